@@ -0,0 +1,506 @@
+/*
+ * video-control-bench
+ *
+ * Load generator for video-control-rest. Keeps a fixed number of
+ * keep-alive connections busy with a weighted mix of requests and reports
+ * throughput and a log-linear (HDR style) latency histogram.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mongoose.h"
+
+#include <stdint.h>
+#include <time.h>
+
+#define MAX_CONNECTIONS 1024
+
+// Values below HIST_SUB_BUCKETS microseconds are exact, above that each
+// power of two is split into HIST_HALF buckets (under 1.6 % error)
+#define HIST_SUB_BUCKETS 128
+#define HIST_HALF 64
+#define HIST_MAGNITUDES 32
+#define HIST_BUCKETS (HIST_SUB_BUCKETS + HIST_MAGNITUDES * HIST_HALF)
+
+struct histogram
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t max;
+};
+
+enum request_kind
+{
+    KIND_DEVICES,
+    KIND_CONTROL_GET,
+    KIND_CONTROL_SET,
+    KIND_FORMATS,
+    KIND_COUNT
+};
+
+static const char *kind_names[KIND_COUNT] = {"devices", "control", "set", "formats"};
+
+struct request_stats
+{
+    int weight;
+    uint64_t requests;
+    uint64_t errors;
+    struct histogram hist;
+};
+
+struct bench_conn
+{
+    struct mg_connection *c;
+    int kind;
+    int closed;
+    uint64_t sent_us;
+    unsigned int seed;
+};
+
+static const char *s_url = "http://127.0.0.1:8800";
+static const char *s_device = "video0";
+static const char *s_body = "{\"brightness\": 50}";
+static int s_connections = 16;
+static int s_duration = 10;
+static uint64_t s_limit = 0;
+static int s_running = 1;
+static uint64_t s_completed = 0;
+static uint64_t s_connect_errors = 0;
+static struct request_stats s_stats[KIND_COUNT];
+static struct histogram s_hist;
+static struct bench_conn s_conns[MAX_CONNECTIONS];
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int hist_index(uint64_t value)
+{
+    int shift = 0;
+    int index;
+
+    if (value < HIST_SUB_BUCKETS)
+    {
+        return (int)value;
+    }
+    while ((value >> shift) >= HIST_SUB_BUCKETS)
+    {
+        shift++;
+    }
+    index = HIST_SUB_BUCKETS + (shift - 1) * HIST_HALF + (int)((value >> shift) - HIST_HALF);
+
+    return index < HIST_BUCKETS ? index : HIST_BUCKETS - 1;
+}
+
+/*
+ * Highest value that falls into the bucket.
+ */
+static uint64_t hist_value(int index)
+{
+    int shift;
+    uint64_t sub;
+
+    if (index < HIST_SUB_BUCKETS)
+    {
+        return index;
+    }
+    shift = (index - HIST_SUB_BUCKETS) / HIST_HALF + 1;
+    sub = (index - HIST_SUB_BUCKETS) % HIST_HALF + HIST_HALF;
+
+    return ((sub + 1) << shift) - 1;
+}
+
+static void hist_record(struct histogram *hist, uint64_t value)
+{
+    hist->counts[hist_index(value)]++;
+    hist->total++;
+    if (value > hist->max)
+    {
+        hist->max = value;
+    }
+}
+
+static uint64_t hist_percentile(struct histogram *hist, double percentile)
+{
+    uint64_t wanted = (uint64_t)(hist->total * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+    int i;
+
+    if (wanted < 1)
+    {
+        wanted = 1;
+    }
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen >= wanted)
+        {
+            return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+static void print_ms(const char *label, uint64_t us)
+{
+    printf("%s%10.3f ms", label, us / 1000.0);
+}
+
+/*
+ * Percentile spectrum, ticks halve the remaining distance to 100 %.
+ */
+static void hist_print(struct histogram *hist)
+{
+    double percentile = 0;
+    double step = 50;
+    uint64_t value;
+    uint64_t last = (uint64_t)-1;
+
+    printf("\n%14s %12s %12s\n", "Value (ms)", "Percentile", "1/(1-P)");
+    while (percentile < 99.9999)
+    {
+        value = hist_percentile(hist, percentile);
+        if (value != last)
+        {
+            if (percentile < 100)
+            {
+                printf("%14.3f %11.6f%% %12.2f\n", value / 1000.0, percentile, 100.0 / (100.0 - percentile));
+            }
+            last = value;
+        }
+        percentile += step;
+        step /= 2;
+    }
+    printf("%14.3f %11.6f%% %12s\n", hist->max / 1000.0, 100.0, "inf");
+}
+
+static void hist_merge(struct histogram *to, struct histogram *from)
+{
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        to->counts[i] += from->counts[i];
+    }
+    to->total += from->total;
+    if (from->max > to->max)
+    {
+        to->max = from->max;
+    }
+}
+
+static int pick_kind(unsigned int *seed)
+{
+    int total = 0;
+    int pick;
+    int k;
+
+    for (k = 0; k < KIND_COUNT; k++)
+    {
+        total += s_stats[k].weight;
+    }
+    pick = rand_r(seed) % total;
+    for (k = 0; k < KIND_COUNT; k++)
+    {
+        if (pick < s_stats[k].weight)
+        {
+            return k;
+        }
+        pick -= s_stats[k].weight;
+    }
+
+    return KIND_DEVICES;
+}
+
+static void send_request(struct bench_conn *bc)
+{
+    struct mg_connection *c = bc->c;
+
+    bc->kind = pick_kind(&bc->seed);
+    bc->sent_us = now_us();
+
+    switch (bc->kind)
+    {
+    case KIND_DEVICES:
+        mg_printf(c, "GET /devices HTTP/1.1\r\nHost: bench\r\n\r\n");
+        break;
+
+    case KIND_CONTROL_GET:
+        mg_printf(c, "GET /device/control/%s HTTP/1.1\r\nHost: bench\r\n\r\n", s_device);
+        break;
+
+    case KIND_CONTROL_SET:
+        mg_printf(c, "POST /device/control/%s HTTP/1.1\r\nHost: bench\r\n"
+                     "Content-Type: application/json\r\nContent-Length: %d\r\n\r\n%s",
+                  s_device, (int)strlen(s_body), s_body);
+        break;
+
+    case KIND_FORMATS:
+        mg_printf(c, "GET /device/formats/%s HTTP/1.1\r\nHost: bench\r\n\r\n", s_device);
+        break;
+    }
+}
+
+static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+    struct bench_conn *bc = (struct bench_conn *)fn_data;
+
+    if (ev == MG_EV_CONNECT && s_running)
+    {
+        send_request(bc);
+    }
+    else if (ev == MG_EV_HTTP_MSG)
+    {
+        struct mg_http_message *hm = (struct mg_http_message *)ev_data;
+        struct request_stats *stats = &s_stats[bc->kind];
+        int status = atoi(hm->uri.ptr);
+
+        stats->requests++;
+        if (status < 200 || status > 299)
+        {
+            stats->errors++;
+        }
+        hist_record(&stats->hist, now_us() - bc->sent_us);
+        s_completed++;
+
+        if (s_limit && s_completed >= s_limit)
+        {
+            s_running = 0;
+        }
+        if (s_running)
+        {
+            send_request(bc);
+        }
+    }
+    else if (ev == MG_EV_ERROR)
+    {
+        s_connect_errors++;
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        bc->closed = 1;
+    }
+    (void)c;
+}
+
+static int parse_mix(char *mix)
+{
+    char *item;
+    char *weight;
+    int k;
+
+    for (k = 0; k < KIND_COUNT; k++)
+    {
+        s_stats[k].weight = 0;
+    }
+
+    for (item = strtok(mix, ","); item != NULL; item = strtok(NULL, ","))
+    {
+        weight = strchr(item, ':');
+        if (weight)
+        {
+            *weight++ = '\0';
+        }
+        for (k = 0; k < KIND_COUNT; k++)
+        {
+            if (!strcmp(item, kind_names[k]))
+            {
+                s_stats[k].weight = weight ? atoi(weight) : 1;
+                break;
+            }
+        }
+        if (k == KIND_COUNT)
+        {
+            printf("ERROR: Unknown request kind '%s'\n", item);
+            return -1;
+        }
+    }
+
+    for (k = 0; k < KIND_COUNT; k++)
+    {
+        if (s_stats[k].weight > 0)
+        {
+            return 0;
+        }
+    }
+    printf("ERROR: Empty request mix\n");
+    return -1;
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv0);
+    fprintf(stderr, "Available options are\n");
+    fprintf(stderr, " -b body         POST body for 'set' requests (default %s)\n", s_body);
+    fprintf(stderr, " -c connections  Number of concurrent connections (1 .. %d, default %d)\n", MAX_CONNECTIONS, s_connections);
+    fprintf(stderr, " -D device       Device name (default %s)\n", s_device);
+    fprintf(stderr, " -d seconds      Duration of the run (default %d)\n", s_duration);
+    fprintf(stderr, " -h              Print this help screen and exit\n");
+    fprintf(stderr, " -m mix          Request mix kind:weight,... (devices, control, set, formats)\n");
+    fprintf(stderr, "                 default devices:1,control:4,set:2,formats:1\n");
+    fprintf(stderr, " -n requests     Stop after number of requests\n");
+    fprintf(stderr, " -u url          Server url (default %s)\n", s_url);
+}
+
+int main(int argc, char *argv[])
+{
+    struct mg_mgr mgr;
+    struct histogram *hist;
+    uint64_t start;
+    uint64_t end;
+    uint64_t errors = 0;
+    double elapsed;
+    char default_mix[] = "devices:1,control:4,set:2,formats:1";
+    int opt;
+    int i;
+    int k;
+
+    if (parse_mix(default_mix) < 0)
+    {
+        return 1;
+    }
+
+    while ((opt = getopt(argc, argv, "b:c:D:d:hm:n:u:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b':
+            s_body = optarg;
+            break;
+
+        case 'c':
+            s_connections = atoi(optarg);
+            if (s_connections < 1 || s_connections > MAX_CONNECTIONS)
+            {
+                printf("ERROR: Invalid number of connections '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'D':
+            s_device = optarg;
+            break;
+
+        case 'd':
+            s_duration = atoi(optarg);
+            break;
+
+        case 'm':
+            if (parse_mix(optarg) < 0)
+            {
+                return 1;
+            }
+            break;
+
+        case 'n':
+            s_limit = strtoull(optarg, NULL, 10);
+            break;
+
+        case 'u':
+            s_url = optarg;
+            break;
+
+        case 'h':
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    printf("Running %d s against %s, %d connections, mix", s_duration, s_url, s_connections);
+    for (k = 0; k < KIND_COUNT; k++)
+    {
+        printf(" %s:%d", kind_names[k], s_stats[k].weight);
+    }
+    printf("\n");
+
+    mg_mgr_init(&mgr);
+
+    start = now_us();
+    end = start + (uint64_t)s_duration * 1000000;
+
+    for (i = 0; i < s_connections; i++)
+    {
+        s_conns[i].seed = i + 1;
+        s_conns[i].closed = 1;
+    }
+
+    while (s_running)
+    {
+        // (Re)connect, the server may close connections on errors
+        for (i = 0; i < s_connections; i++)
+        {
+            if (s_conns[i].closed)
+            {
+                s_conns[i].closed = 0;
+                s_conns[i].c = mg_http_connect(&mgr, s_url, fn, &s_conns[i]);
+                if (s_conns[i].c == NULL)
+                {
+                    printf("ERROR: Can't connect to %s\n", s_url);
+                    mg_mgr_free(&mgr);
+                    return 1;
+                }
+            }
+        }
+
+        mg_mgr_poll(&mgr, 10);
+
+        if (s_duration > 0 && now_us() >= end)
+        {
+            s_running = 0;
+        }
+    }
+    elapsed = (now_us() - start) / 1000000.0;
+    mg_mgr_free(&mgr);
+
+    printf("\n%-10s %12s %10s %14s %14s %14s\n", "Request", "Count", "Errors", "p50", "p99", "max");
+    for (k = 0; k < KIND_COUNT; k++)
+    {
+        hist = &s_stats[k].hist;
+        if (!s_stats[k].requests)
+        {
+            continue;
+        }
+        printf("%-10s %12llu %10llu", kind_names[k],
+               (unsigned long long)s_stats[k].requests,
+               (unsigned long long)s_stats[k].errors);
+        print_ms(" ", hist_percentile(hist, 50));
+        print_ms(" ", hist_percentile(hist, 99));
+        print_ms(" ", hist->max);
+        printf("\n");
+        hist_merge(&s_hist, hist);
+        errors += s_stats[k].errors;
+    }
+
+    hist_print(&s_hist);
+
+    printf("\nRequests:        %llu in %.2f s\n", (unsigned long long)s_completed, elapsed);
+    printf("Throughput:      %.1f requests/s\n", s_completed / elapsed);
+    printf("Non-2xx replies: %llu\n", (unsigned long long)errors);
+    printf("Connect errors:  %llu\n", (unsigned long long)s_connect_errors);
+    if (s_hist.total)
+    {
+        print_ms("Latency p50:  ", hist_percentile(&s_hist, 50));
+        print_ms("\nLatency p99:  ", hist_percentile(&s_hist, 99));
+        print_ms("\nLatency p99.9:", hist_percentile(&s_hist, 99.9));
+        printf("\n");
+    }
+
+    return 0;
+}
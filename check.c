@@ -0,0 +1,423 @@
+/*
+ * video-control-check
+ *
+ * Functional checks against a running video-control-rest that serves the
+ * built-in simulated devices (-M default) and publishes the checked device
+ * to shared memory (-s). Every check prints one line, the exit status is
+ * the number of failed checks.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "mongoose.h"
+#include "mjson.h"
+#include "frame_shm.h"
+
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define TIMEOUT_MS 3000
+// Frames sent at once on one WebSocket, all but the last are coalesced
+#define BURST_SETS 10
+
+struct reply
+{
+    int done;
+    int status;
+    char etag[64];
+    char *body; // heap, released with reply_free()
+    int len;
+};
+
+struct ws_burst
+{
+    int opened;
+    int replies;
+    int coalesced;
+    int closed;
+    char last[256];
+};
+
+static const char *s_url = "http://127.0.0.1:8800";
+static const char *s_device = "video0";
+static int s_failed = 0;
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void check(int ok, const char *what)
+{
+    printf("%-4s %s\n", ok ? "ok" : "FAIL", what);
+    if (!ok)
+    {
+        s_failed++;
+    }
+}
+
+static void poll_until(struct mg_mgr *mgr, int *done)
+{
+    uint64_t end = now_ms() + TIMEOUT_MS;
+
+    while (!*done && now_ms() < end)
+    {
+        mg_mgr_poll(mgr, 10);
+    }
+}
+
+static void http_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+    struct reply *reply = (struct reply *)fn_data;
+
+    if (ev == MG_EV_HTTP_MSG)
+    {
+        struct mg_http_message *hm = (struct mg_http_message *)ev_data;
+        struct mg_str *etag = mg_http_get_header(hm, "ETag");
+
+        reply->status = atoi(hm->uri.ptr);
+        if (etag)
+        {
+            snprintf(reply->etag, sizeof(reply->etag), "%.*s", (int)etag->len, etag->ptr);
+        }
+        reply->body = malloc(hm->body.len + 1);
+        if (reply->body)
+        {
+            reply->len = (int)hm->body.len;
+            memcpy(reply->body, hm->body.ptr, hm->body.len);
+            reply->body[reply->len] = '\0';
+        }
+        reply->done = 1;
+        c->is_closing = 1;
+    }
+    else if (ev == MG_EV_ERROR || ev == MG_EV_CLOSE)
+    {
+        reply->done = 1;
+    }
+}
+
+static void reply_free(struct reply *reply)
+{
+    free(reply->body);
+    memset(reply, 0, sizeof(struct reply));
+}
+
+/*
+ * One request on a connection of its own, 0 on timeout or connect errors.
+ * The previous reply is released.
+ */
+static int http_request(const char *method, const char *uri, const char *headers, const char *body, struct reply *reply)
+{
+    struct mg_mgr mgr;
+    struct mg_connection *c;
+
+    reply_free(reply);
+    mg_mgr_init(&mgr);
+    c = mg_http_connect(&mgr, s_url, http_fn, reply);
+    if (c)
+    {
+        mg_printf(c, "%s %s HTTP/1.1\r\nHost: check\r\n%sContent-Length: %d\r\n\r\n%s",
+                  method, uri, headers ? headers : "", body ? (int)strlen(body) : 0, body ? body : "");
+        poll_until(&mgr, &reply->done);
+    }
+    mg_mgr_free(&mgr);
+
+    return reply->status;
+}
+
+static int control_set(const char *body, struct reply *reply)
+{
+    char uri[128];
+
+    snprintf(uri, sizeof(uri), "/device/control/%s", s_device);
+    return http_request("POST", uri, "Content-Type: application/json\r\n", body, reply);
+}
+
+// Current value of a control, -1000000 if it can't be read
+static int control_value(const char *name)
+{
+    struct reply reply;
+    char uri[192];
+    char path[160];
+    char value[32];
+
+    snprintf(uri, sizeof(uri), "/device/control/%s/%s", s_device, name);
+    snprintf(path, sizeof(path), "$.%s.value", name);
+    memset(&reply, 0, sizeof(reply));
+    if (http_request("GET", uri, NULL, NULL, &reply) != 200 || !reply.body ||
+        mjson_get_string(reply.body, reply.len, path, value, sizeof(value)) < 0)
+    {
+        reply_free(&reply);
+        return -1000000;
+    }
+    reply_free(&reply);
+
+    return atoi(value);
+}
+
+// Calls of one ioctl on the device so far, from /metrics
+static long ioctl_count(const char *ioctl)
+{
+    struct reply reply;
+    char series[192];
+    char *p;
+    long count;
+
+    memset(&reply, 0, sizeof(reply));
+    snprintf(series, sizeof(series), "video_control_ioctl_duration_seconds_count{device=\"%s\",ioctl=\"%s\"} ",
+             s_device, ioctl);
+    if (http_request("GET", "/metrics", NULL, NULL, &reply) != 200 || !reply.body)
+    {
+        reply_free(&reply);
+        return -1;
+    }
+    p = strstr(reply.body, series);
+    count = p ? strtol(p + strlen(series), NULL, 10) : 0;
+    reply_free(&reply);
+
+    return count;
+}
+
+static void check_control_roundtrip(void)
+{
+    struct reply reply;
+    double value = 0;
+
+    memset(&reply, 0, sizeof(reply));
+    control_set("{\"brightness\": 10}", &reply);
+    check(reply.status == 200 && mjson_get_number(reply.body, reply.len, "$.brightness", &value) && value == 10,
+          "control set replies with the applied value");
+    check(control_value("brightness") == 10, "control get returns the written value");
+
+    // Pan moves in steps of 3600, the driver rounds to the nearest one
+    control_set("{\"pan_absolute\": 5000}", &reply);
+    check(reply.status == 200 && mjson_get_number(reply.body, reply.len, "$.pan_absolute", &value) && value == 3600,
+          "control set replies with the value rounded to the step");
+    check(control_value("pan_absolute") == 3600, "control get returns the rounded value");
+
+    control_set("{\"brightness\": 0, \"pan_absolute\": 0}", &reply);
+    reply_free(&reply);
+}
+
+static void check_atomic_rollback(void)
+{
+    struct reply reply;
+    char error[64];
+
+    memset(&reply, 0, sizeof(reply));
+    // "exposure_auto" 2 is an empty menu item, the driver rejects the batch
+    control_set("{\"atomic\": true, \"brightness\": 20, \"exposure_auto\": 2}", &reply);
+    check(reply.status == 200 &&
+              mjson_get_string(reply.body, reply.len, "$.brightness", error, sizeof(error)) > 0 &&
+              !strcmp(error, "Error: Not applied"),
+          "atomic set reports the valid control as not applied");
+    reply_free(&reply);
+    check(control_value("brightness") == 0, "atomic set leaves the valid control unchanged");
+}
+
+static void ws_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+    struct ws_burst *burst = (struct ws_burst *)fn_data;
+    char frame[128];
+    int i;
+
+    if (ev == MG_EV_WS_OPEN)
+    {
+        // A get first keeps the worker busy while the sets queue up
+        snprintf(frame, sizeof(frame), "{\"id\": 0, \"method\": \"get\", \"params\": {}}");
+        mg_ws_send(c, frame, strlen(frame), WEBSOCKET_OP_TEXT);
+        for (i = 1; i <= BURST_SETS; i++)
+        {
+            snprintf(frame, sizeof(frame), "{\"id\": %d, \"method\": \"set\", \"params\": {\"brightness\": %d}}", i, i);
+            mg_ws_send(c, frame, strlen(frame), WEBSOCKET_OP_TEXT);
+        }
+        burst->opened = 1;
+    }
+    else if (ev == MG_EV_WS_MSG)
+    {
+        struct mg_ws_message *wm = (struct mg_ws_message *)ev_data;
+
+        if (mg_strstr(wm->data, mg_str("\"Coalesced\"")))
+        {
+            burst->coalesced++;
+        }
+        snprintf(burst->last, sizeof(burst->last), "%.*s", (int)wm->data.len, wm->data.ptr);
+        if (++burst->replies == BURST_SETS + 1)
+        {
+            c->is_closing = 1;
+        }
+    }
+    else if (ev == MG_EV_ERROR || ev == MG_EV_CLOSE)
+    {
+        burst->closed = 1;
+    }
+}
+
+static void check_coalescing(void)
+{
+    struct mg_mgr mgr;
+    struct ws_burst burst;
+    struct reply reply;
+    char url[256];
+    double value = 0;
+    long before = ioctl_count("S_EXT_CTRLS");
+    long after;
+
+    memset(&burst, 0, sizeof(burst));
+    memset(&reply, 0, sizeof(reply));
+    snprintf(url, sizeof(url), "%s/device/ws/%s", s_url, s_device);
+    mg_mgr_init(&mgr);
+    if (mg_ws_connect(&mgr, url, ws_fn, &burst, NULL))
+    {
+        poll_until(&mgr, &burst.closed);
+    }
+    mg_mgr_free(&mgr);
+    after = ioctl_count("S_EXT_CTRLS");
+
+    check(burst.replies == BURST_SETS + 1, "every WebSocket frame gets a reply");
+    check(burst.coalesced == BURST_SETS - 1, "queued writes of the same control are coalesced");
+    check(mjson_get_number(burst.last, (int)strlen(burst.last), "$.result.brightness", &value) && value == BURST_SETS,
+          "the last write of a burst wins");
+    check(before >= 0 && after == before + 1, "a burst of writes costs one S_EXT_CTRLS");
+    check(control_value("brightness") == BURST_SETS, "the device has the value of the last write");
+
+    control_set("{\"brightness\": 0}", &reply);
+    reply_free(&reply);
+}
+
+static void check_etag(void)
+{
+    struct reply reply;
+    char uri[128];
+    char headers[128];
+
+    memset(&reply, 0, sizeof(reply));
+    snprintf(uri, sizeof(uri), "/device/formats/%s", s_device);
+    http_request("GET", uri, NULL, NULL, &reply);
+    check(reply.status == 200 && reply.etag[0], "formats carry an ETag");
+
+    snprintf(headers, sizeof(headers), "If-None-Match: %s\r\n", reply.etag);
+    http_request("GET", uri, headers, NULL, &reply);
+    check(reply.status == 304 && !reply.len, "a matching If-None-Match gets 304 Not Modified");
+    reply_free(&reply);
+}
+
+static void check_routes(void)
+{
+    struct reply reply;
+
+    memset(&reply, 0, sizeof(reply));
+    check(http_request("GET", "/no/such/route", NULL, NULL, &reply) == 404, "unknown paths get 404");
+    check(http_request("POST", "/devices", NULL, "", &reply) == 405, "unsupported methods get 405");
+    reply_free(&reply);
+}
+
+static void check_shm(void)
+{
+    const struct frame_shm_header *header = MAP_FAILED;
+    const struct frame_shm_slot *slot = NULL;
+    const unsigned char *data;
+    struct stat st;
+    char name[160];
+    uint32_t seq;
+    uint32_t bytesused = 0;
+    unsigned char soi[2] = {0, 0};
+    uint64_t end = now_ms() + TIMEOUT_MS;
+    int fd;
+
+    snprintf(name, sizeof(name), FRAME_SHM_NAME, s_device);
+    fd = shm_open(name, O_RDONLY, 0);
+    if (fd >= 0 && fstat(fd, &st) == 0)
+    {
+        header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    check(header != MAP_FAILED && header->magic == FRAME_SHM_MAGIC, "shared memory ring can be mapped");
+    if (header == MAP_FAILED)
+    {
+        return;
+    }
+
+    // The first frame may still be on its way
+    while (!slot && now_ms() < end)
+    {
+        do
+        {
+            slot = frame_shm_read_begin(header, &seq);
+            if (slot)
+            {
+                data = frame_shm_data(header, slot);
+                bytesused = slot->bytesused;
+                soi[0] = data[0];
+                soi[1] = data[1];
+            }
+        } while (slot && frame_shm_read_retry(slot, seq));
+        if (!slot)
+        {
+            usleep(10000);
+        }
+    }
+    check(slot && bytesused > 2 && soi[0] == 0xff && soi[1] == 0xd8, "a JPEG frame can be read from the ring");
+    munmap((void *)header, st.st_size);
+}
+
+static void usage(const char *argv0)
+{
+    fprintf(stderr, "Usage: %s [options]\n", argv0);
+    fprintf(stderr, "Available options are\n");
+    fprintf(stderr, " -D device       Device name (default %s)\n", s_device);
+    fprintf(stderr, " -h              Print this help screen and exit\n");
+    fprintf(stderr, " -u url          Server url (default %s)\n", s_url);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "D:hu:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'D':
+            s_device = optarg;
+            break;
+
+        case 'u':
+            s_url = optarg;
+            break;
+
+        case 'h':
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    check_control_roundtrip();
+    check_atomic_rollback();
+    check_coalescing();
+    check_etag();
+    check_routes();
+    check_shm();
+
+    printf("%d checks failed\n", s_failed);
+    return s_failed;
+}
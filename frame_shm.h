@@ -0,0 +1,115 @@
+/*
+ * video-control-rest
+ *
+ * Layout of the shared memory frame ring published with -s, for local
+ * readers. Include this header, map the object read-only and read the
+ * newest frame in place:
+ *
+ *     int fd = shm_open("/video-control-video0", O_RDONLY, 0);
+ *     struct stat st;
+ *     fstat(fd, &st);
+ *     const struct frame_shm_header *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+ *
+ *     const struct frame_shm_slot *slot;
+ *     uint32_t seq;
+ *     do
+ *     {
+ *         slot = frame_shm_read_begin(header, &seq);
+ *         // use frame_shm_data(header, slot), slot->bytesused, slot->width, ...
+ *     } while (slot && frame_shm_read_retry(slot, seq));
+ *
+ * The server writes the slot after the newest one, so a reader has the
+ * time of FRAME_SHM_SLOTS - 1 frames before its slot is reused. A retry
+ * means the frame was overwritten while it was read and the result has to
+ * be thrown away. Once live drops to 0 the object was replaced (the frame
+ * size grew) or the server exited: unmap it and open it again.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef FRAME_SHM_H
+#define FRAME_SHM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FRAME_SHM_MAGIC 0x31534656 // "VFS1"
+#define FRAME_SHM_SLOTS 4
+// shm_open() name, %s is the device name
+#define FRAME_SHM_NAME "/video-control-%s"
+
+struct frame_shm_slot
+{
+    uint32_t seq;          // seqlock, odd while the slot is written
+    uint32_t bytesused;
+    uint64_t frame;        // publication counter, starts at 1
+    uint64_t timestamp_us; // capture time, CLOCK_MONOTONIC
+    uint32_t sequence;     // V4L2 buffer sequence
+    uint32_t pixelformat;  // V4L2 fourcc
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytesperline; // 0 for compressed formats
+    uint32_t reserved;
+    uint64_t offset;       // of the frame data from the start of the mapping
+};
+
+struct frame_shm_header
+{
+    uint32_t magic;
+    uint32_t live;
+    uint64_t size;      // of the whole object
+    uint32_t slots_count;
+    uint32_t slot_size; // room for frame data in each slot
+    uint64_t latest;    // frame counter of the newest complete slot, 0 = none yet
+    struct frame_shm_slot slots[FRAME_SHM_SLOTS];
+};
+
+/*
+ * Returns the slot of the newest frame and its seqlock value, NULL until
+ * the first frame is published.
+ */
+static inline const struct frame_shm_slot *frame_shm_read_begin(const struct frame_shm_header *header, uint32_t *seq)
+{
+    const struct frame_shm_slot *slot;
+    uint64_t latest;
+
+    for (;;)
+    {
+        latest = __atomic_load_n(&header->latest, __ATOMIC_ACQUIRE);
+        if (!latest)
+        {
+            return NULL;
+        }
+        slot = &header->slots[latest % FRAME_SHM_SLOTS];
+        *seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (!(*seq & 1))
+        {
+            return slot;
+        }
+    }
+}
+
+// Non zero if the slot changed since frame_shm_read_begin()
+static inline int frame_shm_read_retry(const struct frame_shm_slot *slot, uint32_t seq)
+{
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static inline const unsigned char *frame_shm_data(const struct frame_shm_header *header, const struct frame_shm_slot *slot)
+{
+    return (const unsigned char *)header + slot->offset;
+}
+
+#endif
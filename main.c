@@ -20,44 +20,132 @@
 
 #include "mongoose.h"
 #include "mjson.h"
+#include "v4l2_mock.h"
+#include "frame_shm.h"
 
 #include <ctype.h>
 #include <errno.h>
 #include <time.h>
 #include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <linux/videodev2.h>
+#if ENABLE_ZLIB
+#include <zlib.h>
+#else
+typedef int z_stream;
+#endif
 
 static int debug_enabled = 0;
-static char *getFormattedTime(void);
 
-#define pixfmtstr(x) (x) & 0xff, ((x) >> 8) & 0xff, ((x) >> 16) & 0xff, ((x) >> 24) & 0xff
+#define LOG_MESSAGE_SIZE 232
+#define LOG_RING_SIZE 256
+#define LOG_FLUSH_INTERVAL_MS 20
 
-#define __LOG__(format, loglevel, ...) printf("%s %-5s " format "\n", getFormattedTime(), loglevel, ##__VA_ARGS__)
+enum log_level
+{
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_ERROR
+};
 
-#define LOGDEBUG(format, ...)                    \
-    if (debug_enabled)                           \
-    {                                            \
-        __LOG__(format, "DEBUG", ##__VA_ARGS__); \
-    }
-#define LOGWARN(format, ...) __LOG__(format, "WARN", ##__VA_ARGS__)
-#define LOGERROR(format, ...) __LOG__(format, "ERROR", ##__VA_ARGS__)
-#define LOGINFO(format, ...) __LOG__(format, "INFO", ##__VA_ARGS__)
+/*
+ * Rate limit state of one LOG* call site in one thread.
+ */
+struct log_site
+{
+    time_t second;
+    int count;
+    int suppressed;
+};
+
+static void log_write(struct log_site *site, int level, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define __LOG__(format, loglevel, ...)                                  \
+    do                                                                  \
+    {                                                                   \
+        static __thread struct log_site _log_site;                      \
+        log_write(&_log_site, loglevel, format, ##__VA_ARGS__);         \
+    } while (0)
+
+#define LOGDEBUG(format, ...)                                \
+    do                                                       \
+    {                                                        \
+        if (debug_enabled)                                   \
+        {                                                    \
+            __LOG__(format, LOG_LEVEL_DEBUG, ##__VA_ARGS__); \
+        }                                                    \
+    } while (0)
+#define LOGWARN(format, ...) __LOG__(format, LOG_LEVEL_WARN, ##__VA_ARGS__)
+#define LOGERROR(format, ...) __LOG__(format, LOG_LEVEL_ERROR, ##__VA_ARGS__)
+#define LOGINFO(format, ...) __LOG__(format, LOG_LEVEL_INFO, ##__VA_ARGS__)
 
 #define URL_DEVICES "/devices"
-#define URL_DEVICE_FORMATS "/device/formats/*"
-#define URL_DEVICE_FORMAT "/device/format/*"
-#define URL_DEVICE_CONTROL "/device/control/*"
-
-#define FORMAT_CONTROL_VALUE "\"%s\": %d"
-#define FORMAT_CONTROL_STRING "\"%s\": \"%s\""
-#define FORMAT_DISCRETE "\"%c%c%c%c\": { \"type\": \"DISCRETE\", \"width\": \"%d\", \"height\": \"%d\" }"
-#define FORMAT_STEPWISE "\"%c%c%c%c\": { \"type\": \"STEPWISE\", \"min_width\": \"%d\", \"min_height\": \"%d\", \"max_width\": \"%d\", \"max_height\": \"%d\", \"step_width\": \"%d\", \"step_height\": \"%d\" }"
-#define FORMAT_DEVICE_CAPABILITIES "\"%s\": { \"driver\": \"%s\", \"card\": \"%s\", \"bus_info\": \"%s\", \"version\": \"%d\", \"capabilities\": [ %.*s ] }\n"
-#define FORMAT_CONTROL "\"%s\": { \"minimum\": \"%d\", \"maximum\": \"%d\", \"default\": \"%d\", \"step\": \"%d\", \"value\": \"%d\", \"menu\": { "
-#define FORMAT_PIX_FORMAT "\"pix\": { \"width\": \"%d\", \"height\": \"%d\", \"pixelformat\": \"%c%c%c%c\", \"field\": \"%s\", \"bytesperline\": \"%d\", \"sizeimage\": \"%d\", \"colorspace\": \"%s\", \"priv\": \"%d\", \"flags\": \"%d\" }"
-
-static int s_signo;
+#define URL_METRICS "/metrics"
+#define URL_DEVICE_FORMATS "/device/formats/{device}"
+#define URL_DEVICE_FORMAT "/device/format/{device}"
+#define URL_DEVICE_MODES "/device/modes/{device}"
+#define URL_DEVICE_EVENTS "/device/events/{device}"
+#define URL_DEVICE_WS "/device/ws/{device}"
+#define URL_DEVICE_CONTROL "/device/control/{device}"
+#define URL_DEVICE_CONTROL_ITEM "/device/control/{device}/{control}"
+#define URL_DEVICE_SNAPSHOT "/device/snapshot/{device}"
+#define URL_DEVICE_STREAM "/device/stream/{device}"
+
+#define HEADERS_JSON "Content-Type: application/json\r\n"
+#define HEADERS_METRICS "Content-Type: text/plain; version=0.0.4\r\n"
+#define HEADERS_JPEG "Content-Type: image/jpeg\r\nCache-Control: no-store\r\n"
+#define HEADERS_PGM "Content-Type: image/x-portable-graymap\r\nCache-Control: no-store\r\n"
+#define HEADERS_PPM "Content-Type: image/x-portable-pixmap\r\nCache-Control: no-store\r\n"
+#define HEADERS_STREAM "Content-Type: multipart/x-mixed-replace; boundary=" STREAM_BOUNDARY "\r\nCache-Control: no-store\r\n"
+#define STREAM_BOUNDARY "frame"
+
+/* Formats for out_printf() (mjson_printf), %Q prints an escaped JSON string */
+#define FORMAT_CONTROL_VALUE "%Q: %s" // value from control_value(), mjson has no %lld
+#define FORMAT_CONTROL_STRING "%Q: %Q"
+#define FORMAT_DISCRETE "%Q: { \"type\": \"DISCRETE\", \"width\": \"%d\", \"height\": \"%d\""
+#define FORMAT_STEPWISE "%Q: { \"type\": %Q, \"min_width\": \"%d\", \"min_height\": \"%d\", \"max_width\": \"%d\", \"max_height\": \"%d\", \"step_width\": \"%d\", \"step_height\": \"%d\""
+#define FORMAT_INTERVAL_STEPWISE ", \"intervals\": { \"type\": %Q, \"min\": \"%u/%u\", \"max\": \"%u/%u\", \"step\": \"%u/%u\" }"
+#define FORMAT_MODE "{ \"buffer_type\": %Q, \"format\": %Q, \"width\": \"%u\", \"height\": \"%u\", \"interval\": \"%u/%u\", \"fps\": \"%g\", \"matches\": \"%d\" }\n"
+#define FORMAT_DEVICE_CAPABILITIES "%Q: { \"driver\": %Q, \"card\": %Q, \"bus_info\": %Q, \"version\": \"%d\", \"capabilities\": [ "
+#define FORMAT_CONTROL "%Q: { \"minimum\": \"%d\", \"maximum\": \"%d\", \"default\": \"%d\", \"step\": \"%d\", \"value\": \"%d\", \"menu\": { "
+#define FORMAT_MENU_ITEM "\"%d\": %Q"
+#define FORMAT_PIX_FORMAT "\"pix\": { \"width\": \"%d\", \"height\": \"%d\", \"pixelformat\": %Q, \"field\": %Q, \"bytesperline\": \"%d\", \"sizeimage\": \"%d\", \"colorspace\": %Q, \"priv\": \"%d\", \"flags\": \"%d\" }"
+
+#define MAX_THREADS 64
+#define MAX_DEVICE_WORKERS 64
+#define MAX_MENU_ITEMS 256
+#define MAX_SET_CONTROLS 256
+#define MAX_REPLY_SIZE (4 * 1024 * 1024)
+#define REPLY_CHUNK_SIZE (16 * 1024)
+#define CONN_ARENA_SIZE (4 * 1024)
+#define DEVICE_NAME_SIZE 128
+#define CONTROL_NAME_SIZE 128
+#define PEER_NAME_SIZE 64
+#define CONTROL_VALUE_SIZE 24 // "-9223372036854775808"
+#define LOOP_CONN_BUCKETS 1024
+#define DEVICE_IDLE_TIMEOUT 30
+#define ETAG_SIZE 24
+#define COMPRESS_MIN_SIZE 1024
+#define REPLY_HEADERS_SIZE 256
+#define COMPRESS_LEVEL 6
+#define METRIC_BUCKETS 24
+#define IOCTL_METRICS 22
+#define SNAPSHOT_TIMEOUT_MS 3000
+#define STREAM_BUFFERS 4
+#define STREAM_RETRY_MS 1000
+#define ROUTE_MAX_NODES 256
+#define ROUTE_COUNT 11
+#define ROUTE_METRICS (ROUTE_COUNT + 1)
+#define METHOD_METRICS 3
+#define JSONRPC_ERROR_INVALID_REQUEST -32600 // missing in mjson.h
+
+static volatile sig_atomic_t s_signo;
 static void signal_handler(int signo)
 {
     s_signo = signo;
@@ -66,11 +154,27 @@ static void signal_handler(int signo)
 static char *listen_port = "8800";
 static char *listen_ip = "0.0.0.0";
 static char s_listen_on[128] = {'\0'};
+static int s_threads = 1;
+static int s_device_idle = DEVICE_IDLE_TIMEOUT;
 
 enum http_methods
 {
-    METHOD_GET = 1,
-    METHOD_POST
+    METHOD_GET,
+    METHOD_POST,
+    METHOD_OTHER
+};
+
+/* Path parameters of a route, see route_match() */
+enum route_param_type
+{
+    PARAM_DEVICE,
+    PARAM_CONTROL,
+    PARAM_COUNT
+};
+
+struct route_params
+{
+    struct mg_str values[PARAM_COUNT];
 };
 
 struct enum_names
@@ -158,19 +262,328 @@ struct enum_names v4l2_colorspace_names[13] = {
     {V4L2_COLORSPACE_RAW, "RAW"},
     {V4L2_COLORSPACE_DCI_P3, "DCI_P3"}};
 
-static char *getFormattedTime(void)
+/*
+ * Asynchronous logger. Every thread formats its lines into its own ring
+ * buffer (single producer, single consumer, no locks) and a flusher thread
+ * writes them out in sequence order. Only the second is taken per line, the
+ * flusher turns it into local time once per second. Full rings drop lines
+ * instead of blocking the event loops, drops are reported by the flusher.
+ * The ring of an exited thread is freed by the flusher once it is empty.
+ */
+struct log_record
+{
+    unsigned long long seq;
+    time_t time;
+    int level;
+    int len;
+    char message[LOG_MESSAGE_SIZE];
+};
+
+struct log_ring
+{
+    struct log_ring *next;
+    int thread;
+    unsigned int head; // Next record to flush, written by the flusher
+    unsigned int tail; // Next free record, written by the owning thread
+    unsigned long long dropped;
+    int exited; // Set by the owning thread on exit
+    struct log_record records[LOG_RING_SIZE];
+};
+
+// Time stamp of the last line, formatted once per second per writer
+struct log_stamp
+{
+    time_t time;
+    char text[32];
+};
+
+static const char *s_log_levels[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+static struct log_ring *s_log_rings = NULL;
+static int s_log_threads = 0;
+static pthread_mutex_t s_log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t s_log_flusher;
+static int s_log_running = 0;
+static int s_log_stop = 0;
+static int s_log_json = 0;
+static int s_log_rate = 0;
+static unsigned long long s_log_seq = 0;
+static __thread struct log_ring *s_log_ring;
+static pthread_key_t s_log_key;
+
+static struct log_ring *log_ring_get(void)
+{
+    struct log_ring *ring = s_log_ring;
+
+    if (ring)
+    {
+        return ring;
+    }
+
+    ring = calloc(1, sizeof(struct log_ring));
+    if (!ring)
+    {
+        return NULL;
+    }
+
+    // Registration is the only locked step, once per thread
+    pthread_mutex_lock(&s_log_lock);
+    ring->thread = s_log_threads++;
+    ring->next = s_log_rings;
+    __atomic_store_n(&s_log_rings, ring, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&s_log_lock);
+
+    s_log_ring = ring;
+    pthread_setspecific(s_log_key, ring);
+    return ring;
+}
+
+// Thread exit, the flusher frees the ring after writing what is left
+static void log_ring_release(void *arg)
+{
+    struct log_ring *ring = (struct log_ring *)arg;
+
+    __atomic_store_n(&ring->exited, 1, __ATOMIC_RELEASE);
+}
+
+static void log_print(FILE *fp, struct log_stamp *stamp, time_t time, int level, int thread, const char *message, int len)
+{
+    struct tm tm;
+
+    if (time != stamp->time || !stamp->text[0])
+    {
+        localtime_r(&time, &tm);
+        strftime(stamp->text, sizeof(stamp->text), s_log_json ? "%Y-%m-%dT%H:%M:%S%z" : "%Y-%m-%d %H:%M:%S", &tm);
+        stamp->time = time;
+    }
+
+    if (s_log_json)
+    {
+        mjson_printf(mjson_print_file, fp, "{%Q:%Q,%Q:%Q,%Q:%d,%Q:%.*Q}\n",
+                     "time", stamp->text, "level", s_log_levels[level], "thread", thread, "msg", len, message);
+    }
+    else
+    {
+        fprintf(fp, "%s %-5s %.*s\n", stamp->text, s_log_levels[level], len, message);
+    }
+}
+
+static void log_write(struct log_site *site, int level, const char *fmt, ...)
+{
+    struct log_ring *ring;
+    struct log_record *record = NULL;
+    struct log_stamp stamp;
+    char message[LOG_MESSAGE_SIZE];
+    time_t now = time(NULL);
+    unsigned int tail = 0;
+    int suppressed = 0;
+    int len;
+    va_list ap;
+
+    // Per call site and thread, at most s_log_rate lines per second
+    if (s_log_rate)
+    {
+        if (site->second != now)
+        {
+            suppressed = site->suppressed;
+            site->second = now;
+            site->count = 0;
+            site->suppressed = 0;
+        }
+        if (site->count++ >= s_log_rate)
+        {
+            site->suppressed++;
+            return;
+        }
+    }
+
+    ring = __atomic_load_n(&s_log_running, __ATOMIC_ACQUIRE) ? log_ring_get() : NULL;
+    if (ring)
+    {
+        tail = ring->tail;
+        if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE)
+        {
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        record = &ring->records[tail % LOG_RING_SIZE];
+    }
+
+    va_start(ap, fmt);
+    len = vsnprintf(ring ? record->message : message, LOG_MESSAGE_SIZE, fmt, ap);
+    va_end(ap);
+    len = len < 0 ? 0 : len >= LOG_MESSAGE_SIZE ? LOG_MESSAGE_SIZE - 1 : len;
+
+    if (suppressed)
+    {
+        len += snprintf((ring ? record->message : message) + len, LOG_MESSAGE_SIZE - len,
+                        " (%d similar suppressed)", suppressed);
+        len = len >= LOG_MESSAGE_SIZE ? LOG_MESSAGE_SIZE - 1 : len;
+    }
+
+    if (!ring)
+    {
+        // Before log_start() and after log_stop() lines are written directly
+        memset(&stamp, 0, sizeof(stamp));
+        pthread_mutex_lock(&s_log_lock);
+        log_print(stdout, &stamp, now, level, 0, message, len);
+        fflush(stdout);
+        pthread_mutex_unlock(&s_log_lock);
+        return;
+    }
+
+    record->seq = __atomic_fetch_add(&s_log_seq, 1, __ATOMIC_RELAXED);
+    record->time = now;
+    record->level = level;
+    record->len = len;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Unlinks and frees the drained rings of exited threads. Only the flusher
+ * removes rings, new ones are pushed at the head under the lock.
+ */
+static void log_rings_collect(void)
+{
+    struct log_ring **link;
+    struct log_ring *ring;
+
+    pthread_mutex_lock(&s_log_lock);
+    link = &s_log_rings;
+    while ((ring = *link) != NULL)
+    {
+        if (__atomic_load_n(&ring->exited, __ATOMIC_ACQUIRE) &&
+            ring->head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) &&
+            !__atomic_load_n(&ring->dropped, __ATOMIC_RELAXED))
+        {
+            *link = ring->next;
+            free(ring);
+            continue;
+        }
+        link = &ring->next;
+    }
+    pthread_mutex_unlock(&s_log_lock);
+}
+
+/*
+ * Writes everything queued so far, merging the rings by sequence number.
+ * Returns the number of lines written.
+ */
+static int log_flush(struct log_stamp *stamp)
+{
+    struct log_ring *rings = __atomic_load_n(&s_log_rings, __ATOMIC_ACQUIRE);
+    struct log_ring *ring;
+    struct log_ring *next;
+    struct log_record *record;
+    unsigned long long dropped;
+    int count = 0;
+
+    for (;;)
+    {
+        next = NULL;
+        for (ring = rings; ring != NULL; ring = ring->next)
+        {
+            if (ring->head != __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) &&
+                (!next || ring->records[ring->head % LOG_RING_SIZE].seq < next->records[next->head % LOG_RING_SIZE].seq))
+            {
+                next = ring;
+            }
+        }
+        if (!next)
+        {
+            break;
+        }
+
+        record = &next->records[next->head % LOG_RING_SIZE];
+        log_print(stdout, stamp, record->time, record->level, next->thread, record->message, record->len);
+        __atomic_store_n(&next->head, next->head + 1, __ATOMIC_RELEASE);
+        count++;
+    }
+
+    for (ring = rings; ring != NULL; ring = ring->next)
+    {
+        dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+        if (dropped)
+        {
+            char message[64];
+            int len = snprintf(message, sizeof(message), "Log buffer full, %llu lines dropped", dropped);
+            log_print(stdout, stamp, time(NULL), LOG_LEVEL_WARN, ring->thread, message, len);
+            count++;
+        }
+    }
+
+    if (count)
+    {
+        fflush(stdout);
+    }
+
+    return count;
+}
+
+static void *log_flusher_thread(void *arg)
+{
+    struct timespec idle = {0, LOG_FLUSH_INTERVAL_MS * 1000000L};
+    struct log_stamp stamp;
+
+    (void)arg;
+
+    memset(&stamp, 0, sizeof(stamp));
+    while (!__atomic_load_n(&s_log_stop, __ATOMIC_ACQUIRE))
+    {
+        if (!log_flush(&stamp))
+        {
+            log_rings_collect();
+            nanosleep(&idle, NULL);
+        }
+    }
+    log_flush(&stamp);
+
+    return NULL;
+}
+
+static void log_start(int json, int rate)
 {
+    s_log_json = json;
+    s_log_rate = rate;
+
+    if (pthread_key_create(&s_log_key, log_ring_release) != 0)
+    {
+        return;
+    }
+    if (pthread_create(&s_log_flusher, NULL, log_flusher_thread, NULL) == 0)
+    {
+        __atomic_store_n(&s_log_running, 1, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        pthread_key_delete(s_log_key);
+    }
+}
 
-    time_t rawtime;
-    struct tm *timeinfo;
+/*
+ * Called after all other threads are gone, writes the rest and frees the
+ * rings.
+ */
+static void log_stop(void)
+{
+    struct log_ring *ring;
 
-    time(&rawtime);
-    timeinfo = localtime(&rawtime);
+    if (!s_log_running)
+    {
+        return;
+    }
 
-    static char _retval[20];
-    strftime(_retval, sizeof(_retval), "%Y-%m-%d %H:%M:%S", timeinfo);
+    __atomic_store_n(&s_log_running, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&s_log_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(s_log_flusher, NULL);
+    pthread_key_delete(s_log_key);
 
-    return _retval;
+    while ((ring = s_log_rings))
+    {
+        s_log_rings = ring->next;
+        free(ring);
+    }
+    s_log_ring = NULL;
 }
 
 int digits_only(const char *s)
@@ -217,597 +630,5802 @@ static char *name2var(char *name)
     return strdup((const char *)out_name);
 }
 
-static void device_list(struct mg_connection *con)
+/*
+ * Growable reply buffer. Appends are amortized O(1) and the size is bounded
+ * by MAX_REPLY_SIZE, after that the buffer is marked as overflowed.
+ */
+struct out_buf
 {
-    int fd;
-    struct dirent *ep;
-    struct v4l2_capability cap;
-    char path[80];
-    char device[1024] = {'\0'};
-    char devices[8096] = {'\0'};
-    char capabilities[1024] = {'\0'};
-    int count_capabilities = 0;
-    int count_devices = 0;
-    int c;
+    char *buf;
+    size_t len;
+    size_t size;
+    int overflow;
+    int borrowed; // buf belongs to a connection arena, copied to the heap on growth
+};
 
-    strcat(devices, "{ ");
+static int out_print(const char *ptr, int len, void *fndata)
+{
+    struct out_buf *out = (struct out_buf *)fndata;
+    size_t size = out->size ? out->size : 1024;
+    char *buf;
 
-    DIR *dp = opendir("/dev");
+    if (out->overflow)
+    {
+        return 0;
+    }
 
-    if (dp != NULL)
+    while (size < out->len + len + 1)
     {
-        while ((ep = readdir(dp)))
+        size *= 2;
+    }
+
+    if (size != out->size)
+    {
+        if (size > MAX_REPLY_SIZE || (buf = realloc(out->borrowed ? NULL : out->buf, size)) == NULL)
         {
-            if (strncmp(ep->d_name, "video", 5))
-            {
-                continue;
-            }
-            strcpy(path, "/dev/");
-            strcat(path, ep->d_name);
+            out->overflow = 1;
+            return 0;
+        }
+        if (out->borrowed)
+        {
+            memcpy(buf, out->buf, out->len);
+            out->borrowed = 0;
+        }
+        out->buf = buf;
+        out->size = size;
+    }
 
-            fd = open(path, O_RDWR | O_NONBLOCK);
-            if (!fd)
-            {
-                continue;
-            }
+    memcpy(out->buf + out->len, ptr, len);
+    out->len += len;
+    out->buf[out->len] = '\0';
 
-            device[0] = '\0';
-            capabilities[0] = '\0';
-            count_capabilities = 0;
+    return len;
+}
 
-            if (ioctl(fd, VIDIOC_QUERYCAP, &cap) > -1)
-            {
-                for (c = 0; c < 23; c++)
-                {
-                    if ((cap.capabilities & v4l2_capability_names[c].bitmask))
-                    {
-                        if (count_capabilities)
-                        {
-                            strcat(capabilities, ",");
-                        }
-                        strcat(capabilities, "\"");
-                        strcat(capabilities, v4l2_capability_names[c].name);
-                        strcat(capabilities, "\"");
-                        count_capabilities++;
-                    }
-                }
-                sprintf(device, FORMAT_DEVICE_CAPABILITIES,
-                        ep->d_name,
-                        cap.driver,
-                        cap.card,
-                        cap.bus_info,
-                        cap.version,
-                        strlen(capabilities), capabilities);
-
-                if (count_devices)
-                {
-                    strcat(devices, ",");
-                }
-                strcat(devices, device);
-                count_devices++;
-            }
-            close(fd);
-        }
-        closedir(dp);
+static int out_printf(struct out_buf *out, const char *fmt, ...)
+{
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = mjson_vprintf(out_print, out, fmt, ap);
+    va_end(ap);
+
+    return len;
+}
+
+static void out_free(struct out_buf *out)
+{
+    if (!out->borrowed)
+    {
+        free(out->buf);
     }
-    strcat(devices, " }\n");
-    mg_http_reply(con, 200, "Content-Type: application/json\r\n", devices);
+    memset(out, 0, sizeof(struct out_buf));
 }
 
-static int device_open(char *device_name)
+/*
+ * Per-connection context in c->fn_data, allocated on MG_EV_ACCEPT. Scratch
+ * memory of a request (peer address, the start of replies built on the
+ * event loop) comes from a bump arena that is reset for every request, so
+ * events cost no allocations. The context also links the connection into
+ * its loop's id table, where reply parts find it.
+ */
+struct http_conn
 {
-    char path[256];
-    if (strncmp(device_name, "video", 5))
+    struct mg_connection *c;
+    struct http_conn *next;
+    size_t used;
+    char arena[CONN_ARENA_SIZE];
+};
+
+static void *conn_alloc(struct http_conn *conn, size_t size)
+{
+    size_t start = (conn->used + 7) & ~(size_t)7;
+
+    if (start + size > sizeof(conn->arena))
     {
-        return -ENODEV;
+        return NULL;
     }
-    strcpy(path, "/dev/");
-    strcat(path, device_name);
+    conn->used = start + size;
 
-    return open(path, O_RDWR | O_NONBLOCK);
+    return conn->arena + start;
 }
 
-static void device_control_get(struct mg_connection *con,
-                               char *device_name)
+/*
+ * Reply buffer starting in the rest of the arena, out_print() moves it to
+ * the heap if it grows larger.
+ */
+static void conn_out(struct mg_connection *c, struct out_buf *out)
 {
-    struct v4l2_control ctrl;
-    struct v4l2_queryctrl queryctrl;
-    struct v4l2_querymenu querymenu;
-    char append[1024] = {'\0'};
-    char control[1024] = {'\0'};
-    char controls[65536] = {'\0'};
-    char flags[2048] = {'\0'};
-    char menu[2048] = {'\0'};
-    char *var_name;
-    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
-    int c;
-    int controls_count = 0;
-    int count_flags = 0;
-    int menu_count = 0;
-    int menu_index = 0;
-    int fd = device_open(device_name);
+    struct http_conn *conn = (struct http_conn *)c->fn_data;
+    size_t size = conn ? (sizeof(conn->arena) - conn->used) & ~(size_t)7 : 0;
 
-    if (!fd)
+    memset(out, 0, sizeof(struct out_buf));
+    if (size >= 256 && (out->buf = conn_alloc(conn, size)) != NULL)
     {
-        mg_http_reply(con, 400, "", "Device can't be opened.");
-        return;
+        out->size = size;
+        out->borrowed = 1;
     }
+}
 
-    memset(&queryctrl, 0, sizeof(struct v4l2_queryctrl));
-    memset(&querymenu, 0, sizeof(struct v4l2_querymenu));
-    memset(&ctrl, 0, sizeof(struct v4l2_control));
-    controls[0] = '\0';
-    append[0] = '\0';
+/*
+ * Reply compression. Clients announce gzip / deflate in Accept-Encoding,
+ * replies below COMPRESS_MIN_SIZE are sent as they are. Streamed replies
+ * are compressed chunk by chunk through one z_stream per reply.
+ */
+enum content_encoding
+{
+    ENCODING_IDENTITY,
+    ENCODING_GZIP,
+    ENCODING_DEFLATE,
+    ENCODING_COUNT
+};
 
-    strcat(controls, "{ ");
+static const char *s_encoding_names[ENCODING_COUNT] = {"identity", "gzip", "deflate"};
 
-    queryctrl.id = next_fl;
-    while (ioctl(fd, VIDIOC_QUERYCTRL, &queryctrl) == 0)
-    {
-        count_flags = 0;
-        flags[0] = '\0';
-        control[0] = '\0';
+// Appended to entity tags, each encoding is a different representation
+static const char *s_encoding_etags[ENCODING_COUNT] = {"", "-gz", "-df"};
+
+static int compress_init(z_stream *zs, int encoding)
+{
+#if ENABLE_ZLIB
+    memset(zs, 0, sizeof(z_stream));
+    // windowBits + 16 writes the gzip wrapper, plain windowBits zlib (HTTP deflate)
+    return deflateInit2(zs, COMPRESS_LEVEL, Z_DEFLATED, 15 + (encoding == ENCODING_GZIP ? 16 : 0),
+                        8, Z_DEFAULT_STRATEGY) == Z_OK
+               ? 0
+               : -1;
+#else
+    (void)zs;
+    (void)encoding;
+    return -1;
+#endif
+}
+
+static void compress_end(z_stream *zs)
+{
+#if ENABLE_ZLIB
+    deflateEnd(zs);
+#else
+    (void)zs;
+#endif
+}
+
+/*
+ * Compresses len bytes of buf and appends the output to to. With finish the
+ * stream is closed, otherwise flushed to a byte boundary so the client can
+ * decode everything sent so far.
+ */
+static int compress_append(z_stream *zs, const char *buf, size_t len, int finish, struct out_buf *to)
+{
+#if ENABLE_ZLIB
+    unsigned char chunk[16 * 1024];
+    int rc;
 
-        for (c = 0; c < 11; c++)
+    zs->next_in = (unsigned char *)buf;
+    zs->avail_in = len;
+    do
+    {
+        zs->next_out = chunk;
+        zs->avail_out = sizeof(chunk);
+        rc = deflate(zs, finish ? Z_FINISH : Z_SYNC_FLUSH);
+        if (rc == Z_STREAM_ERROR)
         {
-            if ((queryctrl.flags & v4l2_ctrl_flags[c].bitmask))
-            {
-                if (count_flags)
-                {
-                    strcat(flags, ",");
-                }
-                strcat(flags, "\"");
-                strcat(flags, v4l2_ctrl_flags[c].name);
-                strcat(flags, "\"");
-                count_flags++;
-            }
+            return -1;
         }
+        out_print((const char *)chunk, sizeof(chunk) - zs->avail_out, to);
+    } while (zs->avail_out == 0);
+
+    return to->overflow ? -1 : 0;
+#else
+    (void)zs;
+    (void)buf;
+    (void)len;
+    (void)finish;
+    (void)to;
+    return -1;
+#endif
+}
 
-        var_name = name2var((char *)queryctrl.name);
-        if (var_name)
-        {
-            menu[0] = '\0';
-            menu_count = 0;
+/*
+ * Whole body at once, for cached and event loop replies.
+ */
+static int compress_buf(int encoding, const char *buf, size_t len, struct out_buf *to)
+{
+    z_stream zs;
+    int rc;
 
-            ctrl.id = queryctrl.id;
-            if (ioctl(fd, VIDIOC_G_CTRL, &ctrl) == 0)
-            {
-                if (queryctrl.type == V4L2_CTRL_TYPE_MENU ||
-                    queryctrl.type == V4L2_CTRL_TYPE_INTEGER_MENU)
-                {
-                    for (menu_index = queryctrl.minimum; menu_index <= queryctrl.maximum; menu_index++)
-                    {
-                        querymenu.id = queryctrl.id;
-                        querymenu.index = menu_index;
-                        if (ioctl(fd, VIDIOC_QUERYMENU, &querymenu) == 0)
-                        {
-                            if (menu_count)
-                            {
-                                strcat(menu, ", ");
-                            }
-                            sprintf(append, "%d", querymenu.index);
-                            strcat(menu, "\"");
-                            strcat(menu, append);
-                            strcat(menu, "\": \"");
-
-                            if (queryctrl.type == V4L2_CTRL_TYPE_MENU)
-                            {
-                                strcat(menu, (char *)querymenu.name);
-                            }
-                            else
-                            {
-                                sprintf(append, "%lld", querymenu.value);
-                                strcat(menu, append);
-                            }
-                            strcat(menu, "\"");
-                            menu_count++;
-                        }
-                    }
-                }
-                sprintf(control, FORMAT_CONTROL,
-                        var_name,
-                        queryctrl.minimum,
-                        queryctrl.maximum,
-                        queryctrl.default_value,
-                        queryctrl.step,
-                        ctrl.value);
-
-                strcat(control, menu);
-                strcat(control, " } }");
-
-                if (controls_count)
-                {
-                    strcat(controls, ", ");
-                }
-                strcat(controls, control);
-                controls_count++;
-            }
-            free(var_name);
-        }
-        queryctrl.id |= next_fl;
+    if (compress_init(&zs, encoding) != 0)
+    {
+        return -1;
     }
-    close(fd);
+    rc = compress_append(&zs, buf, len, 1, to);
+    compress_end(&zs);
 
-    strcat(controls, " }\n");
-    mg_http_reply(con, 200, "Content-Type: application/json\r\n", controls);
+    return rc;
 }
 
-static void device_control_set(struct mg_connection *con,
-                               struct mg_http_message *hm,
-                               char *device_name)
-{
+/*
+ * JSON number as a 64-bit integer. Integers are parsed exactly, a double
+ * would round them above 2^53; fractions and exponents are truncated.
+ */
+static long long json_number_s64(const char *s, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (s[i] == '.' || s[i] == 'e' || s[i] == 'E')
+        {
+            return (long long)strtod(s, NULL);
+        }
+    }
+
+    return strtoll(s, NULL, 10);
+}
+
+/*
+ * 64-bit control values as decimal text, long is 32 bits on ARM.
+ */
+static const char *control_value(char *buf, size_t size, long long value)
+{
+    snprintf(buf, size, "%lld", value);
+    return buf;
+}
+
+/*
+ * Copy JSON string content (without quotes) and resolve simple escapes,
+ * the result is printed again with %Q. Truncated to fit the buffer.
+ */
+static void json_key_copy(char *to, size_t size, const char *s, int len)
+{
+    static const char *escapes = "b\bf\fn\nr\rt\t";
+    const char *e;
+    size_t j = 0;
+    int i;
+
+    for (i = 0; i < len && j + 1 < size; i++)
+    {
+        if (s[i] == '\\' && i + 1 < len)
+        {
+            i++;
+            e = s[i] ? strchr(escapes, s[i]) : NULL;
+            to[j++] = (e && (e - escapes) % 2 == 0) ? e[1] : s[i];
+        }
+        else
+        {
+            to[j++] = s[i];
+        }
+    }
+    to[j] = '\0';
+}
+
+static char *fourcc_name(__u32 fourcc, char *name)
+{
+    name[0] = fourcc & 0xff;
+    name[1] = (fourcc >> 8) & 0xff;
+    name[2] = (fourcc >> 16) & 0xff;
+    name[3] = (fourcc >> 24) & 0xff;
+    name[4] = '\0';
+    return name;
+}
+
+/*
+ * Metrics for /metrics. Histograms have power of two buckets from 1 us to
+ * 2^(METRIC_BUCKETS-1) us plus +Inf and are updated with relaxed atomic
+ * adds, so the hot paths never take a lock. Event loops write their own
+ * struct loop_metrics, device workers the slot of their device.
+ */
+struct metric_histogram
+{
+    unsigned long long buckets[METRIC_BUCKETS + 1];
+    unsigned long long sum_us;
+    unsigned long long count;
+};
+
+static const struct
+{
+    unsigned long request;
+    const char *name;
+} ioctl_names[IOCTL_METRICS - 1] = {
+    {VIDIOC_QUERYCAP, "QUERYCAP"},
+    {VIDIOC_QUERYCTRL, "QUERYCTRL"},
+    {VIDIOC_QUERYMENU, "QUERYMENU"},
+    {VIDIOC_G_CTRL, "G_CTRL"},
+    {VIDIOC_S_CTRL, "S_CTRL"},
+    {VIDIOC_G_EXT_CTRLS, "G_EXT_CTRLS"},
+    {VIDIOC_S_EXT_CTRLS, "S_EXT_CTRLS"},
+    {VIDIOC_TRY_EXT_CTRLS, "TRY_EXT_CTRLS"},
+    {VIDIOC_ENUM_FMT, "ENUM_FMT"},
+    {VIDIOC_ENUM_FRAMESIZES, "ENUM_FRAMESIZES"},
+    {VIDIOC_ENUM_FRAMEINTERVALS, "ENUM_FRAMEINTERVALS"},
+    {VIDIOC_G_FMT, "G_FMT"},
+    {VIDIOC_SUBSCRIBE_EVENT, "SUBSCRIBE_EVENT"},
+    {VIDIOC_UNSUBSCRIBE_EVENT, "UNSUBSCRIBE_EVENT"},
+    {VIDIOC_DQEVENT, "DQEVENT"},
+    {VIDIOC_REQBUFS, "REQBUFS"},
+    {VIDIOC_QUERYBUF, "QUERYBUF"},
+    {VIDIOC_QBUF, "QBUF"},
+    {VIDIOC_DQBUF, "DQBUF"},
+    {VIDIOC_STREAMON, "STREAMON"},
+    {VIDIOC_STREAMOFF, "STREAMOFF"},
+};
+
+/*
+ * Per-device ioctl metrics, the last slot counts unknown requests. Slots
+ * are never freed, a replugged device keeps its counters.
+ */
+struct device_metrics
+{
+    char device_name[128];
+    struct metric_histogram ioctls[IOCTL_METRICS];
+    unsigned long long errors[IOCTL_METRICS];
+};
+
+static struct device_metrics s_device_metrics[MAX_DEVICE_WORKERS];
+static int s_device_metrics_count = 0;
+static pthread_mutex_t s_device_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Slot of the device the current thread works for, NULL = not measured
+static __thread struct device_metrics *s_ioctl_metrics;
+// Set when an ioctl of the current thread failed with ENODEV or ENXIO
+static __thread int s_device_gone;
+
+static unsigned long long metric_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void metric_add(unsigned long long *counter, unsigned long long value)
+{
+    __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+static unsigned long long metric_get(unsigned long long *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void metric_observe(struct metric_histogram *histogram, unsigned long long us)
+{
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+
+    if (bucket > METRIC_BUCKETS)
+    {
+        bucket = METRIC_BUCKETS;
+    }
+    metric_add(&histogram->buckets[bucket], 1);
+    metric_add(&histogram->sum_us, us);
+    metric_add(&histogram->count, 1);
+}
+
+static int ioctl_metric_index(unsigned long request)
+{
+    int i;
+
+    for (i = 0; i < IOCTL_METRICS - 1; i++)
+    {
+        if (ioctl_names[i].request == request)
+        {
+            return i;
+        }
+    }
+
+    return IOCTL_METRICS - 1;
+}
+
+static struct device_metrics *device_metrics_get(const char *device_name)
+{
+    struct device_metrics *metrics = NULL;
+    int i;
+
+    pthread_mutex_lock(&s_device_metrics_lock);
+    for (i = 0; i < s_device_metrics_count && !metrics; i++)
+    {
+        if (!strcmp(s_device_metrics[i].device_name, device_name))
+        {
+            metrics = &s_device_metrics[i];
+        }
+    }
+    if (!metrics && s_device_metrics_count < MAX_DEVICE_WORKERS)
+    {
+        metrics = &s_device_metrics[s_device_metrics_count];
+        snprintf(metrics->device_name, sizeof(metrics->device_name), "%s", device_name);
+        // Published after the name, /metrics reads the count without lock
+        __atomic_store_n(&s_device_metrics_count, s_device_metrics_count + 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&s_device_metrics_lock);
+
+    return metrics;
+}
+
+/*
+ * Device access goes through these wrappers, so the simulated devices of
+ * v4l2_mock.c (-M) can stand in for /dev/videoN.
+ */
+static int device_open(const char *device_name)
+{
+    char path[256];
+    if (strncmp(device_name, "video", 5))
+    {
+        return -ENODEV;
+    }
+    if (mock_enabled())
+    {
+        return mock_open(device_name);
+    }
+    strcpy(path, "/dev/");
+    strcat(path, device_name);
+
+    return open(path, O_RDWR | O_NONBLOCK);
+}
+
+static int device_ioctl(int fd, unsigned long request, void *arg)
+{
+    struct device_metrics *metrics = s_ioctl_metrics;
+    unsigned long long started = metrics ? metric_now_us() : 0;
+    int index;
+    int rc;
+
+    rc = mock_enabled() ? mock_ioctl(fd, request, arg) : ioctl(fd, request, arg);
+    if (rc < 0 && (errno == ENODEV || errno == ENXIO))
+    {
+        s_device_gone = 1;
+    }
+    if (!metrics)
+    {
+        return rc;
+    }
+
+    index = ioctl_metric_index(request);
+    metric_observe(&metrics->ioctls[index], metric_now_us() - started);
+    if (rc < 0)
+    {
+        metric_add(&metrics->errors[index], 1);
+    }
+
+    return rc;
+}
+
+static int device_close(int fd)
+{
+    return mock_enabled() ? mock_close(fd) : close(fd);
+}
+
+static void *device_mmap(size_t length, int prot, int flags, int fd, off_t offset)
+{
+    return mock_enabled() ? mock_mmap(length, prot, flags, fd, offset) : mmap(NULL, length, prot, flags, fd, offset);
+}
+
+static int device_stat(const char *device_name, struct stat *st)
+{
+    char path[256];
+
+    if (mock_enabled())
+    {
+        return mock_stat(device_name, st);
+    }
+    snprintf(path, sizeof(path), "/dev/%s", device_name);
+
+    return stat(path, st);
+}
+
+static int device_fstat(int fd, struct stat *st)
+{
+    return mock_enabled() ? mock_fstat(fd, st) : fstat(fd, st);
+}
+
+static int device_exists(const char *device_name)
+{
+    struct stat st;
+
+    return device_stat(device_name, &st) == 0;
+}
+
+/*
+ * Capabilities of one /dev/videoN as a "name": { ... } fragment of the
+ * /devices reply. Returns -1 if the node is not a V4L2 device.
+ */
+static int device_describe(const char *name, struct out_buf *out)
+{
+    struct device_metrics *metrics = s_ioctl_metrics;
+    struct v4l2_capability cap;
+    int count_capabilities = 0;
+    int fd;
+    int c;
+    int rc;
+
+    fd = device_open(name);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    s_ioctl_metrics = device_metrics_get(name);
+    rc = device_ioctl(fd, VIDIOC_QUERYCAP, &cap);
+    s_ioctl_metrics = metrics;
+    device_close(fd);
+
+    if (rc < 0)
+    {
+        return -1;
+    }
+
+    out_printf(out, FORMAT_DEVICE_CAPABILITIES,
+               name,
+               (char *)cap.driver,
+               (char *)cap.card,
+               (char *)cap.bus_info,
+               cap.version);
+
+    for (c = 0; c < 23; c++)
+    {
+        if ((cap.capabilities & v4l2_capability_names[c].bitmask))
+        {
+            out_printf(out, count_capabilities ? ",%Q" : "%Q", v4l2_capability_names[c].name);
+            count_capabilities++;
+        }
+    }
+    out_printf(out, " ] }\n");
+
+    return 0;
+}
+
+/*
+ * Device registry. Filled once at startup and kept current by an inotify
+ * watch on /dev handled in the first event loop, so GET /devices is served
+ * from memory. Without inotify /dev is scanned on every request.
+ */
+struct device_entry
+{
+    char name[32];
+    struct out_buf json;
+};
+
+static struct device_entry *s_registry = NULL;
+static int s_registry_count = 0;
+static int s_registry_watching = 0;
+static struct out_buf s_registry_reply = {NULL, 0, 0, 0, 0};
+static char s_registry_etag[ETAG_SIZE];
+static struct out_buf s_registry_compressed[ENCODING_COUNT];
+static pthread_mutex_t s_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Natural order, video2 before video10.
+ */
+static int device_name_cmp(const char *a, const char *b)
+{
+    size_t la = strlen(a);
+    size_t lb = strlen(b);
+
+    return la != lb ? (la < lb ? -1 : 1) : strcmp(a, b);
+}
+
+static int device_entry_cmp(const void *a, const void *b)
+{
+    return device_name_cmp(((const struct device_entry *)a)->name,
+                           ((const struct device_entry *)b)->name);
+}
+
+static int device_name_valid(const char *name)
+{
+    return strncmp(name, "video", 5) == 0 && strlen(name) < sizeof(((struct device_entry *)0)->name);
+}
+
+/*
+ * Called with s_registry_lock held.
+ */
+static void device_registry_render(void)
+{
+    int i;
+
+    s_registry_reply.len = 0;
+    s_registry_reply.overflow = 0;
+
+    out_printf(&s_registry_reply, "{ ");
+    for (i = 0; i < s_registry_count; i++)
+    {
+        out_printf(&s_registry_reply, i ? ",%.*s" : "%.*s",
+                   (int)s_registry[i].json.len, s_registry[i].json.buf);
+    }
+    out_printf(&s_registry_reply, " }\n");
+
+    snprintf(s_registry_etag, sizeof(s_registry_etag), "\"d-%08x\"",
+             (unsigned)mg_crc32(0, s_registry_reply.buf, s_registry_reply.len));
+
+    // Compressed once per change instead of once per request
+    for (i = ENCODING_GZIP; i < ENCODING_COUNT; i++)
+    {
+        out_free(&s_registry_compressed[i]);
+        if (ENABLE_ZLIB && s_registry_reply.len >= COMPRESS_MIN_SIZE && !s_registry_reply.overflow &&
+            compress_buf(i, s_registry_reply.buf, s_registry_reply.len, &s_registry_compressed[i]) != 0)
+        {
+            out_free(&s_registry_compressed[i]);
+        }
+    }
+}
+
+/*
+ * Called with s_registry_lock held.
+ */
+static struct device_entry *device_registry_find(const char *name)
+{
+    struct device_entry key;
+
+    if (!s_registry_count)
+    {
+        return NULL;
+    }
+    snprintf(key.name, sizeof(key.name), "%s", name);
+    return bsearch(&key, s_registry, s_registry_count, sizeof(struct device_entry), device_entry_cmp);
+}
+
+static void device_stream_plugged(const char *device_name);
+
+/*
+ * Adds or replaces the entry of name with json, or drops it if json is
+ * empty. Takes over json.
+ */
+static void device_registry_store(const char *name, struct out_buf json)
+{
+    struct device_entry *entry;
+    struct device_entry *grown;
+    int found;
+
+    pthread_mutex_lock(&s_registry_lock);
+
+    entry = device_registry_find(name);
+    found = entry != NULL;
+
+    if (json.buf)
+    {
+        if (!entry)
+        {
+            grown = realloc(s_registry, (s_registry_count + 1) * sizeof(struct device_entry));
+            if (!grown)
+            {
+                pthread_mutex_unlock(&s_registry_lock);
+                out_free(&json);
+                return;
+            }
+            s_registry = grown;
+            entry = &s_registry[s_registry_count++];
+            snprintf(entry->name, sizeof(entry->name), "%s", name);
+        }
+        else
+        {
+            out_free(&entry->json);
+        }
+        entry->json = json;
+        qsort(s_registry, s_registry_count, sizeof(struct device_entry), device_entry_cmp);
+    }
+    else if (entry)
+    {
+        out_free(&entry->json);
+        memmove(entry, entry + 1, (s_registry_count - (entry - s_registry) - 1) * sizeof(struct device_entry));
+        s_registry_count--;
+    }
+
+    device_registry_render();
+    pthread_mutex_unlock(&s_registry_lock);
+
+    if (json.buf && !found)
+    {
+        LOGINFO("Device %s added", name);
+        device_stream_plugged(name);
+    }
+    else if (!json.buf && found)
+    {
+        LOGINFO("Device %s removed", name);
+    }
+}
+
+/*
+ * Queries the node again and adds, replaces or drops its entry. The ioctl
+ * runs before the lock is taken.
+ */
+static void device_registry_update(const char *name)
+{
+    struct out_buf json = {NULL, 0, 0, 0, 0};
+
+    if (device_describe(name, &json) < 0 || json.overflow)
+    {
+        out_free(&json);
+    }
+    device_registry_store(name, json);
+}
+
+static void device_registry_queue(struct mg_mgr *mgr, const char *name);
+
+/*
+ * With mgr the nodes are queried on their device workers, without (at
+ * startup, before requests are served) right away.
+ */
+static void device_registry_scan(struct mg_mgr *mgr)
+{
+    struct dirent *ep;
+    DIR *dp;
+    int i;
+
+    if (mock_enabled())
+    {
+        for (i = 0; i < mock_count(); i++)
+        {
+            device_registry_update(mock_name(i));
+        }
+        return;
+    }
+
+    dp = opendir("/dev");
+    if (dp == NULL)
+    {
+        return;
+    }
+
+    while ((ep = readdir(dp)))
+    {
+        if (device_name_valid(ep->d_name) && mgr)
+        {
+            device_registry_queue(mgr, ep->d_name);
+        }
+        else if (device_name_valid(ep->d_name))
+        {
+            device_registry_update(ep->d_name);
+        }
+    }
+    closedir(dp);
+}
+
+static int device_registry_known(const char *name)
+{
+    int known;
+
+    pthread_mutex_lock(&s_registry_lock);
+    known = device_registry_find(name) != NULL;
+    pthread_mutex_unlock(&s_registry_lock);
+
+    return known;
+}
+
+/*
+ * Handler of the wrapped inotify fd.
+ */
+static void device_registry_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+    struct inotify_event *event;
+    size_t offset = 0;
+    size_t size;
+
+    (void)ev_data;
+    (void)fn_data;
+
+    if (ev != MG_EV_READ)
+    {
+        return;
+    }
+
+    while (c->recv.len - offset >= sizeof(struct inotify_event))
+    {
+        event = (struct inotify_event *)(c->recv.buf + offset);
+        size = sizeof(struct inotify_event) + event->len;
+        if (c->recv.len - offset < size)
+        {
+            break;
+        }
+        offset += size;
+
+        if (event->mask & IN_Q_OVERFLOW)
+        {
+            LOGDEBUG("Device registry: inotify queue overflow, rescan /dev");
+            device_registry_scan(c->mgr);
+            continue;
+        }
+
+        if (!event->len || !device_name_valid(event->name))
+        {
+            continue;
+        }
+
+        // udev fixes permissions after the node is created, re-query on
+        // IN_ATTRIB only while the node is not usable yet
+        if ((event->mask & IN_ATTRIB) && device_registry_known(event->name))
+        {
+            continue;
+        }
+
+        // open() and VIDIOC_QUERYCAP block on a settling driver, they run
+        // on the device worker
+        LOGDEBUG("Device registry: %s event 0x%x", event->name, event->mask);
+        device_registry_queue(c->mgr, event->name);
+    }
+
+    mg_iobuf_delete(&c->recv, offset);
+}
+
+static void device_registry_start(struct mg_mgr *mgr)
+{
+    struct mg_connection *c;
+    int fd;
+
+    // Simulated devices never come and go
+    if (mock_enabled())
+    {
+        device_registry_scan(NULL);
+        pthread_mutex_lock(&s_registry_lock);
+        device_registry_render();
+        s_registry_watching = 1;
+        pthread_mutex_unlock(&s_registry_lock);
+        return;
+    }
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+    {
+        LOGWARN("Device registry: inotify not available (%s), /dev is scanned per request", strerror(errno));
+        return;
+    }
+
+    if (inotify_add_watch(fd, "/dev", IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO) < 0 ||
+        (c = mg_wrapfd(mgr, fd, device_registry_fn, NULL)) == NULL)
+    {
+        LOGWARN("Device registry: can't watch /dev (%s), /dev is scanned per request", strerror(errno));
+        close(fd);
+        return;
+    }
+    c->is_fd = 1;
+
+    // Watch first, then scan, so no node slips in between
+    device_registry_scan(NULL);
+
+    pthread_mutex_lock(&s_registry_lock);
+    device_registry_render();
+    s_registry_watching = 1;
+    pthread_mutex_unlock(&s_registry_lock);
+
+    LOGDEBUG("Device registry: watching /dev, %d devices", s_registry_count);
+}
+
+static void device_registry_free(void)
+{
+    int i;
+
+    for (i = 0; i < s_registry_count; i++)
+    {
+        out_free(&s_registry[i].json);
+    }
+    free(s_registry);
+    s_registry = NULL;
+    s_registry_count = 0;
+    out_free(&s_registry_reply);
+    for (i = 0; i < ENCODING_COUNT; i++)
+    {
+        out_free(&s_registry_compressed[i]);
+    }
+}
+
+/*
+ * If-None-Match holds one or more (possibly weak) entity tags or "*".
+ */
+static int etag_match(struct mg_str *if_none_match, const char *etag)
+{
+    struct mg_str value;
+
+    if (!if_none_match)
+    {
+        return 0;
+    }
+
+    value = mg_strstrip(*if_none_match);
+    return !mg_vcmp(&value, "*") || mg_strstr(value, mg_str(etag)) != NULL;
+}
+
+/*
+ * Tag of the representation in encoding, "x" -> "x-gz".
+ */
+static void etag_variant(char *to, size_t size, const char *etag, int encoding)
+{
+    snprintf(to, size, "%.*s%s\"", (int)strlen(etag) - 1, etag, s_encoding_etags[encoding]);
+}
+
+/*
+ * A tag of any encoding is still valid, the data behind it is the same.
+ */
+static int etag_match_any(struct mg_str *if_none_match, const char *etag)
+{
+    char variant[ETAG_SIZE + 8];
+    int encoding;
+
+    for (encoding = 0; encoding < ENCODING_COUNT; encoding++)
+    {
+        etag_variant(variant, sizeof(variant), etag, encoding);
+        if (etag_match(if_none_match, variant))
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Preferred encoding of Accept-Encoding, gzip before deflate. Codings with
+ * q=0 are refused.
+ */
+static int accept_encoding(struct mg_http_message *hm)
+{
+    struct mg_str *header = mg_http_get_header(hm, "Accept-Encoding");
+    int accepted[ENCODING_COUNT] = {1, 0, 0};
+    struct mg_str token;
+    struct mg_str name;
+    const char *p;
+    const char *end;
+    const char *comma;
+    const char *semi;
+    const char *q;
+    int encoding;
+    int weight;
+
+    if (!ENABLE_ZLIB || !header)
+    {
+        return ENCODING_IDENTITY;
+    }
+
+    for (p = header->ptr, end = header->ptr + header->len; p < end; p = comma + 1)
+    {
+        comma = memchr(p, ',', end - p);
+        comma = comma ? comma : end;
+        token = mg_strstrip(mg_str_n(p, comma - p));
+        semi = memchr(token.ptr, ';', token.len);
+        name = mg_strstrip(mg_str_n(token.ptr, semi ? (size_t)(semi - token.ptr) : token.len));
+
+        weight = 1;
+        if (semi && (q = mg_strstr(mg_str_n(semi, token.ptr + token.len - semi), mg_str("q="))) != NULL)
+        {
+            // q=0, q=0.0, q=0.000
+            for (q += 2, weight = 0; q < token.ptr + token.len && *q != ' '; q++)
+            {
+                weight |= *q >= '1' && *q <= '9';
+            }
+        }
+
+        for (encoding = ENCODING_GZIP; encoding < ENCODING_COUNT; encoding++)
+        {
+            if (!mg_vcasecmp(&name, s_encoding_names[encoding]) || (!mg_vcmp(&name, "*") && encoding == ENCODING_GZIP))
+            {
+                accepted[encoding] = weight;
+            }
+        }
+    }
+
+    return accepted[ENCODING_GZIP] ? ENCODING_GZIP : accepted[ENCODING_DEFLATE] ? ENCODING_DEFLATE
+                                                                                 : ENCODING_IDENTITY;
+}
+
+/*
+ * Reply built on the event loop. Compressed if the client accepts it (from
+ * cache when given, precompressed per encoding), tagged with etag and
+ * answered with 304 when the client has it already.
+ */
+static void reply_body(struct mg_connection *con, struct mg_http_message *hm, const char *content_type,
+                       struct out_buf *out, const char *etag, struct out_buf *cache)
+{
+    struct out_buf compressed = {NULL, 0, 0, 0, 0};
+    struct out_buf *body = out;
+    char headers[256];
+    char tag[ETAG_SIZE + 8];
+    int encoding = out->len >= COMPRESS_MIN_SIZE ? accept_encoding(hm) : ENCODING_IDENTITY;
+    int len;
+
+    if (out->overflow)
+    {
+        mg_http_reply(con, 500, "", "Reply too large.");
+        return;
+    }
+
+    if (encoding != ENCODING_IDENTITY)
+    {
+        if (cache && cache[encoding].len)
+        {
+            body = &cache[encoding];
+        }
+        else if (compress_buf(encoding, out->buf, out->len, &compressed) == 0)
+        {
+            body = &compressed;
+        }
+        else
+        {
+            encoding = ENCODING_IDENTITY;
+        }
+    }
+
+    len = snprintf(headers, sizeof(headers), "%s", content_type);
+    if (ENABLE_ZLIB)
+    {
+        len += snprintf(headers + len, sizeof(headers) - len, "Vary: Accept-Encoding\r\n");
+    }
+    if (encoding != ENCODING_IDENTITY)
+    {
+        len += snprintf(headers + len, sizeof(headers) - len, "Content-Encoding: %s\r\n", s_encoding_names[encoding]);
+    }
+
+    if (etag)
+    {
+        etag_variant(tag, sizeof(tag), etag, encoding);
+        snprintf(headers + len, sizeof(headers) - len, "ETag: %s\r\n", tag);
+
+        if (etag_match_any(mg_http_get_header(hm, "If-None-Match"), etag))
+        {
+            mg_http_reply(con, 304, headers + strlen(content_type), "");
+            out_free(&compressed);
+            return;
+        }
+    }
+
+    // Not mg_http_reply(), compressed bodies contain NUL bytes
+    mg_printf(con, "HTTP/1.1 200 OK\r\n%sContent-Length: %d\r\n\r\n", headers, (int)body->len);
+    mg_send(con, body->buf ? body->buf : "", body->len);
+    out_free(&compressed);
+}
+
+static void device_list(struct mg_connection *con, struct mg_http_message *hm)
+{
+    struct dirent *ep;
+    struct out_buf out;
+    char etag[ETAG_SIZE];
+    int count_devices = 0;
+    DIR *dp;
+
+    pthread_mutex_lock(&s_registry_lock);
+    if (s_registry_watching)
+    {
+        reply_body(con, hm, HEADERS_JSON, &s_registry_reply, s_registry_etag, s_registry_compressed);
+        pthread_mutex_unlock(&s_registry_lock);
+        return;
+    }
+    pthread_mutex_unlock(&s_registry_lock);
+
+    conn_out(con, &out);
+    out_printf(&out, "{ ");
+
+    dp = opendir("/dev");
+    if (dp != NULL)
+    {
+        while ((ep = readdir(dp)))
+        {
+            if (!device_name_valid(ep->d_name))
+            {
+                continue;
+            }
+            if (count_devices)
+            {
+                out_printf(&out, ",");
+            }
+            if (device_describe(ep->d_name, &out) == 0)
+            {
+                count_devices++;
+            }
+            else if (count_devices)
+            {
+                out.len--; // drop the separator again
+            }
+        }
+        closedir(dp);
+    }
+    out_printf(&out, " }\n");
+
+    // Same tag as the registry, the scan still saves the bandwidth
+    snprintf(etag, sizeof(etag), "\"d-%08x\"", (unsigned)mg_crc32(0, out.buf, out.len));
+    reply_body(con, hm, HEADERS_JSON, &out, etag, NULL);
+    out_free(&out);
+}
+
+struct device_job;
+struct device_worker;
+typedef void (*device_handler_t)(struct device_job *job);
+
+/*
+ * Captured frame handed from a device worker to the event loop. The bytes
+ * stay in the mapped driver buffer, the last reference unmaps it or gives
+ * it back to its owner through release.
+ */
+struct frame
+{
+    int refs;
+    const char *data;
+    size_t len;
+    void *map;
+    size_t map_len;
+    void (*release)(struct frame *frame);
+    void *owner;
+    __u32 index;
+    __u32 sequence;
+    unsigned long long timestamp_us;
+};
+
+static struct frame *frame_mapped(void *map, size_t map_len, size_t len)
+{
+    struct frame *frame = calloc(1, sizeof(struct frame));
+
+    if (!frame)
+    {
+        return NULL;
+    }
+    frame->refs = 1;
+    frame->data = (const char *)map;
+    frame->len = len < map_len ? len : map_len;
+    frame->map = map;
+    frame->map_len = map_len;
+
+    return frame;
+}
+
+static void frame_unref(struct frame *frame)
+{
+    if (frame && __atomic_sub_fetch(&frame->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        if (frame->release)
+        {
+            frame->release(frame);
+        }
+        else
+        {
+            munmap(frame->map, frame->map_len);
+        }
+        free(frame);
+    }
+}
+
+/*
+ * Piece of a reply produced on a device worker. A reply posted at once is
+ * both first and last, longer replies are sent in HTTP chunks.
+ */
+struct reply_part
+{
+    struct reply_part *next;
+    unsigned long conn_id;
+    int status;
+    const char *headers;
+    int first;
+    int last;
+    int raw;
+    int ws;
+    struct metric_histogram *latency;
+    unsigned long long started;
+    char etag[ETAG_SIZE + 8];
+    int encoding;
+    struct out_buf out;
+    struct frame *frame; // sent after out, single replies and raw parts
+    const char *trailer; // sent after the frame of raw parts
+    int droppable;       // raw frame that is skipped while c->send is not empty
+};
+
+/*
+ * Counters of one event loop, written only by its thread. Requests are
+ * timed from MG_EV_HTTP_MSG until the last part of the reply is handed
+ * to the connection.
+ */
+struct loop_metrics
+{
+    struct metric_histogram requests[ROUTE_METRICS][METHOD_METRICS];
+    struct metric_histogram iterations;
+    unsigned long long bytes_received;
+    unsigned long long bytes_sent;
+    unsigned long long connections;
+    unsigned long long accepted;
+};
+
+/*
+ * Event loop thread. Device workers hand replies back through the parts
+ * list and wake the loop up by writing to the mg_socketpair.
+ */
+struct http_loop
+{
+    struct mg_mgr mgr;
+    int wakeup_sock;
+    pthread_mutex_t lock;
+    struct reply_part *parts;
+    struct loop_metrics metrics;
+    unsigned long long poll_ready;
+    // Request in MG_EV_HTTP_MSG, taken over by device_job_new()
+    struct metric_histogram *request_latency;
+    unsigned long long request_started;
+    // Accepted connections by c->id, only touched by the loop itself
+    struct http_conn *conns[LOOP_CONN_BUCKETS];
+};
+
+struct control_menu
+{
+    __u32 index;
+    char name[32];
+};
+
+/*
+ * Control descriptor, name is already normalized by name2var().
+ */
+struct control_desc
+{
+    __u32 id;
+    __u32 type;
+    __s32 minimum;
+    __s32 maximum;
+    __s32 step;
+    __s32 default_value;
+    __u32 flags;
+    char name[128];
+    int menu_count;
+    struct control_menu *menu;
+};
+
+struct frame_size
+{
+    __u32 type;
+    __u32 min_width;
+    __u32 min_height;
+    __u32 max_width;
+    __u32 max_height;
+    __u32 step_width;
+    __u32 step_height;
+    __u32 intervals_type;
+    int intervals_count;
+    struct v4l2_fract *intervals;
+};
+
+struct pixel_format
+{
+    __u32 buf_type;
+    __u32 pixelformat;
+    int sizes_count;
+    struct frame_size *sizes;
+};
+
+/*
+ * One control of a POST request. Requests with errors (unknown control,
+ * not a number) have no descriptor and are only reported back.
+ */
+struct control_write
+{
+    struct control_desc *desc;
+    char name[128];
+    int order;
+    __s64 value;
+    int applied;
+    int err;
+    const char *error;
+};
+
+/*
+ * Per-device cache. Owned by the device worker, so only its thread
+ * touches it and no locking is needed.
+ */
+struct device_state
+{
+    ino_t ino;
+    dev_t rdev;
+    int fd;
+    struct timespec last_used;
+    int controls_loaded;
+    int controls_count;
+    struct control_desc *controls;
+    struct control_desc **by_name;
+    int formats_loaded;
+    uint32_t formats_crc;
+    struct out_buf formats_compressed[ENCODING_COUNT];
+    __u32 capabilities;
+    int formats_count;
+    struct pixel_format *formats;
+};
+
+/*
+ * Request for a device worker. The handler runs on the worker thread, does
+ * all the ioctls and leaves the HTTP reply in status / headers / reply.
+ */
+struct device_job
+{
+    struct device_job *next;
+    struct http_loop *loop;
+    unsigned long conn_id;
+    device_handler_t handler;
+    char device_name[128];
+    char control[CONTROL_NAME_SIZE]; // single control of GET /device/control/{device}/{control}
+    char *body;
+    size_t body_len;
+    struct mg_str query;
+    int status;
+    const char *headers;
+    struct out_buf out;
+    int inline_reply;
+    int no_chunks;
+    int ws;
+    int streamed;
+    struct device_state *state;
+    struct device_state local_state;
+    struct device_worker *worker;
+    struct metric_histogram *latency;
+    unsigned long long started;
+    char if_none_match[128];
+    char etag[ETAG_SIZE];
+    int encoding;
+    int precompressed;
+    int compressing;
+    z_stream zs;
+    struct frame *frame;
+};
+
+/*
+ * One thread per /dev/videoN, so a slow driver blocks only its own requests.
+ */
+struct device_worker
+{
+    struct device_worker *next;
+    char device_name[128];
+    pthread_t thread;
+    pthread_cond_t cond;
+    struct device_job *head;
+    struct device_job *tail;
+    struct device_state state;
+    int controls_stale; // under s_workers_lock, set by the event watcher
+};
+
+static struct http_loop s_loops[MAX_THREADS];
+static struct device_worker *s_workers = NULL;
+static int s_workers_count = 0;
+static int s_workers_stop = 0;
+static pthread_mutex_t s_workers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void job_reply(struct device_job *job, int status, const char *headers, const char *fmt, ...)
+{
+    va_list ap;
+
+    job->out.len = 0;
+    job->out.overflow = 0;
+
+    va_start(ap, fmt);
+    mjson_vprintf(out_print, &job->out, fmt, ap);
+    va_end(ap);
+
+    job->status = status;
+    job->headers = headers;
+}
+
+/*
+ * Handlers print the reply into job->out, this marks it as JSON reply.
+ */
+static void job_reply_json(struct device_job *job)
+{
+    job->status = 200;
+    job->headers = HEADERS_JSON;
+}
+
+static void device_job_flush(struct device_job *job);
+static void device_job_post(struct device_job *job, int last);
+
+static void device_state_clear_controls(struct device_state *state)
+{
+    int i;
+
+    for (i = 0; i < state->controls_count; i++)
+    {
+        free(state->controls[i].menu);
+    }
+    free(state->controls);
+    free(state->by_name);
+    state->controls = NULL;
+    state->by_name = NULL;
+    state->controls_count = 0;
+    state->controls_loaded = 0;
+}
+
+static void device_state_clear(struct device_state *state)
+{
+    int i;
+    int s;
+
+    device_state_clear_controls(state);
+
+    for (i = 0; i < state->formats_count; i++)
+    {
+        for (s = 0; s < state->formats[i].sizes_count; s++)
+        {
+            free(state->formats[i].sizes[s].intervals);
+        }
+        free(state->formats[i].sizes);
+    }
+    free(state->formats);
+    state->formats = NULL;
+    state->formats_count = 0;
+    state->formats_loaded = 0;
+    for (i = 0; i < ENCODING_COUNT; i++)
+    {
+        out_free(&state->formats_compressed[i]);
+    }
+    state->capabilities = 0;
+}
+
+static void control_menu_load(int fd, struct control_desc *desc)
+{
+    struct v4l2_querymenu querymenu;
+    int menu_index;
+    int size = desc->maximum - desc->minimum + 1;
+
+    if (size <= 0 || size > MAX_MENU_ITEMS)
+    {
+        size = MAX_MENU_ITEMS;
+    }
+    desc->menu = calloc(size, sizeof(struct control_menu));
+    if (!desc->menu)
+    {
+        return;
+    }
+
+    memset(&querymenu, 0, sizeof(struct v4l2_querymenu));
+
+    for (menu_index = desc->minimum; menu_index <= desc->maximum && desc->menu_count < size; menu_index++)
+    {
+        querymenu.id = desc->id;
+        querymenu.index = menu_index;
+        if (device_ioctl(fd, VIDIOC_QUERYMENU, &querymenu) == 0)
+        {
+            struct control_menu *item = &desc->menu[desc->menu_count++];
+
+            item->index = querymenu.index;
+            if (desc->type == V4L2_CTRL_TYPE_MENU)
+            {
+                snprintf(item->name, sizeof(item->name), "%s", (char *)querymenu.name);
+            }
+            else
+            {
+                snprintf(item->name, sizeof(item->name), "%lld", querymenu.value);
+            }
+        }
+    }
+}
+
+/*
+ * Enumerate controls (and their menus) once, they don't change for the
+ * lifetime of the device node. Returns number of loaded controls.
+ */
+static int device_state_load_controls(struct device_state *state, int fd)
+{
     struct v4l2_queryctrl queryctrl;
+    struct control_desc *desc;
+    char *var_name;
+    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
+    int capacity = 0;
+
+    memset(&queryctrl, 0, sizeof(struct v4l2_queryctrl));
+
+    queryctrl.id = next_fl;
+    while (device_ioctl(fd, VIDIOC_QUERYCTRL, &queryctrl) == 0)
+    {
+        if (queryctrl.type == V4L2_CTRL_TYPE_CTRL_CLASS)
+        {
+            queryctrl.id |= next_fl;
+            continue;
+        }
+
+        var_name = name2var((char *)queryctrl.name);
+        if (!var_name)
+        {
+            queryctrl.id |= next_fl;
+            continue;
+        }
+
+        if (state->controls_count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 32;
+            desc = realloc(state->controls, capacity * sizeof(struct control_desc));
+            if (!desc)
+            {
+                free(var_name);
+                break;
+            }
+            state->controls = desc;
+        }
+
+        desc = &state->controls[state->controls_count++];
+        memset(desc, 0, sizeof(struct control_desc));
+        desc->id = queryctrl.id;
+        desc->type = queryctrl.type;
+        desc->minimum = queryctrl.minimum;
+        desc->maximum = queryctrl.maximum;
+        desc->step = queryctrl.step;
+        desc->default_value = queryctrl.default_value;
+        desc->flags = queryctrl.flags;
+        snprintf(desc->name, sizeof(desc->name), "%s", var_name);
+        free(var_name);
+
+        if (queryctrl.type == V4L2_CTRL_TYPE_MENU ||
+            queryctrl.type == V4L2_CTRL_TYPE_INTEGER_MENU)
+        {
+            control_menu_load(fd, desc);
+        }
+
+        queryctrl.id |= next_fl;
+    }
+
+    return state->controls_count;
+}
+
+static int control_desc_cmp(const void *a, const void *b)
+{
+    return strcmp((*(struct control_desc **)a)->name, (*(struct control_desc **)b)->name);
+}
+
+/*
+ * Sorted index of control names for lookups of POST keys.
+ */
+static void device_state_index_controls(struct device_state *state)
+{
+    int c;
+
+    state->by_name = malloc((state->controls_count + 1) * sizeof(struct control_desc *));
+    if (!state->by_name)
+    {
+        return;
+    }
+    for (c = 0; c < state->controls_count; c++)
+    {
+        state->by_name[c] = &state->controls[c];
+    }
+    qsort(state->by_name, state->controls_count, sizeof(struct control_desc *), control_desc_cmp);
+}
+
+static struct control_desc *control_find(struct device_state *state, const char *name, int len)
+{
+    int lo = 0;
+    int hi = state->controls_count - 1;
+    int mid;
+    int cmp;
+
+    if (!state->by_name)
+    {
+        return NULL;
+    }
+
+    while (lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        cmp = strncmp(state->by_name[mid]->name, name, len);
+        if (cmp == 0 && state->by_name[mid]->name[len] != '\0')
+        {
+            cmp = 1;
+        }
+        if (cmp == 0)
+        {
+            return state->by_name[mid];
+        }
+        if (cmp < 0)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Cached state is dropped when the node was replaced (unplugged and plugged
+ * again), which shows up as a different inode or device number.
+ */
+static void device_state_close(struct device_state *state)
+{
+    if (state->fd >= 0)
+    {
+        device_close(state->fd);
+        state->fd = -1;
+    }
+}
+
+static void device_state_validate(struct device_state *state, int fd)
+{
+    struct stat st;
+
+    if (device_fstat(fd, &st) != 0)
+    {
+        return;
+    }
+
+    if ((state->controls_loaded || state->formats_loaded) && (st.st_ino != state->ino || st.st_rdev != state->rdev))
+    {
+        LOGDEBUG("Device node changed, dropping cached state");
+        device_state_clear(state);
+    }
+
+    state->ino = st.st_ino;
+    state->rdev = st.st_rdev;
+}
+
+/*
+ * The device fd is kept open in the device state and shared by all
+ * requests of the worker, so USB devices are not woken up by an open()
+ * per request. Reuse costs nothing: the worker drops the fd after an
+ * ioctl failed with ENODEV or ENXIO and when the registry sees the node
+ * change, and closes it after s_device_idle seconds without requests.
+ */
+static int device_fd(struct device_job *job)
+{
+    struct device_state *state = job->state;
+
+    if (state->fd < 0)
+    {
+        state->fd = device_open(job->device_name);
+        if (state->fd < 0)
+        {
+            return -1;
+        }
+        device_state_validate(state, state->fd);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &state->last_used);
+    return state->fd;
+}
+
+static struct device_state *device_state_controls(struct device_job *job, int fd)
+{
+    struct device_state *state = job->state;
+
+    if (!state->controls_loaded)
+    {
+        device_state_load_controls(state, fd);
+        device_state_index_controls(state);
+        state->controls_loaded = 1;
+        LOGDEBUG("Device %s: cached %d controls", job->device_name, state->controls_count);
+    }
+
+    return state;
+}
+
+static void device_control_get(struct device_job *job)
+{
+    struct device_state *state;
+    struct control_desc *desc;
+    struct v4l2_control ctrl;
+    struct out_buf *out = &job->out;
+    int c;
+    int m;
+    int controls_count = 0;
+    int fd = device_fd(job);
+
+    if (fd < 0)
+    {
+        job_reply(job, 400, "", "Device can't be opened.");
+        return;
+    }
+
+    state = device_state_controls(job, fd);
+
+    memset(&ctrl, 0, sizeof(struct v4l2_control));
+
+    out_printf(out, "{ ");
+
+    for (c = 0; c < state->controls_count; c++)
+    {
+        desc = &state->controls[c];
+        if (job->control[0] && strcmp(desc->name, job->control))
+        {
+            continue;
+        }
+
+        ctrl.id = desc->id;
+        if (device_ioctl(fd, VIDIOC_G_CTRL, &ctrl) == 0)
+        {
+            if (controls_count)
+            {
+                out_printf(out, ", ");
+            }
+            out_printf(out, FORMAT_CONTROL,
+                       desc->name,
+                       desc->minimum,
+                       desc->maximum,
+                       desc->default_value,
+                       desc->step,
+                       ctrl.value);
+
+            for (m = 0; m < desc->menu_count; m++)
+            {
+                if (m)
+                {
+                    out_printf(out, ", ");
+                }
+                out_printf(out, FORMAT_MENU_ITEM, desc->menu[m].index, desc->menu[m].name);
+            }
+
+            out_printf(out, " } }");
+            controls_count++;
+            device_job_flush(job);
+        }
+    }
+
+    if (job->control[0] && !controls_count)
+    {
+        job_reply(job, 404, "", "Unknown control.");
+        return;
+    }
+
+    out_printf(out, " }\n");
+    job_reply_json(job);
+}
+
+static int control_write_order_cmp(const void *a, const void *b)
+{
+    return ((struct control_write *)a)->order - ((struct control_write *)b)->order;
+}
+
+static int control_write_class_cmp(const void *a, const void *b)
+{
+    const struct control_write *wa = (const struct control_write *)a;
+    const struct control_write *wb = (const struct control_write *)b;
+    __u32 ca = V4L2_CTRL_ID2CLASS(wa->desc->id);
+    __u32 cb = V4L2_CTRL_ID2CLASS(wb->desc->id);
+
+    if (ca != cb)
+    {
+        return ca < cb ? -1 : 1;
+    }
+    return wa->order - wb->order;
+}
+
+/*
+ * One VIDIOC_*_EXT_CTRLS call for a group of controls of the same class.
+ * With set_values the requested (or saved) values are written, otherwise
+ * the values reported by the driver are stored back into the group.
+ */
+static int control_batch_ioctl(int fd, unsigned long request,
+                               struct control_write *writes, int count,
+                               struct v4l2_ext_control *ext, int set_values)
+{
+    struct v4l2_ext_controls ctrls;
+    int i;
+
+    memset(&ctrls, 0, sizeof(struct v4l2_ext_controls));
+    memset(ext, 0, count * sizeof(struct v4l2_ext_control));
+    ctrls.ctrl_class = V4L2_CTRL_ID2CLASS(writes[0].desc->id);
+    ctrls.count = count;
+    ctrls.controls = ext;
+
+    for (i = 0; i < count; i++)
+    {
+        ext[i].id = writes[i].desc->id;
+        if (set_values)
+        {
+            if (writes[i].desc->type == V4L2_CTRL_TYPE_INTEGER64)
+            {
+                ext[i].value64 = writes[i].value;
+            }
+            else
+            {
+                ext[i].value = (__s32)writes[i].value;
+            }
+        }
+    }
+
+    if (device_ioctl(fd, request, &ctrls) != 0)
+    {
+        int err = errno;
+        for (i = 0; i < count; i++)
+        {
+            if (ctrls.error_idx >= ctrls.count || ctrls.error_idx == (__u32)i)
+            {
+                writes[i].err = err;
+            }
+        }
+        return -1;
+    }
+
+    if (!set_values)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (writes[i].desc->type == V4L2_CTRL_TYPE_INTEGER64)
+            {
+                writes[i].value = ext[i].value64;
+            }
+            else
+            {
+                writes[i].value = ext[i].value;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Per-control path, used when the driver rejects the batch, so every
+ * control still gets applied (or reports its own error).
+ */
+static void control_write_single(int fd, struct control_write *write, int set_value)
+{
+    struct v4l2_ext_control ext;
     struct v4l2_control ctrl;
-    struct v4l2_querymenu querymenu;
-    char *var_name;
-    char control[1024] = {'\0'};
-    char controls[65536] = {'\0'};
-    char json_path[256] = {'\0'};
+
+    write->err = 0;
+
+    // 64-bit values don't fit struct v4l2_control, one element batch instead
+    if (write->desc->type == V4L2_CTRL_TYPE_INTEGER64)
+    {
+        if ((set_value && control_batch_ioctl(fd, VIDIOC_S_EXT_CTRLS, write, 1, &ext, 1) != 0) ||
+            control_batch_ioctl(fd, VIDIOC_G_EXT_CTRLS, write, 1, &ext, 0) != 0)
+        {
+            return;
+        }
+        write->applied = 1;
+        return;
+    }
+
+    memset(&ctrl, 0, sizeof(struct v4l2_control));
+    ctrl.id = write->desc->id;
+    ctrl.value = (__s32)write->value;
+
+    if (set_value && device_ioctl(fd, VIDIOC_S_CTRL, &ctrl) != 0)
+    {
+        write->err = errno;
+        return;
+    }
+
+    if (device_ioctl(fd, VIDIOC_G_CTRL, &ctrl) != 0)
+    {
+        write->err = errno;
+        return;
+    }
+    write->value = ctrl.value;
+    write->applied = 1;
+}
+
+static void control_group_readback(int fd, struct control_write *writes, int count,
+                                   struct v4l2_ext_control *ext)
+{
+    int i;
+
+    if (control_batch_ioctl(fd, VIDIOC_G_EXT_CTRLS, writes, count, ext, 0) == 0)
+    {
+        for (i = 0; i < count; i++)
+        {
+            writes[i].applied = 1;
+        }
+        return;
+    }
+
+    // e.g. write-only control in the group, read one by one
+    for (i = 0; i < count; i++)
+    {
+        control_write_single(fd, &writes[i], 0);
+    }
+}
+
+static int control_group_end(struct control_write *writes, int start, int count)
+{
+    int end = start + 1;
+    __u32 ctrl_class = V4L2_CTRL_ID2CLASS(writes[start].desc->id);
+
+    while (end < count && V4L2_CTRL_ID2CLASS(writes[end].desc->id) == ctrl_class)
+    {
+        end++;
+    }
+    return end;
+}
+
+/*
+ * Best effort: every class group is tried and set in one call, groups
+ * rejected by the driver fall back to VIDIOC_S_CTRL per control.
+ */
+static void control_writes_apply(int fd, struct control_write *writes, int count,
+                                 struct v4l2_ext_control *ext)
+{
+    int start;
+    int end;
+    int i;
+
+    for (start = 0; start < count; start = end)
+    {
+        end = control_group_end(writes, start, count);
+
+        if (control_batch_ioctl(fd, VIDIOC_TRY_EXT_CTRLS, writes + start, end - start, ext, 1) == 0 &&
+            control_batch_ioctl(fd, VIDIOC_S_EXT_CTRLS, writes + start, end - start, ext, 1) == 0)
+        {
+            control_group_readback(fd, writes + start, end - start, ext);
+            continue;
+        }
+
+        for (i = start; i < end; i++)
+        {
+            control_write_single(fd, &writes[i], 1);
+        }
+    }
+}
+
+/*
+ * All or nothing: every group is tried first, then set. If setting a group
+ * fails, groups set before it are restored to their previous values.
+ */
+static void control_writes_apply_atomic(int fd, struct control_write *writes, int count,
+                                        struct v4l2_ext_control *ext)
+{
+    struct control_write *saved;
+    int start;
+    int end;
+    int failed = 0;
+    int i;
+
+    if (count <= 0)
+    {
+        return;
+    }
+
+    for (start = 0; start < count && !failed; start = end)
+    {
+        end = control_group_end(writes, start, count);
+        failed = control_batch_ioctl(fd, VIDIOC_TRY_EXT_CTRLS, writes + start, end - start, ext, 1) != 0;
+    }
+
+    saved = failed ? NULL : malloc(count * sizeof(struct control_write));
+    if (!failed && !saved)
+    {
+        for (i = 0; i < count; i++)
+        {
+            writes[i].err = ENOMEM;
+        }
+        return;
+    }
+
+    if (saved)
+    {
+        memcpy(saved, writes, count * sizeof(struct control_write));
+
+        for (start = 0; start < count && !failed; start = end)
+        {
+            end = control_group_end(writes, start, count);
+            if (control_batch_ioctl(fd, VIDIOC_G_EXT_CTRLS, saved + start, end - start, ext, 0) != 0 ||
+                control_batch_ioctl(fd, VIDIOC_S_EXT_CTRLS, writes + start, end - start, ext, 1) != 0)
+            {
+                if (saved[start].err && !writes[start].err)
+                {
+                    writes[start].err = saved[start].err;
+                }
+                failed = 1;
+                while (start > 0)
+                {
+                    int prev = start - 1;
+                    __u32 ctrl_class = V4L2_CTRL_ID2CLASS(writes[prev].desc->id);
+
+                    while (prev > 0 && V4L2_CTRL_ID2CLASS(writes[prev - 1].desc->id) == ctrl_class)
+                    {
+                        prev--;
+                    }
+                    if (control_batch_ioctl(fd, VIDIOC_S_EXT_CTRLS, saved + prev, start - prev, ext, 1) != 0)
+                    {
+                        LOGERROR("Restoring controls after failed atomic set failed: %s", strerror(errno));
+                    }
+                    start = prev;
+                }
+            }
+        }
+        free(saved);
+    }
+
+    if (failed)
+    {
+        for (i = 0; i < count; i++)
+        {
+            if (!writes[i].err)
+            {
+                writes[i].error = "Error: Not applied";
+            }
+        }
+        return;
+    }
+
+    for (start = 0; start < count; start = end)
+    {
+        end = control_group_end(writes, start, count);
+        control_group_readback(fd, writes + start, end - start, ext);
+    }
+}
+
+static void device_control_set(struct device_job *job);
+static void device_rpc(struct device_job *job);
+
+/*
+ * Drop the writes of controls that a queued control object sets again.
+ * Keys go through the control index, the same control can be spelt
+ * differently by different requests.
+ */
+static int control_writes_supersede(struct device_state *state, const char *body, int len,
+                                    struct control_write *writes, int count)
+{
+    struct control_desc *desc;
+    int koff, klen, voff, vlen, vtype, off;
+    int coalesced = 0;
+    int i;
+
+    if (mjson_find(body, len, "$.atomic", NULL, NULL) == MJSON_TOK_TRUE)
+    {
+        return 0;
+    }
+
+    for (off = 0; (off = mjson_next(body, len, off, &koff, &klen, &voff, &vlen, &vtype)) != 0;)
+    {
+        if (klen < 2 || vtype != MJSON_TOK_NUMBER ||
+            (desc = control_find(state, body + koff + 1, klen - 2)) == NULL)
+        {
+            continue;
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            if (writes[i].desc && writes[i].desc->id == desc->id)
+            {
+                writes[i].desc = NULL;
+                writes[i].error = "Coalesced";
+                coalesced++;
+            }
+        }
+    }
+
+    return coalesced;
+}
+
+/*
+ * Same for a queued JSON-RPC request: only "set" carries control writes.
+ */
+static int control_writes_supersede_rpc(struct device_state *state, const char *request, int len,
+                                        struct control_write *writes, int count)
+{
+    char method[8];
+    const char *params;
+    int params_len;
+
+    if (mjson_get_string(request, len, "$.method", method, sizeof(method)) < 0 || strcmp(method, "set") ||
+        mjson_find(request, len, "$.params", &params, &params_len) != MJSON_TOK_OBJECT)
+    {
+        return 0;
+    }
+
+    return control_writes_supersede(state, params, params_len, writes, count);
+}
+
+/*
+ * Last write wins. Queued POST requests and WebSocket "set" calls for the
+ * device form the pending write table: a write whose control is set again
+ * by a later queued request is skipped and answered as coalesced, so a
+ * fast slider costs one ioctl per driver round trip instead of a growing
+ * queue. Atomic requests neither supersede nor get superseded.
+ */
+static int control_writes_coalesce(struct device_job *job, struct device_state *state,
+                                   struct control_write *writes, int count)
+{
+    struct device_job *queued;
+    int koff, klen, voff, vlen, vtype, off;
+    int coalesced = 0;
+
+    if (!job->worker || !state)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&s_workers_lock);
+    for (queued = job->worker->head; queued != NULL; queued = queued->next)
+    {
+        if (!queued->body)
+        {
+            continue;
+        }
+
+        if (queued->handler == device_control_set)
+        {
+            coalesced += control_writes_supersede(state, queued->body, queued->body_len, writes, count);
+        }
+        else if (queued->handler == device_rpc && queued->body_len && queued->body[0] == '[')
+        {
+            for (off = 0; (off = mjson_next(queued->body, queued->body_len, off, &koff, &klen, &voff, &vlen, &vtype)) != 0;)
+            {
+                coalesced += control_writes_supersede_rpc(state, queued->body + voff, vlen, writes, count);
+            }
+        }
+        else if (queued->handler == device_rpc)
+        {
+            coalesced += control_writes_supersede_rpc(state, queued->body, queued->body_len, writes, count);
+        }
+    }
+    pthread_mutex_unlock(&s_workers_lock);
+
+    if (coalesced)
+    {
+        LOGDEBUG("Device %s: %d control writes coalesced", job->device_name, coalesced);
+    }
+
+    return coalesced;
+}
+
+static void device_control_set(struct device_job *job)
+{
+    struct device_state *state;
+    struct control_desc *desc;
+    struct control_write *writes;
+    struct control_write *write;
+    struct v4l2_ext_control *ext;
+    struct out_buf *out = &job->out;
+    char value[CONTROL_VALUE_SIZE];
+    int atomic = 0;
+    int count = 0;
+    int valid = 0;
+    int i;
+    int koff, klen, voff, vlen, vtype, off;
+    int fd = device_fd(job);
+
+    if (fd < 0)
+    {
+        job_reply(job, 400, "", "Device can't be opened.");
+        return;
+    }
+
+    writes = calloc(MAX_SET_CONTROLS, sizeof(struct control_write));
+    ext = calloc(MAX_SET_CONTROLS, sizeof(struct v4l2_ext_control));
+    if (!writes || !ext)
+    {
+        free(writes);
+        free(ext);
+        job_reply(job, 500, "", "Out of memory.");
+        return;
+    }
+
+    state = device_state_controls(job, fd);
+
+    // Walk the request body once, keys are looked up in the control index
+    for (off = 0; (off = mjson_next(job->body, job->body_len, off, &koff, &klen, &voff, &vlen, &vtype)) != 0;)
+    {
+        if (klen < 2)
+        {
+            continue;
+        }
+
+        if (klen == 8 && !strncmp(job->body + koff, "\"atomic\"", 8))
+        {
+            atomic = (vtype == MJSON_TOK_TRUE);
+            continue;
+        }
+
+        if (count >= MAX_SET_CONTROLS)
+        {
+            LOGERROR("Device %s: too many controls in request", job->device_name);
+            break;
+        }
+
+        write = &writes[count];
+        write->order = count++;
+
+        json_key_copy(write->name, sizeof(write->name), job->body + koff + 1, klen - 2);
+        desc = control_find(state, job->body + koff + 1, klen - 2);
+
+        if (!desc)
+        {
+            write->error = "Error: Unknown control";
+            LOGERROR("Device %s control %s: Unknown control", job->device_name, write->name);
+        }
+        else if (vtype != MJSON_TOK_NUMBER)
+        {
+            write->error = "Error: Only numbers are expected";
+            LOGERROR("Device %s control %s: Only numbers are expected", job->device_name, write->name);
+        }
+        else
+        {
+            write->desc = desc;
+            write->value = json_number_s64(job->body + voff, vlen);
+            LOGDEBUG("Device %s control %s set %lld", job->device_name, write->name, write->value);
+            valid++;
+        }
+    }
+
+    if (!atomic)
+    {
+        valid -= control_writes_coalesce(job, state, writes, count);
+    }
+
+    // Valid writes first, grouped by control class
+    for (i = 0; i < count; i++)
+    {
+        if (!writes[i].desc)
+        {
+            writes[i].order += MAX_SET_CONTROLS;
+        }
+    }
+    qsort(writes, count, sizeof(struct control_write), control_write_order_cmp);
+    qsort(writes, valid, sizeof(struct control_write), control_write_class_cmp);
+
+    if (valid && atomic && valid < count)
+    {
+        for (i = 0; i < valid; i++)
+        {
+            writes[i].error = "Error: Not applied";
+        }
+    }
+    else if (valid && atomic)
+    {
+        control_writes_apply_atomic(fd, writes, valid, ext);
+    }
+    else if (valid)
+    {
+        control_writes_apply(fd, writes, valid, ext);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        writes[i].order %= MAX_SET_CONTROLS;
+    }
+    qsort(writes, count, sizeof(struct control_write), control_write_order_cmp);
+
+    out_printf(out, "{ ");
+    for (i = 0; i < count; i++)
+    {
+        write = &writes[i];
+        if (i)
+        {
+            out_printf(out, ", ");
+        }
+
+        if (write->error)
+        {
+            out_printf(out, FORMAT_CONTROL_STRING, write->name, write->error);
+        }
+        else if (write->err || !write->applied)
+        {
+            out_printf(out, FORMAT_CONTROL_STRING, write->name, strerror(write->err));
+            LOGERROR("Device %s control %s: %s", job->device_name, write->name, strerror(write->err));
+        }
+        else
+        {
+            out_printf(out, FORMAT_CONTROL_VALUE, write->name, control_value(value, sizeof(value), write->value));
+            LOGDEBUG("Device %s control %s get %lld", job->device_name, write->name, write->value);
+        }
+    }
+    out_printf(out, " }\n");
+
+    free(writes);
+    free(ext);
+    job_reply_json(job);
+}
+
+static int device_buffer_check(struct v4l2_capability *cap, int buffer_index, int exclude_overlay)
+{
+    switch (buffer_index)
+    {
+    case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+        return (cap->capabilities & V4L2_CAP_VIDEO_CAPTURE);
+
+    case V4L2_BUF_TYPE_VIDEO_OUTPUT:
+        return (cap->capabilities & V4L2_CAP_VIDEO_OUTPUT);
+
+    case V4L2_BUF_TYPE_VIDEO_OVERLAY:
+        return !exclude_overlay && (cap->capabilities & V4L2_CAP_VIDEO_OVERLAY);
+
+    case V4L2_BUF_TYPE_VBI_CAPTURE:
+        return (cap->capabilities & V4L2_CAP_VBI_CAPTURE);
+
+    case V4L2_BUF_TYPE_VBI_OUTPUT:
+        return (cap->capabilities & V4L2_CAP_VBI_OUTPUT);
+
+    case V4L2_BUF_TYPE_SLICED_VBI_CAPTURE:
+        return (cap->capabilities & V4L2_CAP_SLICED_VBI_CAPTURE);
+
+    case V4L2_BUF_TYPE_SLICED_VBI_OUTPUT:
+        return (cap->capabilities & V4L2_CAP_SLICED_VBI_OUTPUT);
+
+    case V4L2_BUF_TYPE_VIDEO_OUTPUT_OVERLAY:
+        return !exclude_overlay && (cap->capabilities & V4L2_CAP_VIDEO_OUTPUT_OVERLAY);
+
+    case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+        return (cap->capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE);
+
+    case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+        return (cap->capabilities & V4L2_CAP_VIDEO_OUTPUT_MPLANE);
+    }
+
+    return 0;
+}
+
+static void *array_append(void *items, int *count, int *capacity, size_t size)
+{
+    char *grown;
+
+    if (*count == *capacity)
+    {
+        int new_capacity = *capacity ? *capacity * 2 : 8;
+        grown = realloc(*(char **)items, new_capacity * size);
+        if (!grown)
+        {
+            return NULL;
+        }
+        *(char **)items = grown;
+        *capacity = new_capacity;
+    }
+
+    grown = *(char **)items + (*count)++ * size;
+    memset(grown, 0, size);
+    return grown;
+}
+
+static void frame_intervals_load(int fd, struct pixel_format *format, struct frame_size *size)
+{
+    struct v4l2_frmivalenum frmival;
+    struct v4l2_fract *interval;
+    int capacity = 0;
+
+    memset(&frmival, 0, sizeof(struct v4l2_frmivalenum));
+    frmival.pixel_format = format->pixelformat;
+    frmival.width = size->max_width;
+    frmival.height = size->max_height;
+
+    while (device_ioctl(fd, VIDIOC_ENUM_FRAMEINTERVALS, &frmival) == 0)
+    {
+        frmival.index++;
+        size->intervals_type = frmival.type;
+
+        if (frmival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+        {
+            interval = array_append(&size->intervals, &size->intervals_count, &capacity, sizeof(struct v4l2_fract));
+            if (!interval)
+            {
+                return;
+            }
+            *interval = frmival.discrete;
+            continue;
+        }
+
+        // Stepwise and continuous are stored as min, max, step
+        size->intervals = calloc(3, sizeof(struct v4l2_fract));
+        if (size->intervals)
+        {
+            size->intervals[0] = frmival.stepwise.min;
+            size->intervals[1] = frmival.stepwise.max;
+            size->intervals[2] = frmival.stepwise.step;
+            size->intervals_count = 3;
+        }
+        return;
+    }
+}
+
+/*
+ * Capability index: buffer type / pixel format -> frame sizes -> frame
+ * intervals. Enumerated once, then format listings and mode queries are
+ * answered without ioctls. Stepwise intervals are taken at the max size.
+ */
+static void device_state_load_formats(struct device_state *state, int fd)
+{
+    struct v4l2_capability cap;
+    struct v4l2_fmtdesc fmtdesc;
+    struct v4l2_frmsizeenum frmsize;
+    struct pixel_format *format;
+    struct frame_size *size;
+    int formats_capacity = 0;
+    int sizes_capacity;
+    int c;
+
+    memset(&cap, 0, sizeof(struct v4l2_capability));
+    if (device_ioctl(fd, VIDIOC_QUERYCAP, &cap) < 0)
+    {
+        return;
+    }
+    state->capabilities = cap.capabilities;
+
+    for (c = 1; c < 14; c++)
+    {
+        if (!device_buffer_check(&cap, c, 0))
+        {
+            continue;
+        }
+
+        memset(&fmtdesc, 0, sizeof(struct v4l2_fmtdesc));
+        fmtdesc.type = c;
+
+        while (device_ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0)
+        {
+            fmtdesc.index++;
+
+            format = array_append(&state->formats, &state->formats_count, &formats_capacity, sizeof(struct pixel_format));
+            if (!format)
+            {
+                return;
+            }
+            format->buf_type = c;
+            format->pixelformat = fmtdesc.pixelformat;
+            sizes_capacity = 0;
+
+            memset(&frmsize, 0, sizeof(struct v4l2_frmsizeenum));
+            frmsize.pixel_format = fmtdesc.pixelformat;
+
+            while (device_ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) == 0)
+            {
+                frmsize.index++;
+                if (frmsize.type != V4L2_FRMSIZE_TYPE_DISCRETE &&
+                    frmsize.type != V4L2_FRMSIZE_TYPE_STEPWISE &&
+                    frmsize.type != V4L2_FRMSIZE_TYPE_CONTINUOUS)
+                {
+                    continue;
+                }
+
+                size = array_append(&format->sizes, &format->sizes_count, &sizes_capacity, sizeof(struct frame_size));
+                if (!size)
+                {
+                    break;
+                }
+
+                size->type = frmsize.type;
+                if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+                {
+                    size->min_width = size->max_width = frmsize.discrete.width;
+                    size->min_height = size->max_height = frmsize.discrete.height;
+                    size->step_width = size->step_height = 1;
+                }
+                else
+                {
+                    size->min_width = frmsize.stepwise.min_width;
+                    size->min_height = frmsize.stepwise.min_height;
+                    size->max_width = frmsize.stepwise.max_width;
+                    size->max_height = frmsize.stepwise.max_height;
+                    size->step_width = frmsize.stepwise.step_width ? frmsize.stepwise.step_width : 1;
+                    size->step_height = frmsize.stepwise.step_height ? frmsize.stepwise.step_height : 1;
+                }
+
+                frame_intervals_load(fd, format, size);
+            }
+        }
+    }
+}
+
+/*
+ * Checksum of the cached formats, the entity tag of the replies built only
+ * from them. Changes whenever the driver reports anything different.
+ */
+static uint32_t device_state_formats_crc(struct device_state *state)
+{
+    struct pixel_format *format;
+    struct frame_size *size;
+    uint32_t crc = mg_crc32(0, (const char *)&state->capabilities, sizeof(state->capabilities));
+    int f;
+    int s;
+
+    for (f = 0; f < state->formats_count; f++)
+    {
+        format = &state->formats[f];
+        crc = mg_crc32(crc, (const char *)&format->buf_type, sizeof(format->buf_type));
+        crc = mg_crc32(crc, (const char *)&format->pixelformat, sizeof(format->pixelformat));
+
+        for (s = 0; s < format->sizes_count; s++)
+        {
+            size = &format->sizes[s];
+            // Fields up to the intervals pointer, without the padding
+            crc = mg_crc32(crc, (const char *)size, offsetof(struct frame_size, intervals_count) + sizeof(size->intervals_count));
+            crc = mg_crc32(crc, (const char *)size->intervals, size->intervals_count * sizeof(struct v4l2_fract));
+        }
+    }
+
+    return crc;
+}
+
+/*
+ * Sets the ETag of the reply. Returns 1 and turns the reply into 304 Not
+ * Modified if the client sent it in If-None-Match.
+ */
+static int job_not_modified(struct device_job *job, const char *prefix, uint32_t crc)
+{
+    struct mg_str inm = mg_str(job->if_none_match);
+
+    snprintf(job->etag, sizeof(job->etag), "\"%s-%08x\"", prefix, (unsigned)crc);
+    if (!job->if_none_match[0] || !etag_match_any(&inm, job->etag))
+    {
+        return 0;
+    }
+
+    job->out.len = 0;
+    job->status = 304;
+    job->headers = "";
+    return 1;
+}
+
+static struct device_state *device_state_formats(struct device_job *job, int fd)
+{
+    struct device_state *state = job->state;
+
+    if (!state->formats_loaded)
+    {
+        device_state_load_formats(state, fd);
+        state->formats_crc = device_state_formats_crc(state);
+        state->formats_loaded = 1;
+        LOGDEBUG("Device %s: cached %d formats", job->device_name, state->formats_count);
+    }
+
+    return state;
+}
+
+static void frame_intervals_print(struct out_buf *out, struct frame_size *size)
+{
+    int i;
+
+    if (!size->intervals_count)
+    {
+        return;
+    }
+
+    if (size->intervals_type == V4L2_FRMIVAL_TYPE_DISCRETE)
+    {
+        out_printf(out, ", \"intervals\": [ ");
+        for (i = 0; i < size->intervals_count; i++)
+        {
+            out_printf(out, i ? ", \"%u/%u\"" : "\"%u/%u\"",
+                       size->intervals[i].numerator,
+                       size->intervals[i].denominator);
+        }
+        out_printf(out, " ]");
+        return;
+    }
+
+    out_printf(out, FORMAT_INTERVAL_STEPWISE,
+               size->intervals_type == V4L2_FRMIVAL_TYPE_STEPWISE ? "STEPWISE" : "CONTINUOUS",
+               size->intervals[0].numerator, size->intervals[0].denominator,
+               size->intervals[1].numerator, size->intervals[1].denominator,
+               size->intervals[2].numerator, size->intervals[2].denominator);
+}
+
+static void device_formats(struct device_job *job)
+{
+    struct device_state *state;
+    struct pixel_format *format;
+    struct frame_size *size;
+    struct v4l2_capability cap;
+    struct out_buf *out = &job->out;
+    char fourcc[5];
+    int format_count = 0;
+    int buffers_count = 0;
+    int c;
+    int f;
+    int s;
+
+    int fd = device_fd(job);
+
+    if (fd < 0)
+    {
+        job_reply(job, 400, "", "Device can't be opened.");
+        return;
+    }
+
+    state = device_state_formats(job, fd);
+    if (job_not_modified(job, "f", state->formats_crc))
+    {
+        return;
+    }
+
+    // Compressed replies are cached with the formats
+    if (job->encoding != ENCODING_IDENTITY && state->formats_compressed[job->encoding].len)
+    {
+        out_print(state->formats_compressed[job->encoding].buf, state->formats_compressed[job->encoding].len, out);
+        job->precompressed = 1;
+        job_reply_json(job);
+        return;
+    }
+    if (job->encoding != ENCODING_IDENTITY)
+    {
+        job->no_chunks = 1;
+    }
+
+    memset(&cap, 0, sizeof(struct v4l2_capability));
+    cap.capabilities = state->capabilities;
+
+    out_printf(out, "{ ");
+    for (c = 1; c < 14; c++)
+    {
+        if (!device_buffer_check(&cap, c, 0))
+        {
+            continue;
+        }
+
+        if (buffers_count)
+        {
+            out_printf(out, ", ");
+        }
+        out_printf(out, "%Q: { ", v4l2_buffer_type_names[c - 1].name);
+        buffers_count++;
+        format_count = 0;
+
+        for (f = 0; f < state->formats_count; f++)
+        {
+            format = &state->formats[f];
+            if (format->buf_type != (__u32)c)
+            {
+                continue;
+            }
+            fourcc_name(format->pixelformat, fourcc);
+
+            for (s = 0; s < format->sizes_count; s++)
+            {
+                size = &format->sizes[s];
+
+                if (format_count)
+                {
+                    out_printf(out, ", ");
+                }
+                format_count++;
+
+                if (size->type == V4L2_FRMSIZE_TYPE_DISCRETE)
+                {
+                    out_printf(out, FORMAT_DISCRETE,
+                               fourcc,
+                               size->max_width,
+                               size->max_height);
+                }
+                else
+                {
+                    out_printf(out, FORMAT_STEPWISE,
+                               fourcc,
+                               size->type == V4L2_FRMSIZE_TYPE_STEPWISE ? "STEPWISE" : "CONTINUOUS",
+                               size->min_width,
+                               size->min_height,
+                               size->max_width,
+                               size->max_height,
+                               size->step_width,
+                               size->step_height);
+                }
+                frame_intervals_print(out, size);
+                out_printf(out, " }");
+                device_job_flush(job);
+            }
+        }
+        out_printf(out, " }");
+    }
+    out_printf(out, " }\n");
+
+    job_reply_json(job);
+
+    if (job->encoding != ENCODING_IDENTITY && out->len >= COMPRESS_MIN_SIZE && !out->overflow &&
+        compress_buf(job->encoding, out->buf, out->len, &state->formats_compressed[job->encoding]) == 0)
+    {
+        out->len = 0;
+        out_print(state->formats_compressed[job->encoding].buf, state->formats_compressed[job->encoding].len, out);
+        job->precompressed = 1;
+    }
+}
+
+/*
+ * Smallest value >= wanted that the stepwise range allows, 0 if none.
+ */
+static __u32 frame_size_fit(__u32 wanted, __u32 min, __u32 max, __u32 step)
+{
+    // 64-bit so rounding up near UINT32_MAX can't wrap below max
+    unsigned long long value = wanted > min ? wanted : min;
+
+    if (value > max)
+    {
+        return 0;
+    }
+    if (step > 1)
+    {
+        value = min + (value - min + step - 1) / step * step;
+    }
+    return value <= max ? (__u32)value : 0;
+}
+
+/*
+ * Best (fastest) interval of a frame size, 0/0 when the driver doesn't
+ * enumerate intervals.
+ */
+static struct v4l2_fract frame_size_best_interval(struct frame_size *size, double min_fps)
+{
+    struct v4l2_fract best = {0, 0};
+    double fps;
+    double best_fps = 0;
+    int i;
+    int count = size->intervals_type == V4L2_FRMIVAL_TYPE_DISCRETE ? size->intervals_count : (size->intervals_count ? 1 : 0);
+
+    // For stepwise intervals the minimum interval is the highest rate
+    for (i = 0; i < count; i++)
+    {
+        if (!size->intervals[i].numerator)
+        {
+            continue;
+        }
+        fps = (double)size->intervals[i].denominator / size->intervals[i].numerator;
+        if (fps >= min_fps && fps > best_fps)
+        {
+            best_fps = fps;
+            best = size->intervals[i];
+        }
+    }
+
+    return best;
+}
+
+/*
+ * GET /device/modes/{device}?format=MJPG&min_width=1920&min_height=1080&min_fps=30
+ * Picks the smallest frame size satisfying the request, on ties the one
+ * with the highest frame rate. Answered from the capability index.
+ */
+static void device_modes(struct device_job *job)
+{
+    struct device_state *state;
+    struct pixel_format *format;
+    struct pixel_format *best_format = NULL;
+    struct frame_size *size;
+    struct v4l2_fract interval;
+    struct v4l2_fract best_interval = {0, 0};
     char buf[32];
-    const unsigned next_fl = V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND;
-    double dv;
-    int controls_count = 0;
-    int fd = device_open(device_name);
+    char fourcc[5] = {'\0'};
+    int fourcc_len;
+    __u32 min_width = 0;
+    __u32 min_height = 0;
+    __u32 width, height;
+    __u32 best_width = 0;
+    __u32 best_height = 0;
+    double min_fps = 0;
+    double fps;
+    double best_fps = 0;
+    int f;
+    int s;
+    int matches = 0;
+    int fd;
+
+    // Short codes such as "Y16" are space padded like v4l2 does. Anything
+    // but 1 to 4 characters is an error, never "any format".
+    fourcc_len = mg_http_get_var(&job->query, "format", fourcc, sizeof(fourcc));
+    if (fourcc_len > 0)
+    {
+        for (f = fourcc_len; f < 4; f++)
+        {
+            fourcc[f] = ' ';
+        }
+    }
+    else if (fourcc_len != -1 && fourcc_len != -4)
+    {
+        job_reply(job, 400, "", "Invalid format, expected a fourcc of 1 to 4 characters.");
+        return;
+    }
+    if (mg_http_get_var(&job->query, "min_width", buf, sizeof(buf)) > 0)
+    {
+        min_width = strtoul(buf, NULL, 10);
+    }
+    if (mg_http_get_var(&job->query, "min_height", buf, sizeof(buf)) > 0)
+    {
+        min_height = strtoul(buf, NULL, 10);
+    }
+    if (mg_http_get_var(&job->query, "min_fps", buf, sizeof(buf)) > 0)
+    {
+        min_fps = strtod(buf, NULL);
+    }
+
+    fd = device_fd(job);
+    if (fd < 0)
+    {
+        job_reply(job, 400, "", "Device can't be opened.");
+        return;
+    }
+    state = device_state_formats(job, fd);
+
+    // The mode depends on the formats and the query only
+    if (job_not_modified(job, "m", mg_crc32(state->formats_crc, job->query.ptr, job->query.len)))
+    {
+        return;
+    }
+
+    for (f = 0; f < state->formats_count; f++)
+    {
+        format = &state->formats[f];
+        if (fourcc[0] && format->pixelformat != v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]))
+        {
+            continue;
+        }
+
+        for (s = 0; s < format->sizes_count; s++)
+        {
+            size = &format->sizes[s];
+            width = frame_size_fit(min_width, size->min_width, size->max_width, size->step_width);
+            height = frame_size_fit(min_height, size->min_height, size->max_height, size->step_height);
+            if (!width || !height)
+            {
+                continue;
+            }
+
+            interval = frame_size_best_interval(size, min_fps);
+            if (min_fps > 0 && !interval.numerator)
+            {
+                continue;
+            }
+            fps = interval.numerator ? (double)interval.denominator / interval.numerator : 0;
+            matches++;
+
+            if (!best_format ||
+                (__u64)width * height < (__u64)best_width * best_height ||
+                ((__u64)width * height == (__u64)best_width * best_height && fps > best_fps))
+            {
+                best_format = format;
+                best_width = width;
+                best_height = height;
+                best_interval = interval;
+                best_fps = fps;
+            }
+        }
+    }
+
+    if (!best_format)
+    {
+        job_reply(job, 404, "", "No matching mode.");
+        return;
+    }
+
+    out_printf(&job->out, FORMAT_MODE,
+               v4l2_buffer_type_names[best_format->buf_type - 1].name,
+               fourcc_name(best_format->pixelformat, fourcc),
+               best_width,
+               best_height,
+               best_interval.numerator,
+               best_interval.denominator,
+               best_fps,
+               matches);
+    job_reply_json(job);
+}
+
+static const char *field_name_get(int field, char *snum)
+{
+    if (field > -1 && field < 10)
+    {
+        return v4l2_field_names[field].name;
+    }
+    sprintf(snum, "%d", field);
+    return snum;
+}
+
+static const char *colorspace_name_get(int colorspace, char *snum)
+{
+    if (colorspace > -1 && colorspace < 13)
+    {
+        return v4l2_colorspace_names[colorspace].name;
+    }
+    sprintf(snum, "%d", colorspace);
+    return snum;
+}
+
+static void device_format_get(struct device_job *job)
+{
+    struct v4l2_capability cap;
+    struct v4l2_format fmt;
+    struct out_buf *out = &job->out;
+    char fourcc[5];
+    char field_num[16];
+    char colorspace_num[16];
+    int buffers_count = 0;
+    int c;
+
+    int fd = device_fd(job);
+
+    if (fd < 0)
+    {
+        job_reply(job, 400, "", "Device can't be opened.");
+        return;
+    }
+
+    memset(&cap, 0, sizeof(struct v4l2_capability));
+
+    out_printf(out, "{ ");
+
+    if (device_ioctl(fd, VIDIOC_QUERYCAP, &cap) > -1)
+    {
+        for (c = 1; c < 14; c++)
+        {
+            if (!device_buffer_check(&cap, c, 1))
+            {
+                continue;
+            }
+
+            memset(&fmt, 0, sizeof(struct v4l2_format));
+            fmt.type = c;
+
+            if (buffers_count)
+            {
+                out_printf(out, ", ");
+            }
+            out_printf(out, "%Q: { ", v4l2_buffer_type_names[c - 1].name);
+
+            if (device_ioctl(fd, VIDIOC_G_FMT, &fmt) == 0)
+            {
+                out_printf(out, FORMAT_PIX_FORMAT,
+                           fmt.fmt.pix.width,
+                           fmt.fmt.pix.height,
+                           fourcc_name(fmt.fmt.pix.pixelformat, fourcc),
+                           field_name_get(fmt.fmt.pix.field, field_num),
+                           fmt.fmt.pix.bytesperline,
+                           fmt.fmt.pix.sizeimage,
+                           colorspace_name_get(fmt.fmt.pix.colorspace, colorspace_num),
+                           fmt.fmt.pix.priv,
+                           fmt.fmt.pix.flags);
+            }
+            else
+            {
+                out_printf(out, "\"status\": %Q", strerror(errno));
+            }
+            out_printf(out, " }");
+
+            buffers_count++;
+        }
+    }
+
+    out_printf(out, " }\n");
+    job_reply_json(job);
+}
+
+/*
+ * Grabs one frame through streaming I/O. The mapping outlives the fd, the
+ * driver frees the buffer with the last munmap().
+ */
+static int snapshot_capture(int fd, struct v4l2_buffer *buf, void **map)
+{
+    struct v4l2_requestbuffers req;
+    struct pollfd pfd;
+    unsigned long long deadline = metric_now_us() + SNAPSHOT_TIMEOUT_MS * 1000ULL;
+    unsigned long long now;
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int err = ETIMEDOUT;
+
+    memset(&req, 0, sizeof(struct v4l2_requestbuffers));
+    req.count = 1;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (device_ioctl(fd, VIDIOC_REQBUFS, &req) != 0)
+    {
+        return errno;
+    }
+    if (!req.count)
+    {
+        return ENOMEM;
+    }
+
+    memset(buf, 0, sizeof(struct v4l2_buffer));
+    buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf->memory = V4L2_MEMORY_MMAP;
+    if (device_ioctl(fd, VIDIOC_QUERYBUF, buf) != 0)
+    {
+        return errno;
+    }
+    *map = device_mmap(buf->length, PROT_READ, MAP_SHARED, fd, buf->m.offset);
+    if (*map == MAP_FAILED)
+    {
+        return errno;
+    }
+    if (device_ioctl(fd, VIDIOC_QBUF, buf) != 0 || device_ioctl(fd, VIDIOC_STREAMON, &type) != 0)
+    {
+        return errno;
+    }
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while ((now = metric_now_us()) < deadline)
+    {
+        if (poll(&pfd, 1, (int)((deadline - now + 999) / 1000)) < 0 && errno != EINTR)
+        {
+            err = errno;
+            break;
+        }
+        if (device_ioctl(fd, VIDIOC_DQBUF, buf) == 0)
+        {
+            err = buf->flags & V4L2_BUF_FLAG_ERROR ? EIO : 0;
+            break;
+        }
+        if (errno != EAGAIN)
+        {
+            err = errno;
+            break;
+        }
+    }
+    device_ioctl(fd, VIDIOC_STREAMOFF, &type);
+
+    return err;
+}
+
+static unsigned char yuv_clip(int value)
+{
+    return value < 0 ? 0 : value > 255 ? 255 : (unsigned char)value;
+}
+
+// BT.601, limited range
+static void yuv_rgb(int y, int u, int v, unsigned char *rgb)
+{
+    y = 298 * (y - 16) + 128;
+    u -= 128;
+    v -= 128;
+
+    rgb[0] = yuv_clip((y + 409 * v) >> 8);
+    rgb[1] = yuv_clip((y - 100 * u - 208 * v) >> 8);
+    rgb[2] = yuv_clip((y + 516 * u) >> 8);
+}
+
+/*
+ * PNM of a raw frame. Rows without padding are sent from the mapping,
+ * padded rows are packed and YUYV is converted, both through job->out.
+ */
+static void snapshot_pnm(struct device_job *job, struct v4l2_pix_format *pix, const unsigned char *data, struct frame *frame)
+{
+    int channels = pix->pixelformat == V4L2_PIX_FMT_GREY ? 1 : 3;
+    int pixel = pix->pixelformat == V4L2_PIX_FMT_RGB24 ? 3 : pix->pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+    unsigned char *row = NULL;
+    __u32 x;
+    __u32 y;
+
+    // YUYV comes in pairs of pixels, an odd width would read past the row
+    if (pix->bytesperline < pix->width * pixel || (size_t)pix->bytesperline * pix->height > frame->len ||
+        (pix->pixelformat == V4L2_PIX_FMT_YUYV && pix->width % 2))
+    {
+        job_reply(job, 500, "", "Unexpected frame size.");
+        return;
+    }
+
+    job->status = 200;
+    job->headers = channels == 1 ? HEADERS_PGM : HEADERS_PPM;
+    out_printf(&job->out, "P%d\n%d %d\n255\n", channels == 1 ? 5 : 6, (int)pix->width, (int)pix->height);
+
+    if (pix->pixelformat != V4L2_PIX_FMT_YUYV && pix->bytesperline == pix->width * pixel)
+    {
+        frame->len = (size_t)pix->bytesperline * pix->height;
+        job->frame = frame;
+        __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    row = malloc(pix->width * channels + 3);
+    if (!row)
+    {
+        job_reply(job, 500, "", "Out of memory.");
+        return;
+    }
+    for (y = 0; y < pix->height; y++)
+    {
+        const unsigned char *src = data + (size_t)y * pix->bytesperline;
+
+        if (pix->pixelformat != V4L2_PIX_FMT_YUYV)
+        {
+            memcpy(row, src, pix->width * channels);
+        }
+        for (x = 0; pix->pixelformat == V4L2_PIX_FMT_YUYV && x < pix->width; x += 2, src += 4)
+        {
+            yuv_rgb(src[0], src[1], src[3], row + x * 3);
+            yuv_rgb(src[2], src[1], src[3], row + x * 3 + 3);
+        }
+        out_print((char *)row, pix->width * channels, &job->out);
+
+        if (!job->no_chunks && job->out.len >= REPLY_CHUNK_SIZE)
+        {
+            device_job_post(job, 0);
+        }
+    }
+    free(row);
+}
+
+/*
+ * GET /device/snapshot/{device}, one frame in the current format. A fd of
+ * its own keeps the worker fd and its event subscriptions out of
+ * streaming. JPEG leaves from the mapped driver buffer as it is.
+ */
+static void device_snapshot(struct device_job *job)
+{
+    struct v4l2_format fmt;
+    struct v4l2_buffer buf;
+    struct v4l2_pix_format *pix = &fmt.fmt.pix;
+    struct frame *frame;
+    void *map = MAP_FAILED;
+    int fd = device_open(job->device_name);
+    int err;
+
+    // Already compressed or large, raw
+    job->encoding = ENCODING_IDENTITY;
+
+    if (fd < 0)
+    {
+        job_reply(job, 400, "", "Device can't be opened.");
+        return;
+    }
+
+    memset(&fmt, 0, sizeof(struct v4l2_format));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (device_ioctl(fd, VIDIOC_G_FMT, &fmt) != 0)
+    {
+        device_close(fd);
+        job_reply(job, 400, "", "Device can't capture.");
+        return;
+    }
+    if (pix->pixelformat != V4L2_PIX_FMT_MJPEG && pix->pixelformat != V4L2_PIX_FMT_JPEG &&
+        pix->pixelformat != V4L2_PIX_FMT_GREY && pix->pixelformat != V4L2_PIX_FMT_RGB24 &&
+        pix->pixelformat != V4L2_PIX_FMT_YUYV)
+    {
+        device_close(fd);
+        job_reply(job, 415, "", "Unsupported pixel format.");
+        return;
+    }
+
+    err = snapshot_capture(fd, &buf, &map);
+    device_close(fd);
+    if (err)
+    {
+        if (map != MAP_FAILED)
+        {
+            munmap(map, buf.length);
+        }
+        LOGERROR("Device %s: snapshot failed: %s", job->device_name, strerror(err));
+        job_reply(job, err == EBUSY ? 409 : 500, "", "Capture failed: %s", strerror(err));
+        return;
+    }
+
+    frame = frame_mapped(map, buf.length, buf.bytesused);
+    if (!frame)
+    {
+        munmap(map, buf.length);
+        job_reply(job, 500, "", "Out of memory.");
+        return;
+    }
+
+    if (pix->pixelformat == V4L2_PIX_FMT_MJPEG || pix->pixelformat == V4L2_PIX_FMT_JPEG)
+    {
+        job->status = 200;
+        job->headers = HEADERS_JPEG;
+        job->frame = frame;
+        return;
+    }
+
+    snapshot_pnm(job, pix, map, frame);
+    frame_unref(frame);
+}
+
+static void device_job_free(struct device_job *job)
+{
+    if (job->compressing)
+    {
+        compress_end(&job->zs);
+    }
+    device_state_close(&job->local_state);
+    device_state_clear(&job->local_state);
+    free(job->body);
+    free((char *)job->query.ptr);
+    out_free(&job->out);
+    frame_unref(job->frame);
+    free(job);
+}
+
+static void reply_part_free(struct reply_part *part)
+{
+    out_free(&part->out);
+    frame_unref(part->frame);
+    free(part);
+}
+
+/*
+ * Writes straight to the socket while nothing is queued in c->send, so
+ * the body leaves from where it is without the copy into the connection
+ * buffer. Whatever the socket doesn't take is queued as usual.
+ */
+static void conn_sendv(struct mg_connection *c, struct iovec *iov, int count)
+{
+    struct http_loop *loop = (struct http_loop *)c->mgr->userdata;
+    struct msghdr msg;
+    ssize_t sent = 0;
+    int i;
+
+    if (!c->send.len && !c->is_closing)
+    {
+        memset(&msg, 0, sizeof(struct msghdr));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        sent = sendmsg((int)(size_t)c->fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            sent = 0; // errors show up again on mongoose's own write
+        }
+        metric_add(&loop->metrics.bytes_sent, sent);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if ((size_t)sent >= iov[i].iov_len)
+        {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        mg_send(c, (char *)iov[i].iov_base + sent, iov[i].iov_len - sent);
+        sent = 0;
+    }
+}
+
+static const char *reply_part_headers(struct reply_part *part, char *headers)
+{
+    int len = snprintf(headers, REPLY_HEADERS_SIZE, "%s", part->headers);
+
+    if (ENABLE_ZLIB && part->status == 200)
+    {
+        len += snprintf(headers + len, REPLY_HEADERS_SIZE - len, "Vary: Accept-Encoding\r\n");
+    }
+    if (part->encoding != ENCODING_IDENTITY)
+    {
+        len += snprintf(headers + len, REPLY_HEADERS_SIZE - len, "Content-Encoding: %s\r\n", s_encoding_names[part->encoding]);
+    }
+    if (part->etag[0])
+    {
+        snprintf(headers + len, REPLY_HEADERS_SIZE - len, "ETag: %s\r\n", part->etag);
+    }
+
+    return headers;
+}
+
+/*
+ * Connection ids are sequential, so id modulo the table size spreads them
+ * evenly and a lookup is one short chain instead of a walk of mgr->conns.
+ */
+static void loop_conn_add(struct http_loop *loop, struct http_conn *conn)
+{
+    struct http_conn **bucket = &loop->conns[conn->c->id % LOOP_CONN_BUCKETS];
+
+    conn->next = *bucket;
+    *bucket = conn;
+}
+
+static void loop_conn_remove(struct http_loop *loop, struct http_conn *conn)
+{
+    struct http_conn **entry = &loop->conns[conn->c->id % LOOP_CONN_BUCKETS];
+
+    while (*entry && *entry != conn)
+    {
+        entry = &(*entry)->next;
+    }
+    if (*entry)
+    {
+        *entry = conn->next;
+    }
+}
+
+static struct mg_connection *loop_conn_find(struct http_loop *loop, unsigned long conn_id)
+{
+    struct http_conn *conn;
+
+    for (conn = loop->conns[conn_id % LOOP_CONN_BUCKETS]; conn != NULL; conn = conn->next)
+    {
+        if (conn->c->id == conn_id)
+        {
+            return conn->c;
+        }
+    }
+
+    return NULL;
+}
+
+static void reply_part_send(struct http_loop *loop, struct reply_part *part)
+{
+    char headers[REPLY_HEADERS_SIZE];
+    char head[REPLY_HEADERS_SIZE + 64];
+    struct iovec iov[3];
+    struct mg_connection *c;
+    const char *buf = part->out.buf ? part->out.buf : "";
+    int len = (int)part->out.len;
+    int frame_len = part->frame ? (int)part->frame->len : 0;
+
+    // The client may have gone away while the worker was busy
+    c = loop_conn_find(loop, part->conn_id);
+    if (c != NULL)
+    {
+        if (part->ws)
+        {
+            // JSON-RPC replies and notifications, one text frame each
+            if (len)
+            {
+                mg_ws_send(c, buf, len, WEBSOCKET_OP_TEXT);
+            }
+        }
+        else if (part->raw)
+        {
+            // Event streams, no HTTP framing, last closes the connection.
+            // A client still busy with the previous frame skips this one.
+            if (part->frame && !(part->droppable && c->send.len))
+            {
+                iov[0].iov_base = (void *)buf;
+                iov[0].iov_len = len;
+                iov[1].iov_base = (void *)part->frame->data;
+                iov[1].iov_len = frame_len;
+                iov[2].iov_base = (void *)(part->trailer ? part->trailer : "");
+                iov[2].iov_len = part->trailer ? strlen(part->trailer) : 0;
+                conn_sendv(c, iov, 3);
+            }
+            else if (!part->frame)
+            {
+                mg_send(c, buf, len);
+            }
+            if (part->last)
+            {
+                c->is_draining = 1;
+            }
+        }
+        else if (part->first && part->last && part->out.overflow)
+        {
+            mg_http_reply(c, 500, "", "Reply too large.");
+        }
+        else if (part->first && part->last)
+        {
+            // Whole reply at once, sent without the extra copy of mg_http_reply()
+            iov[0].iov_base = head;
+            iov[0].iov_len = snprintf(head, sizeof(head), "HTTP/1.1 %d OK\r\n%sContent-Length: %d\r\n\r\n",
+                                      part->status, reply_part_headers(part, headers), len + frame_len);
+            iov[1].iov_base = (void *)buf;
+            iov[1].iov_len = len;
+            iov[2].iov_base = (void *)(part->frame ? part->frame->data : "");
+            iov[2].iov_len = frame_len;
+            conn_sendv(c, iov, 3);
+        }
+        else
+        {
+            if (part->first)
+            {
+                mg_printf(c, "HTTP/1.1 %d OK\r\n%sTransfer-Encoding: chunked\r\n\r\n", part->status, reply_part_headers(part, headers));
+            }
+            if (len)
+            {
+                mg_http_write_chunk(c, buf, len);
+            }
+            if (part->last)
+            {
+                mg_http_write_chunk(c, "", 0);
+            }
+        }
+    }
+
+    if (part->last && part->latency)
+    {
+        metric_observe(part->latency, metric_now_us() - part->started);
+    }
+    reply_part_free(part);
+}
+
+/*
+ * Queue a part for the event loop and wake it up.
+ */
+static void loop_post(struct http_loop *loop, struct reply_part *part)
+{
+    pthread_mutex_lock(&loop->lock);
+    part->next = loop->parts;
+    loop->parts = part;
+    pthread_mutex_unlock(&loop->lock);
+
+    // Lost wakeups are fine, the loop drains the whole list at once
+    if (send(loop->wakeup_sock, "", 1, MSG_DONTWAIT) < 0)
+    {
+        LOGDEBUG("Wakeup of event loop failed: %s", strerror(errno));
+    }
+}
+
+/*
+ * The first part decides: small single replies and replies that are not
+ * 200 go out as they are, everything else through the job's z_stream.
+ */
+static void device_job_compress(struct device_job *job, int last)
+{
+    struct out_buf compressed = {NULL, 0, 0, 0, 0};
+
+    if (!job->streamed)
+    {
+        if (job->encoding == ENCODING_IDENTITY || job->ws || job->precompressed)
+        {
+            return;
+        }
+        if (job->status != 200 || job->out.overflow || (last && job->out.len < COMPRESS_MIN_SIZE) ||
+            compress_init(&job->zs, job->encoding) != 0)
+        {
+            job->encoding = ENCODING_IDENTITY;
+            return;
+        }
+        job->compressing = 1;
+    }
+
+    if (!job->compressing)
+    {
+        return;
+    }
+
+    if (compress_append(&job->zs, job->out.buf ? job->out.buf : "", job->out.len, last, &compressed) != 0)
+    {
+        compressed.overflow = 1;
+    }
+    out_free(&job->out);
+    job->out = compressed;
+
+    if (last)
+    {
+        compress_end(&job->zs);
+        job->compressing = 0;
+    }
+}
+
+/*
+ * Hand over everything printed to job->out so far. Inline jobs send it
+ * directly, worker jobs queue it for the event loop and wake it up.
+ */
+static void device_job_post(struct device_job *job, int last)
+{
+    struct http_loop *loop = job->loop;
+    struct reply_part *part;
+
+    // Registry jobs have no connection to reply to
+    if (!job->conn_id)
+    {
+        return;
+    }
+
+    part = calloc(1, sizeof(struct reply_part));
+    if (!part)
+    {
+        LOGERROR("Device %s: reply dropped, out of memory", job->device_name);
+        return;
+    }
+
+    part->conn_id = job->conn_id;
+    part->status = job->status;
+    part->headers = job->headers;
+    part->first = !job->streamed;
+    part->last = last;
+    device_job_compress(job, last);
+
+    part->ws = job->ws;
+    part->encoding = job->encoding;
+    if (job->etag[0])
+    {
+        etag_variant(part->etag, sizeof(part->etag), job->etag, job->encoding);
+    }
+    if (last)
+    {
+        part->latency = job->latency;
+        part->started = job->started;
+    }
+    part->out = job->out;
+    memset(&job->out, 0, sizeof(struct out_buf));
+    part->frame = job->frame;
+    job->frame = NULL;
+    job->streamed = 1;
+
+    if (job->inline_reply)
+    {
+        reply_part_send(loop, part);
+        return;
+    }
+
+    loop_post(loop, part);
+}
+
+/*
+ * Called by enumerating handlers between entries. Once the reply grows
+ * over REPLY_CHUNK_SIZE it is streamed as chunked transfer encoding, so
+ * the client gets the first bytes early and the worker holds one chunk.
+ */
+static void device_job_flush(struct device_job *job)
+{
+    if (job->no_chunks || job->out.len < REPLY_CHUNK_SIZE)
+    {
+        return;
+    }
+    job_reply_json(job);
+    device_job_post(job, 0);
+}
+
+static void wakeup_fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
+{
+    struct http_loop *loop = (struct http_loop *)fn_data;
+    struct reply_part *part;
+    struct reply_part *parts = NULL;
+
+    if (ev == MG_EV_READ)
+    {
+        c->recv.len = 0;
+
+        pthread_mutex_lock(&loop->lock);
+        part = loop->parts;
+        loop->parts = NULL;
+        pthread_mutex_unlock(&loop->lock);
+
+        // Restore posting order, chunks of one reply must stay in order
+        while (part)
+        {
+            struct reply_part *next = part->next;
+            part->next = parts;
+            parts = part;
+            part = next;
+        }
+
+        while (parts)
+        {
+            part = parts;
+            parts = parts->next;
+            reply_part_send(loop, part);
+        }
+    }
+    (void)ev_data;
+}
+
+static void *device_worker_thread(void *arg)
+{
+    struct device_worker *worker = (struct device_worker *)arg;
+    struct device_job *job;
+    struct timespec timeout;
+    int controls_stale;
+
+    s_ioctl_metrics = device_metrics_get(worker->device_name);
+
+    pthread_mutex_lock(&s_workers_lock);
+    while (!s_workers_stop)
+    {
+        job = worker->head;
+        if (!job && worker->state.fd >= 0)
+        {
+            // Keep the device open while requests keep coming
+            timeout = worker->state.last_used;
+            timeout.tv_sec += s_device_idle;
+            if (s_device_idle <= 0 ||
+                pthread_cond_timedwait(&worker->cond, &s_workers_lock, &timeout) == ETIMEDOUT)
+            {
+                LOGDEBUG("Device %s: idle, closing", worker->device_name);
+                pthread_mutex_unlock(&s_workers_lock);
+                device_state_close(&worker->state);
+                pthread_mutex_lock(&s_workers_lock);
+            }
+            continue;
+        }
+        if (!job)
+        {
+            pthread_cond_wait(&worker->cond, &s_workers_lock);
+            continue;
+        }
+        worker->head = job->next;
+        if (!worker->head)
+        {
+            worker->tail = NULL;
+        }
+        controls_stale = worker->controls_stale;
+        worker->controls_stale = 0;
+        pthread_mutex_unlock(&s_workers_lock);
+
+        if (controls_stale && worker->state.controls_loaded)
+        {
+            LOGDEBUG("Device %s: control flags or range changed, dropping cached controls", worker->device_name);
+            device_state_clear_controls(&worker->state);
+        }
+
+        job->next = NULL;
+        s_device_gone = 0;
+        job->handler(job);
+        if (s_device_gone && worker->state.fd >= 0)
+        {
+            LOGDEBUG("Device %s: gone, reopening with the next request", worker->device_name);
+            device_state_close(&worker->state);
+        }
+        device_job_post(job, 1);
+        device_job_free(job);
+
+        pthread_mutex_lock(&s_workers_lock);
+    }
+    pthread_mutex_unlock(&s_workers_lock);
+
+    return NULL;
+}
+
+/*
+ * Called with s_workers_lock held. Workers are created on the first request
+ * for an existing device node and live until the server exits.
+ */
+static struct device_worker *device_worker_get(char *device_name)
+{
+    struct device_worker *worker;
+    pthread_condattr_t attr;
+
+    for (worker = s_workers; worker != NULL; worker = worker->next)
+    {
+        if (!strcmp(worker->device_name, device_name))
+        {
+            return worker;
+        }
+    }
+
+    if (strncmp(device_name, "video", 5) || !digits_only(device_name + 5))
+    {
+        return NULL;
+    }
+
+    if (!device_exists(device_name) || s_workers_count >= MAX_DEVICE_WORKERS)
+    {
+        return NULL;
+    }
+
+    worker = calloc(1, sizeof(struct device_worker));
+    if (!worker)
+    {
+        return NULL;
+    }
+    snprintf(worker->device_name, sizeof(worker->device_name), "%s", device_name);
+    worker->state.fd = -1;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&worker->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&worker->thread, NULL, device_worker_thread, worker) != 0)
+    {
+        LOGERROR("Can't start worker for device %s", device_name);
+        pthread_cond_destroy(&worker->cond);
+        free(worker);
+        return NULL;
+    }
+
+    worker->next = s_workers;
+    s_workers = worker;
+    s_workers_count++;
+    LOGDEBUG("Started worker for device %s", device_name);
+
+    return worker;
+}
+
+/*
+ * Control flags (inactive, grabbed, ...) or ranges changed behind the
+ * worker's back, its descriptors are loaded again before the next job.
+ */
+static void device_worker_controls_stale(const char *device_name)
+{
+    struct device_worker *worker;
+
+    pthread_mutex_lock(&s_workers_lock);
+    for (worker = s_workers; worker != NULL; worker = worker->next)
+    {
+        if (!strcmp(worker->device_name, device_name))
+        {
+            worker->controls_stale = 1;
+        }
+    }
+    pthread_mutex_unlock(&s_workers_lock);
+}
+
+static int device_worker_enqueue(struct device_job *job)
+{
+    struct device_worker *worker = NULL;
+
+    pthread_mutex_lock(&s_workers_lock);
+    if (!s_workers_stop)
+    {
+        worker = device_worker_get(job->device_name);
+    }
+    if (worker)
+    {
+        if (worker->tail)
+        {
+            worker->tail->next = job;
+        }
+        else
+        {
+            worker->head = job;
+        }
+        worker->tail = job;
+        job->state = &worker->state;
+        job->worker = worker;
+        pthread_cond_signal(&worker->cond);
+    }
+    pthread_mutex_unlock(&s_workers_lock);
+
+    return worker != NULL;
+}
+
+/*
+ * The node was created, removed or replaced, so the pooled fd may belong
+ * to the old device. The next request opens it again and finds out.
+ */
+static void device_registry_refresh(struct device_job *job)
+{
+    device_state_close(job->state);
+    device_registry_update(job->device_name);
+}
+
+/*
+ * Registry update for name on its device worker. A node without worker
+ * is gone and dropped right away, there is nothing to query.
+ */
+static void device_registry_queue(struct mg_mgr *mgr, const char *name)
+{
+    struct out_buf none = {NULL, 0, 0, 0, 0};
+    struct device_job *job = calloc(1, sizeof(struct device_job));
+
+    if (!job)
+    {
+        LOGERROR("Device registry: %s not updated, out of memory", name);
+        return;
+    }
+
+    job->loop = (struct http_loop *)mgr->userdata;
+    job->handler = device_registry_refresh;
+    job->state = &job->local_state;
+    job->local_state.fd = -1;
+    snprintf(job->device_name, sizeof(job->device_name), "%s", name);
+
+    if (!device_worker_enqueue(job))
+    {
+        device_job_free(job);
+        if (device_exists(name))
+        {
+            LOGWARN("Device registry: %s not updated, no device worker", name);
+            return;
+        }
+        device_registry_store(name, none);
+    }
+}
+
+static void device_workers_stop(void)
+{
+    struct device_worker *worker;
+    struct device_job *job;
+
+    pthread_mutex_lock(&s_workers_lock);
+    s_workers_stop = 1;
+    for (worker = s_workers; worker != NULL; worker = worker->next)
+    {
+        pthread_cond_signal(&worker->cond);
+    }
+    pthread_mutex_unlock(&s_workers_lock);
+
+    while ((worker = s_workers))
+    {
+        s_workers = worker->next;
+        pthread_join(worker->thread, NULL);
+        while ((job = worker->head))
+        {
+            worker->head = job->next;
+            device_job_free(job);
+        }
+        device_state_close(&worker->state);
+        device_state_clear(&worker->state);
+        pthread_cond_destroy(&worker->cond);
+        free(worker);
+    }
+    s_workers_count = 0;
+}
+
+/*
+ * Control change events. One watcher thread per device with subscribers
+ * holds the device open, subscribed to V4L2_EVENT_CTRL for every control,
+ * and blocks in poll() for POLLPRI. Changes are pushed to the subscribed
+ * connections as raw reply parts through their event loops.
+ */
+struct event_subscriber
+{
+    struct event_subscriber *next;
+    struct http_loop *loop;
+    unsigned long conn_id;
+    int ws;
+};
+
+struct event_watcher
+{
+    struct event_watcher *next;
+    char device_name[128];
+    pthread_t thread;
+    int wake[2];
+    int fd;
+    struct event_subscriber *subscribers;
+    struct device_state state;
+    __s64 *values;
+    char *changed;
+};
+
+static struct event_watcher *s_watchers = NULL;
+static int s_watchers_count = 0;
+static int s_watchers_stop = 0;
+static pthread_mutex_t s_watchers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * SSE clients get "event: name / data: ..." records, WebSocket clients a
+ * JSON-RPC notification { "method": name, "params": data }.
+ */
+static void event_subscriber_post(struct event_subscriber *sub, const char *event, struct out_buf *data, int last)
+{
+    struct reply_part *part = calloc(1, sizeof(struct reply_part));
+
+    if (!part)
+    {
+        return;
+    }
+
+    part->conn_id = sub->conn_id;
+    part->raw = 1;
+    part->ws = sub->ws;
+    // A WebSocket stays usable for get/set, only SSE streams are closed
+    part->last = last && !sub->ws;
+
+    if (sub->ws)
+    {
+        out_printf(&part->out, "{\"method\":%Q,\"params\":%.*s}", event, (int)data->len, data->buf);
+    }
+    else
+    {
+        out_printf(&part->out, "event: %s\ndata: %.*s\n\n", event, (int)data->len, data->buf);
+    }
+    loop_post(sub->loop, part);
+}
+
+/*
+ * Called with s_watchers_lock held. With last set the subscribers are
+ * dropped and SSE connections closed after the message.
+ */
+static void event_watcher_broadcast(struct event_watcher *watcher, const char *event, struct out_buf *data, int last)
+{
+    struct event_subscriber *sub;
+
+    for (sub = watcher->subscribers; sub != NULL; sub = sub->next)
+    {
+        event_subscriber_post(sub, event, data, last);
+    }
+
+    while (last && (sub = watcher->subscribers))
+    {
+        watcher->subscribers = sub->next;
+        free(sub);
+    }
+}
+
+static void event_watcher_close(struct event_watcher *watcher)
+{
+    struct v4l2_event_subscription sub;
+
+    if (watcher->fd < 0)
+    {
+        return;
+    }
+
+    memset(&sub, 0, sizeof(struct v4l2_event_subscription));
+    sub.type = V4L2_EVENT_ALL;
+    device_ioctl(watcher->fd, VIDIOC_UNSUBSCRIBE_EVENT, &sub);
+    device_close(watcher->fd);
+    watcher->fd = -1;
+
+    device_state_clear(&watcher->state);
+    free(watcher->values);
+    free(watcher->changed);
+    watcher->values = NULL;
+    watcher->changed = NULL;
+    LOGDEBUG("Device %s: events closed", watcher->device_name);
+}
+
+static int event_watcher_open(struct event_watcher *watcher)
+{
+    struct v4l2_event_subscription sub;
+    int subscribed = 0;
+    int i;
+
+    watcher->fd = device_open(watcher->device_name);
+    if (watcher->fd < 0)
+    {
+        return -1;
+    }
+
+    device_state_load_controls(&watcher->state, watcher->fd);
+    watcher->values = calloc(watcher->state.controls_count + 1, sizeof(__s64));
+    watcher->changed = calloc(watcher->state.controls_count + 1, 1);
+    if (!watcher->values || !watcher->changed)
+    {
+        event_watcher_close(watcher);
+        return -1;
+    }
+
+    for (i = 0; i < watcher->state.controls_count; i++)
+    {
+        memset(&sub, 0, sizeof(struct v4l2_event_subscription));
+        sub.type = V4L2_EVENT_CTRL;
+        sub.id = watcher->state.controls[i].id;
+        if (device_ioctl(watcher->fd, VIDIOC_SUBSCRIBE_EVENT, &sub) == 0)
+        {
+            subscribed++;
+        }
+    }
+
+    if (!subscribed)
+    {
+        event_watcher_close(watcher);
+        return -1;
+    }
+
+    LOGDEBUG("Device %s: subscribed to %d control events", watcher->device_name, subscribed);
+    return 0;
+}
+
+static int control_desc_id_cmp(const void *key, const void *item)
+{
+    __u32 id = *(const __u32 *)key;
+    __u32 other = ((const struct control_desc *)item)->id;
+
+    return id < other ? -1 : id > other;
+}
+
+/*
+ * Drains the event queue. Several changes of one control since the last
+ * wakeup collapse into its latest value, all of them go out as one event.
+ */
+static void event_watcher_dequeue(struct event_watcher *watcher, struct out_buf *out)
+{
+    struct v4l2_event ev;
+    struct control_desc *desc;
+    char value[CONTROL_VALUE_SIZE];
+    int count = 0;
+    int stale = 0;
+    int i;
+
+    memset(&ev, 0, sizeof(struct v4l2_event));
+    while (device_ioctl(watcher->fd, VIDIOC_DQEVENT, &ev) == 0)
+    {
+        if (ev.type != V4L2_EVENT_CTRL)
+        {
+            continue;
+        }
+        if (ev.u.ctrl.changes & (V4L2_EVENT_CTRL_CH_FLAGS | V4L2_EVENT_CTRL_CH_RANGE))
+        {
+            stale = 1;
+        }
+        if (!(ev.u.ctrl.changes & V4L2_EVENT_CTRL_CH_VALUE))
+        {
+            continue;
+        }
+
+        desc = bsearch(&ev.id, watcher->state.controls, watcher->state.controls_count,
+                       sizeof(struct control_desc), control_desc_id_cmp);
+        if (!desc)
+        {
+            continue;
+        }
+
+        i = desc - watcher->state.controls;
+        watcher->values[i] = ev.u.ctrl.type == V4L2_CTRL_TYPE_INTEGER64 ? ev.u.ctrl.value64 : ev.u.ctrl.value;
+        watcher->changed[i] = 1;
+    }
+
+    if (stale)
+    {
+        device_worker_controls_stale(watcher->device_name);
+    }
+
+    out_printf(out, "{ ");
+    for (i = 0; i < watcher->state.controls_count; i++)
+    {
+        if (!watcher->changed[i])
+        {
+            continue;
+        }
+        watcher->changed[i] = 0;
+        out_printf(out, count ? ", " FORMAT_CONTROL_VALUE : FORMAT_CONTROL_VALUE,
+                   watcher->state.controls[i].name,
+                   control_value(value, sizeof(value), watcher->values[i]));
+        count++;
+    }
+    out_printf(out, " }");
+
+    if (!count)
+    {
+        out->len = 0;
+    }
+}
+
+static void *event_watcher_thread(void *arg)
+{
+    struct event_watcher *watcher = (struct event_watcher *)arg;
+    struct out_buf out = {NULL, 0, 0, 0, 0};
+    struct pollfd fds[2];
+    char buf[64];
+    int subscribed;
+
+    s_ioctl_metrics = device_metrics_get(watcher->device_name);
+
+    fds[0].fd = watcher->wake[0];
+    fds[0].events = POLLIN;
+    fds[1].events = POLLPRI;
+
+    pthread_mutex_lock(&s_watchers_lock);
+    while (!s_watchers_stop)
+    {
+        subscribed = watcher->subscribers != NULL;
+        pthread_mutex_unlock(&s_watchers_lock);
+
+        // The device is only held open while somebody listens
+        if (subscribed && watcher->fd < 0 && event_watcher_open(watcher) < 0)
+        {
+            out.len = 0;
+            out_printf(&out, "%Q", "Device can't be opened or has no control events.");
+            pthread_mutex_lock(&s_watchers_lock);
+            event_watcher_broadcast(watcher, "error", &out, 1);
+            continue;
+        }
+        if (!subscribed)
+        {
+            event_watcher_close(watcher);
+        }
+
+        fds[1].fd = watcher->fd;
+        fds[1].revents = 0;
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            LOGERROR("Device %s: poll failed: %s", watcher->device_name, strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            while (read(watcher->wake[0], buf, sizeof(buf)) > 0)
+            {
+            }
+        }
+
+        out.len = 0;
+        if (fds[1].revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            // Unplugged, tell the clients and close their streams
+            event_watcher_close(watcher);
+            out_printf(&out, "%Q", "Device disconnected.");
+            pthread_mutex_lock(&s_watchers_lock);
+            event_watcher_broadcast(watcher, "error", &out, 1);
+            continue;
+        }
+        if (fds[1].revents & POLLPRI)
+        {
+            event_watcher_dequeue(watcher, &out);
+        }
+
+        pthread_mutex_lock(&s_watchers_lock);
+        if (out.len)
+        {
+            event_watcher_broadcast(watcher, "control", &out, 0);
+        }
+    }
+    pthread_mutex_unlock(&s_watchers_lock);
+
+    event_watcher_close(watcher);
+    out_free(&out);
+
+    return NULL;
+}
+
+static void event_watcher_wake(struct event_watcher *watcher)
+{
+    if (write(watcher->wake[1], "", 1) < 0)
+    {
+        LOGDEBUG("Device %s: wakeup of event watcher failed: %s", watcher->device_name, strerror(errno));
+    }
+}
+
+/*
+ * Called with s_watchers_lock held. Like workers, watchers live until the
+ * server exits, but close the device when the last client leaves.
+ */
+static struct event_watcher *event_watcher_get(char *device_name)
+{
+    struct event_watcher *watcher;
+
+    for (watcher = s_watchers; watcher != NULL; watcher = watcher->next)
+    {
+        if (!strcmp(watcher->device_name, device_name))
+        {
+            return watcher;
+        }
+    }
+
+    if (strncmp(device_name, "video", 5) || !digits_only(device_name + 5))
+    {
+        return NULL;
+    }
+
+    if (!device_exists(device_name) || s_watchers_count >= MAX_DEVICE_WORKERS)
+    {
+        return NULL;
+    }
+
+    watcher = calloc(1, sizeof(struct event_watcher));
+    if (!watcher)
+    {
+        return NULL;
+    }
+    snprintf(watcher->device_name, sizeof(watcher->device_name), "%s", device_name);
+    watcher->fd = -1;
+
+    if (pipe(watcher->wake) < 0)
+    {
+        free(watcher);
+        return NULL;
+    }
+    fcntl(watcher->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(watcher->wake[1], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&watcher->thread, NULL, event_watcher_thread, watcher) != 0)
+    {
+        LOGERROR("Can't start event watcher for device %s", device_name);
+        close(watcher->wake[0]);
+        close(watcher->wake[1]);
+        free(watcher);
+        return NULL;
+    }
+
+    watcher->next = s_watchers;
+    s_watchers = watcher;
+    s_watchers_count++;
+    LOGDEBUG("Started event watcher for device %s", device_name);
+
+    return watcher;
+}
+
+/*
+ * Adds a subscriber for the connection, a second call is a no-op.
+ */
+static int event_subscribe(struct http_loop *loop, unsigned long conn_id, char *device_name, int ws)
+{
+    struct event_watcher *watcher = NULL;
+    struct event_subscriber *sub = NULL;
+
+    pthread_mutex_lock(&s_watchers_lock);
+    if (!s_watchers_stop && loop->wakeup_sock >= 0)
+    {
+        watcher = event_watcher_get(device_name);
+    }
+    if (watcher)
+    {
+        for (sub = watcher->subscribers; sub != NULL; sub = sub->next)
+        {
+            if (sub->conn_id == conn_id && sub->loop == loop)
+            {
+                break;
+            }
+        }
+    }
+    if (watcher && !sub && (sub = calloc(1, sizeof(struct event_subscriber))) != NULL)
+    {
+        sub->loop = loop;
+        sub->conn_id = conn_id;
+        sub->ws = ws;
+        sub->next = watcher->subscribers;
+        watcher->subscribers = sub;
+        event_watcher_wake(watcher);
+    }
+    pthread_mutex_unlock(&s_watchers_lock);
+
+    return sub != NULL ? 0 : -1;
+}
+
+static void event_unsubscribe(struct http_loop *loop, unsigned long conn_id, const char *device_name)
+{
+    struct event_watcher *watcher;
+    struct event_subscriber **sub;
+    struct event_subscriber *found;
+
+    pthread_mutex_lock(&s_watchers_lock);
+    for (watcher = s_watchers; watcher != NULL; watcher = watcher->next)
+    {
+        if (strcmp(watcher->device_name, device_name))
+        {
+            continue;
+        }
+        for (sub = &watcher->subscribers; *sub != NULL; sub = &(*sub)->next)
+        {
+            if ((*sub)->conn_id == conn_id && (*sub)->loop == loop)
+            {
+                found = *sub;
+                *sub = found->next;
+                free(found);
+                if (!watcher->subscribers)
+                {
+                    event_watcher_wake(watcher);
+                }
+                break;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&s_watchers_lock);
+}
+
+/*
+ * GET /device/events/{device}, text/event-stream of control changes.
+ */
+static void device_events(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    struct mg_str *device_name = &params->values[PARAM_DEVICE];
+
+    // Marks the connection for device_events_close(), the label holds the
+    // NUL terminated device name from here on
+    snprintf(c->label, sizeof(c->label), "events:%.*s", (int)device_name->len, device_name->ptr);
+    if (event_subscribe((struct http_loop *)c->mgr->userdata, c->id, c->label + 7, 0) < 0)
+    {
+        c->label[0] = '\0';
+        mg_http_reply(c, 400, "", "Device can't be opened.");
+        return;
+    }
+
+    mg_printf(c, "HTTP/1.1 200 OK\r\n"
+                 "Content-Type: text/event-stream\r\n"
+                 "Cache-Control: no-cache\r\n"
+                 "\r\n"
+                 ": subscribed to %s\n\n",
+              c->label + 7);
+    (void)hm;
+}
+
+/*
+ * SSE and WebSocket connections carry the device name in their label.
+ */
+static void device_events_close(struct mg_connection *c)
+{
+    if (!strncmp(c->label, "events:", 7))
+    {
+        event_unsubscribe((struct http_loop *)c->mgr->userdata, c->id, c->label + 7);
+    }
+}
+
+static void device_events_stop(void)
+{
+    struct event_watcher *watcher;
+    struct event_subscriber *sub;
+
+    pthread_mutex_lock(&s_watchers_lock);
+    s_watchers_stop = 1;
+    for (watcher = s_watchers; watcher != NULL; watcher = watcher->next)
+    {
+        event_watcher_wake(watcher);
+    }
+    pthread_mutex_unlock(&s_watchers_lock);
+
+    while ((watcher = s_watchers))
+    {
+        s_watchers = watcher->next;
+        pthread_join(watcher->thread, NULL);
+        while ((sub = watcher->subscribers))
+        {
+            watcher->subscribers = sub->next;
+            free(sub);
+        }
+        close(watcher->wake[0]);
+        close(watcher->wake[1]);
+        free(watcher);
+    }
+    s_watchers_count = 0;
+}
+
+/*
+ * MJPEG live streams. One capture thread per device with subscribers owns
+ * the device's streaming buffers. Every dequeued buffer is published once
+ * as a refcounted frame to all subscribers, the connections send from the
+ * mapped buffer and the last reference hands it back to the capture
+ * thread, which queues it again, so the buffers are the broadcast ring. Clients too slow for the frame rate skip frames.
+ * Devices given with -s stream all the time and also copy every frame into
+ * a shared memory ring for local readers (frame_shm.h).
+ */
+struct stream_subscriber
+{
+    struct stream_subscriber *next;
+    struct http_loop *loop;
+    unsigned long conn_id;
+    int started;
+};
+
+/*
+ * Mapped buffers of one streaming session. Frames in flight keep them
+ * mapped after the capture thread closed the fd. Only the capture thread
+ * does ioctls, released frames set their bit in returned and wake it.
+ */
+struct stream_buffers
+{
+    int refs;
+    int fd;
+    int wake; // Write end of the stream's wake pipe, -1 once closed
+    unsigned int returned;
+    __u32 count;
+    void *maps[STREAM_BUFFERS];
+    size_t lengths[STREAM_BUFFERS];
+};
+
+struct frame_stream
+{
+    struct frame_stream *next;
+    char device_name[128];
+    pthread_t thread;
+    int wake[2];
+    struct stream_buffers *buffers;
+    struct stream_subscriber *subscribers;
+    struct v4l2_pix_format pix;
+    int publish;
+    struct frame_shm_header *shm;
+};
+
+static struct frame_stream *s_streams = NULL;
+static int s_streams_count = 0;
+static int s_streams_stop = 0;
+static pthread_mutex_t s_streams_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void stream_buffers_unref(struct stream_buffers *buffers)
+{
+    __u32 i;
+
+    if (__atomic_sub_fetch(&buffers->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    {
+        return;
+    }
+    for (i = 0; i < buffers->count; i++)
+    {
+        munmap(buffers->maps[i], buffers->lengths[i]);
+    }
+    free(buffers);
+}
+
+// Capture thread only
+static void stream_buffer_queue(struct stream_buffers *buffers, __u32 index)
+{
+    struct v4l2_buffer buf;
+
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    device_ioctl(buffers->fd, VIDIOC_QBUF, &buf);
+}
+
+// Capture thread, queues the buffers handed back since the last call
+static void stream_buffers_requeue(struct stream_buffers *buffers)
+{
+    unsigned int returned = __atomic_exchange_n(&buffers->returned, 0, __ATOMIC_ACQ_REL);
+    __u32 i;
+
+    for (i = 0; returned; i++, returned >>= 1)
+    {
+        if (returned & 1)
+        {
+            stream_buffer_queue(buffers, i);
+        }
+    }
+}
+
+/*
+ * Runs on whichever thread drops the last reference, mostly an event loop.
+ * Only the first return since the capture thread last looked wakes it.
+ */
+static void stream_frame_release(struct frame *frame)
+{
+    struct stream_buffers *buffers = (struct stream_buffers *)frame->owner;
+    int wake;
+
+    if (!__atomic_fetch_or(&buffers->returned, 1u << frame->index, __ATOMIC_ACQ_REL) &&
+        (wake = __atomic_load_n(&buffers->wake, __ATOMIC_ACQUIRE)) >= 0 && write(wake, "", 1) < 0)
+    {
+        LOGDEBUG("Wakeup of capture thread failed: %s", strerror(errno));
+    }
+    stream_buffers_unref(buffers);
+}
+
+static void stream_close(struct frame_stream *stream)
+{
+    struct stream_buffers *buffers = stream->buffers;
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (!buffers)
+    {
+        return;
+    }
+
+    __atomic_store_n(&buffers->wake, -1, __ATOMIC_RELEASE);
+    device_ioctl(buffers->fd, VIDIOC_STREAMOFF, &type);
+    device_close(buffers->fd);
+    buffers->fd = -1;
+
+    stream_buffers_unref(buffers);
+    stream->buffers = NULL;
+    LOGDEBUG("Device %s: stream closed", stream->device_name);
+}
+
+static void stream_shm_close(struct frame_stream *stream)
+{
+    struct frame_shm_header *header = stream->shm;
+    char name[160];
+
+    if (!header)
+    {
+        return;
+    }
+
+    // Readers still holding the mapping see live drop and reopen
+    __atomic_store_n(&header->live, 0, __ATOMIC_RELEASE);
+    munmap(header, header->size);
+    snprintf(name, sizeof(name), FRAME_SHM_NAME, stream->device_name);
+    shm_unlink(name);
+    stream->shm = NULL;
+}
+
+/*
+ * Slots are sized for the current format, a format with larger frames
+ * replaces the object. Returns 0 if the ring is usable.
+ */
+static int stream_shm_open(struct frame_stream *stream)
+{
+    struct frame_shm_header *header;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t frame_size = stream->pix.sizeimage ? stream->pix.sizeimage : (size_t)stream->pix.bytesperline * stream->pix.height;
+    size_t slot_size = (frame_size + page - 1) / page * page;
+    size_t data_offset = (sizeof(struct frame_shm_header) + page - 1) / page * page;
+    size_t size = data_offset + FRAME_SHM_SLOTS * slot_size;
+    char name[160];
+    int fd;
+    int i;
+
+    if (stream->shm && stream->shm->slot_size >= slot_size)
+    {
+        return 0;
+    }
+    stream_shm_close(stream);
+    if (!slot_size || slot_size > UINT32_MAX)
+    {
+        return -1;
+    }
+
+    snprintf(name, sizeof(name), FRAME_SHM_NAME, stream->device_name);
+    shm_unlink(name); // left over by a server that was killed
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0640);
+    if (fd < 0)
+    {
+        LOGERROR("Device %s: can't create shared memory %s: %s", stream->device_name, name, strerror(errno));
+        return -1;
+    }
+    header = ftruncate(fd, size) == 0 ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (header == MAP_FAILED)
+    {
+        LOGERROR("Device %s: can't map shared memory %s: %s", stream->device_name, name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    close(fd);
+
+    header->magic = FRAME_SHM_MAGIC;
+    header->size = size;
+    header->slots_count = FRAME_SHM_SLOTS;
+    header->slot_size = slot_size;
+    for (i = 0; i < FRAME_SHM_SLOTS; i++)
+    {
+        header->slots[i].offset = data_offset + i * slot_size;
+    }
+    __atomic_store_n(&header->live, 1, __ATOMIC_RELEASE);
+    stream->shm = header;
+
+    LOGINFO("Device %s: publishing frames to shared memory %s (%zu bytes)", stream->device_name, name, size);
+    return 0;
+}
+
+/*
+ * Seqlock writer. The slot after the newest one is odd while it is
+ * written, latest moves on once it is even again.
+ */
+static void stream_shm_publish(struct frame_stream *stream, struct frame *frame)
+{
+    struct frame_shm_header *header = stream->shm;
+    struct frame_shm_slot *slot;
+    uint64_t next;
+    uint32_t seq;
+
+    if (!header || frame->len > header->slot_size)
+    {
+        return;
+    }
+
+    next = header->latest + 1;
+    slot = &header->slots[next % FRAME_SHM_SLOTS];
+    seq = slot->seq;
+    __atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy((char *)header + slot->offset, frame->data, frame->len);
+    slot->bytesused = frame->len;
+    slot->frame = next;
+    slot->timestamp_us = frame->timestamp_us;
+    slot->sequence = frame->sequence;
+    slot->pixelformat = stream->pix.pixelformat;
+    slot->width = stream->pix.width;
+    slot->height = stream->pix.height;
+    slot->bytesperline = stream->pix.bytesperline;
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->latest, next, __ATOMIC_RELEASE);
+}
+
+static int stream_format_jpeg(const struct v4l2_pix_format *pix)
+{
+    return pix->pixelformat == V4L2_PIX_FMT_MJPEG || pix->pixelformat == V4L2_PIX_FMT_JPEG;
+}
+
+/*
+ * Returns 0 or the HTTP status for the subscribers, with the reason in
+ * error. Raw formats are only captured for shared memory (publish).
+ */
+static int stream_open(struct frame_stream *stream, int publish, const char **error)
+{
+    struct stream_buffers *buffers;
+    struct v4l2_requestbuffers req;
+    struct v4l2_buffer buf;
+    struct v4l2_format fmt;
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int fd = device_open(stream->device_name);
+
+    *error = "Device can't be opened.";
+    if (fd < 0)
+    {
+        return 400;
+    }
+
+    memset(&fmt, 0, sizeof(struct v4l2_format));
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (device_ioctl(fd, VIDIOC_G_FMT, &fmt) != 0)
+    {
+        device_close(fd);
+        *error = "Device can't capture.";
+        return 400;
+    }
+    if (!publish && !stream_format_jpeg(&fmt.fmt.pix))
+    {
+        device_close(fd);
+        *error = "Unsupported pixel format.";
+        return 415;
+    }
+    stream->pix = fmt.fmt.pix;
+
+    memset(&req, 0, sizeof(struct v4l2_requestbuffers));
+    req.count = STREAM_BUFFERS;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    if (device_ioctl(fd, VIDIOC_REQBUFS, &req) != 0 || !req.count)
+    {
+        int busy = errno == EBUSY;
+
+        device_close(fd);
+        *error = busy ? "Device is busy." : "Device can't stream.";
+        return busy ? 409 : 500;
+    }
+
+    buffers = calloc(1, sizeof(struct stream_buffers));
+    if (!buffers)
+    {
+        device_close(fd);
+        *error = "Out of memory.";
+        return 500;
+    }
+    buffers->refs = 1;
+    buffers->fd = fd;
+    buffers->wake = stream->wake[1];
+    stream->buffers = buffers;
+
+    for (buffers->count = 0; buffers->count < req.count && buffers->count < STREAM_BUFFERS; buffers->count++)
+    {
+        memset(&buf, 0, sizeof(struct v4l2_buffer));
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index = buffers->count;
+        if (device_ioctl(fd, VIDIOC_QUERYBUF, &buf) != 0)
+        {
+            break;
+        }
+        buffers->maps[buf.index] = device_mmap(buf.length, PROT_READ, MAP_SHARED, fd, buf.m.offset);
+        if (buffers->maps[buf.index] == MAP_FAILED || device_ioctl(fd, VIDIOC_QBUF, &buf) != 0)
+        {
+            if (buffers->maps[buf.index] != MAP_FAILED)
+            {
+                munmap(buffers->maps[buf.index], buf.length);
+            }
+            break;
+        }
+        buffers->lengths[buf.index] = buf.length;
+    }
+
+    if (buffers->count < req.count || device_ioctl(fd, VIDIOC_STREAMON, &type) != 0)
+    {
+        stream_close(stream);
+        *error = "Device can't stream.";
+        return 500;
+    }
+
+    if (publish)
+    {
+        stream_shm_open(stream);
+    }
+
+    LOGDEBUG("Device %s: streaming with %u buffers", stream->device_name, buffers->count);
+    return 0;
+}
+
+static struct frame *stream_dequeue(struct frame_stream *stream)
+{
+    struct stream_buffers *buffers = stream->buffers;
+    struct v4l2_buffer buf;
+    struct frame *frame;
+
+    memset(&buf, 0, sizeof(struct v4l2_buffer));
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    if (device_ioctl(buffers->fd, VIDIOC_DQBUF, &buf) != 0 || buf.index >= buffers->count)
+    {
+        return NULL;
+    }
+
+    frame = calloc(1, sizeof(struct frame));
+    if (!frame || (buf.flags & V4L2_BUF_FLAG_ERROR))
+    {
+        free(frame);
+        stream_buffer_queue(buffers, buf.index);
+        return NULL;
+    }
+    frame->refs = 1;
+    frame->data = (const char *)buffers->maps[buf.index];
+    frame->len = buf.bytesused < buffers->lengths[buf.index] ? buf.bytesused : buffers->lengths[buf.index];
+    frame->release = stream_frame_release;
+    frame->owner = buffers;
+    frame->index = buf.index;
+    frame->sequence = buf.sequence;
+    frame->timestamp_us = (unsigned long long)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+    __atomic_add_fetch(&buffers->refs, 1, __ATOMIC_RELAXED);
+
+    return frame;
+}
+
+/*
+ * Called with s_streams_lock held. The first frame of a subscriber carries
+ * the response header and is never skipped.
+ */
+static void stream_broadcast(struct frame_stream *stream, struct frame *frame)
+{
+    struct stream_subscriber *sub;
+    struct reply_part *part;
+
+    for (sub = stream->subscribers; sub != NULL; sub = sub->next)
+    {
+        part = calloc(1, sizeof(struct reply_part));
+        if (!part)
+        {
+            continue;
+        }
+        part->conn_id = sub->conn_id;
+        part->raw = 1;
+        part->droppable = sub->started;
+        if (!sub->started)
+        {
+            out_printf(&part->out, "HTTP/1.1 200 OK\r\n%s\r\n", HEADERS_STREAM);
+            sub->started = 1;
+        }
+        out_printf(&part->out, "--%s\r\nContent-Type: image/jpeg\r\nContent-Length: %d\r\n\r\n",
+                   STREAM_BOUNDARY, (int)frame->len);
+        part->frame = frame;
+        part->trailer = "\r\n";
+        __atomic_add_fetch(&frame->refs, 1, __ATOMIC_RELAXED);
+        loop_post(sub->loop, part);
+    }
+}
+
+/*
+ * Called with s_streams_lock held. Subscribers waiting for their first
+ * frame get an error reply, running streams are closed.
+ */
+static void stream_fail(struct frame_stream *stream, int status, const char *error)
+{
+    struct stream_subscriber *sub;
+    struct reply_part *part;
+
+    while ((sub = stream->subscribers))
+    {
+        stream->subscribers = sub->next;
+        part = calloc(1, sizeof(struct reply_part));
+        if (part)
+        {
+            part->conn_id = sub->conn_id;
+            part->status = status;
+            part->headers = "";
+            part->first = 1;
+            part->last = 1;
+            part->raw = sub->started;
+            if (!sub->started)
+            {
+                out_printf(&part->out, "%s", error);
+            }
+            loop_post(sub->loop, part);
+        }
+        free(sub);
+    }
+}
+
+static void *stream_thread(void *arg)
+{
+    struct frame_stream *stream = (struct frame_stream *)arg;
+    struct frame *frame;
+    struct pollfd fds[2];
+    const char *error;
+    char buf[64];
+    int subscribed;
+    int publish;
+    int status;
+
+    s_ioctl_metrics = device_metrics_get(stream->device_name);
+
+    fds[0].fd = stream->wake[0];
+    fds[0].events = POLLIN;
+    fds[1].events = POLLIN;
+
+    pthread_mutex_lock(&s_streams_lock);
+    while (!s_streams_stop)
+    {
+        publish = stream->publish;
+        subscribed = stream->subscribers != NULL || publish;
+        pthread_mutex_unlock(&s_streams_lock);
+
+        // The device only streams while somebody watches
+        if (subscribed && !stream->buffers && (status = stream_open(stream, publish, &error)) != 0)
+        {
+            pthread_mutex_lock(&s_streams_lock);
+            stream_fail(stream, status, error);
+
+            // A published device retries until it can be opened (again),
+            // new subscribers and the registry wake it up earlier
+            if (publish)
+            {
+                pthread_mutex_unlock(&s_streams_lock);
+                if (poll(fds, 1, STREAM_RETRY_MS) > 0)
+                {
+                    while (read(stream->wake[0], buf, sizeof(buf)) > 0)
+                    {
+                    }
+                }
+                pthread_mutex_lock(&s_streams_lock);
+            }
+            continue;
+        }
+        if (!subscribed)
+        {
+            stream_close(stream);
+        }
+
+        fds[1].fd = stream->buffers ? stream->buffers->fd : -1;
+        fds[1].revents = 0;
+        if (poll(fds, 2, -1) < 0 && errno != EINTR)
+        {
+            LOGERROR("Device %s: poll failed: %s", stream->device_name, strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            while (read(stream->wake[0], buf, sizeof(buf)) > 0)
+            {
+            }
+        }
+        if (stream->buffers)
+        {
+            stream_buffers_requeue(stream->buffers);
+        }
+
+        frame = NULL;
+        if (fds[1].revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            // Unplugged, close the streams of the clients
+            stream_close(stream);
+            pthread_mutex_lock(&s_streams_lock);
+            stream_fail(stream, 500, "Device disconnected.");
+            continue;
+        }
+        if (fds[1].revents & POLLIN)
+        {
+            frame = stream_dequeue(stream);
+        }
+        if (frame)
+        {
+            stream_shm_publish(stream, frame);
+        }
+
+        pthread_mutex_lock(&s_streams_lock);
+        // Raw formats only go to shared memory
+        if (stream->buffers && stream->subscribers && !stream_format_jpeg(&stream->pix))
+        {
+            stream_fail(stream, 415, "Unsupported pixel format.");
+        }
+        if (frame)
+        {
+            stream_broadcast(stream, frame);
+            frame_unref(frame);
+        }
+    }
+    pthread_mutex_unlock(&s_streams_lock);
+
+    stream_close(stream);
+    stream_shm_close(stream);
+
+    return NULL;
+}
+
+static void stream_wake(struct frame_stream *stream)
+{
+    if (write(stream->wake[1], "", 1) < 0)
+    {
+        LOGDEBUG("Device %s: wakeup of stream failed: %s", stream->device_name, strerror(errno));
+    }
+}
+
+/*
+ * Called with s_streams_lock held. With absent the stream is also created
+ * for a node that doesn't exist yet, its thread waits for the device.
+ */
+static struct frame_stream *stream_get(char *device_name, int absent)
+{
+    struct frame_stream *stream;
+
+    for (stream = s_streams; stream != NULL; stream = stream->next)
+    {
+        if (!strcmp(stream->device_name, device_name))
+        {
+            return stream;
+        }
+    }
+
+    if (strncmp(device_name, "video", 5) || !digits_only(device_name + 5))
+    {
+        return NULL;
+    }
+
+    if ((!absent && !device_exists(device_name)) || s_streams_count >= MAX_DEVICE_WORKERS)
+    {
+        return NULL;
+    }
+
+    stream = calloc(1, sizeof(struct frame_stream));
+    if (!stream)
+    {
+        return NULL;
+    }
+    snprintf(stream->device_name, sizeof(stream->device_name), "%s", device_name);
+
+    if (pipe(stream->wake) < 0)
+    {
+        free(stream);
+        return NULL;
+    }
+    fcntl(stream->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(stream->wake[1], F_SETFL, O_NONBLOCK);
+
+    if (pthread_create(&stream->thread, NULL, stream_thread, stream) != 0)
+    {
+        LOGERROR("Can't start stream for device %s", device_name);
+        close(stream->wake[0]);
+        close(stream->wake[1]);
+        free(stream);
+        return NULL;
+    }
+
+    stream->next = s_streams;
+    s_streams = stream;
+    s_streams_count++;
+    LOGDEBUG("Started stream for device %s", device_name);
+
+    return stream;
+}
+
+static int stream_subscribe(struct http_loop *loop, unsigned long conn_id, char *device_name)
+{
+    struct frame_stream *stream = NULL;
+    struct stream_subscriber *sub = NULL;
+
+    pthread_mutex_lock(&s_streams_lock);
+    if (!s_streams_stop && loop->wakeup_sock >= 0)
+    {
+        stream = stream_get(device_name, 0);
+    }
+    if (stream && (sub = calloc(1, sizeof(struct stream_subscriber))) != NULL)
+    {
+        sub->loop = loop;
+        sub->conn_id = conn_id;
+        sub->next = stream->subscribers;
+        stream->subscribers = sub;
+        stream_wake(stream);
+    }
+    pthread_mutex_unlock(&s_streams_lock);
+
+    return sub != NULL ? 0 : -1;
+}
+
+static void stream_unsubscribe(struct http_loop *loop, unsigned long conn_id, const char *device_name)
+{
+    struct frame_stream *stream;
+    struct stream_subscriber **sub;
+    struct stream_subscriber *found;
+
+    pthread_mutex_lock(&s_streams_lock);
+    for (stream = s_streams; stream != NULL; stream = stream->next)
+    {
+        if (strcmp(stream->device_name, device_name))
+        {
+            continue;
+        }
+        for (sub = &stream->subscribers; *sub != NULL; sub = &(*sub)->next)
+        {
+            if ((*sub)->conn_id == conn_id && (*sub)->loop == loop)
+            {
+                found = *sub;
+                *sub = found->next;
+                free(found);
+                if (!stream->subscribers)
+                {
+                    stream_wake(stream);
+                }
+                break;
+            }
+        }
+        break;
+    }
+    pthread_mutex_unlock(&s_streams_lock);
+}
 
-    if (!fd)
+/*
+ * GET /device/stream/{device}, multipart/x-mixed-replace of JPEG frames.
+ * The response header goes out with the first frame, so a device that
+ * can't stream still gets a proper error status.
+ */
+static void device_stream(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    struct mg_str *device_name = &params->values[PARAM_DEVICE];
+
+    // Marks the connection for device_stream_close()
+    snprintf(c->label, sizeof(c->label), "stream:%.*s", (int)device_name->len, device_name->ptr);
+    if (stream_subscribe((struct http_loop *)c->mgr->userdata, c->id, c->label + 7) < 0)
+    {
+        c->label[0] = '\0';
+        mg_http_reply(c, 400, "", "Device can't be opened.");
+    }
+    (void)hm;
+}
+
+static void device_stream_close(struct mg_connection *c)
+{
+    if (!strncmp(c->label, "stream:", 7))
+    {
+        stream_unsubscribe((struct http_loop *)c->mgr->userdata, c->id, c->label + 7);
+    }
+}
+
+/*
+ * -s: the device streams from the start and keeps its shared memory ring
+ * updated, with or without HTTP clients. A camera that is not plugged in
+ * yet is published once it appears.
+ */
+static int stream_publish(char *device_name)
+{
+    struct frame_stream *stream;
+
+    pthread_mutex_lock(&s_streams_lock);
+    stream = stream_get(device_name, 1);
+    if (stream)
+    {
+        stream->publish = 1;
+        stream_wake(stream);
+    }
+    pthread_mutex_unlock(&s_streams_lock);
+
+    return stream != NULL ? 0 : -1;
+}
+
+/*
+ * The registry saw the node appear, a published stream waiting for it
+ * opens the device right away instead of at its next retry.
+ */
+static void device_stream_plugged(const char *device_name)
+{
+    struct frame_stream *stream;
+
+    pthread_mutex_lock(&s_streams_lock);
+    for (stream = s_streams; stream != NULL; stream = stream->next)
+    {
+        if (stream->publish && !strcmp(stream->device_name, device_name))
+        {
+            stream_wake(stream);
+        }
+    }
+    pthread_mutex_unlock(&s_streams_lock);
+}
+
+static void device_streams_stop(void)
+{
+    struct frame_stream *stream;
+    struct stream_subscriber *sub;
+
+    pthread_mutex_lock(&s_streams_lock);
+    s_streams_stop = 1;
+    for (stream = s_streams; stream != NULL; stream = stream->next)
+    {
+        stream_wake(stream);
+    }
+    pthread_mutex_unlock(&s_streams_lock);
+
+    while ((stream = s_streams))
+    {
+        s_streams = stream->next;
+        pthread_join(stream->thread, NULL);
+        while ((sub = stream->subscribers))
+        {
+            stream->subscribers = sub->next;
+            free(sub);
+        }
+        close(stream->wake[0]);
+        close(stream->wake[1]);
+        free(stream);
+    }
+    s_streams_count = 0;
+}
+
+static struct device_job *device_job_new(struct mg_connection *c,
+                                         device_handler_t handler,
+                                         struct mg_str device_name,
+                                         struct mg_str *body)
+{
+    struct device_job *job = calloc(1, sizeof(struct device_job));
+
+    if (!job)
+    {
+        return NULL;
+    }
+
+    job->loop = (struct http_loop *)c->mgr->userdata;
+    job->conn_id = c->id;
+    job->handler = handler;
+    job->state = &job->local_state;
+    job->local_state.fd = -1;
+    snprintf(job->device_name, sizeof(job->device_name), "%.*s", (int)device_name.len, device_name.ptr);
+
+    // The job replies later, so it takes over the request timing
+    job->latency = job->loop->request_latency;
+    job->started = job->loop->request_started;
+    job->loop->request_latency = NULL;
+
+    if (body && body->len)
+    {
+        job->body = malloc(body->len + 1);
+        if (!job->body)
+        {
+            device_job_free(job);
+            return NULL;
+        }
+        memcpy(job->body, body->ptr, body->len);
+        job->body[body->len] = '\0';
+        job->body_len = body->len;
+    }
+
+    return job;
+}
+
+/*
+ * Run handler on the device worker. Unknown devices (and loops without
+ * wakeup socket) are handled inline, they fail fast in device_open().
+ */
+static void device_job_start(struct device_job *job)
+{
+    if (job->loop->wakeup_sock < 0 || !device_worker_enqueue(job))
+    {
+        job->inline_reply = 1;
+        job->handler(job);
+        device_job_post(job, 1);
+        device_job_free(job);
+    }
+}
+
+static void device_job_submit(struct mg_connection *c,
+                              struct mg_http_message *hm,
+                              device_handler_t handler,
+                              struct route_params *params,
+                              struct mg_str *body)
+{
+    struct device_job *job = device_job_new(c, handler, params->values[PARAM_DEVICE], body);
+    struct mg_str *control = &params->values[PARAM_CONTROL];
+    struct mg_str *inm;
+
+    if (!job)
     {
-        mg_http_reply(con, 400, "", "Device can't be opened.");
+        mg_http_reply(c, 500, "", "Out of memory.");
         return;
     }
 
-    memset(&queryctrl, 0, sizeof(struct v4l2_queryctrl));
-    memset(&querymenu, 0, sizeof(struct v4l2_querymenu));
-    memset(&ctrl, 0, sizeof(struct v4l2_control));
-    strcat(controls, "{ ");
+    snprintf(job->control, sizeof(job->control), "%.*s", (int)control->len, control->ptr);
 
-    queryctrl.id = next_fl;
-    while (ioctl(fd, VIDIOC_QUERYCTRL, &queryctrl) == 0)
+    job->no_chunks = !mg_vcmp(&hm->proto, "HTTP/1.0");
+
+    job->encoding = accept_encoding(hm);
+
+    inm = mg_http_get_header(hm, "If-None-Match");
+    if (inm && inm->len < sizeof(job->if_none_match))
     {
-        ctrl.id = queryctrl.id;
-        queryctrl.id |= next_fl;
+        memcpy(job->if_none_match, inm->ptr, inm->len);
+    }
 
-        var_name = name2var((char *)queryctrl.name);
-        if (!var_name)
+    if (hm->query.len)
+    {
+        job->query = mg_strdup(hm->query);
+        if (!job->query.ptr)
         {
-            continue;
+            device_job_free(job);
+            mg_http_reply(c, 500, "", "Out of memory.");
+            return;
         }
+    }
+
+    device_job_start(job);
+}
+
+/*
+ * WebSocket control channel. Every frame is a JSON-RPC request or a batch
+ * (array) of them, processed on the device worker like an HTTP request, so
+ * an interactive client pays one frame per update instead of one HTTP
+ * transaction. Methods reuse the HTTP handlers. s_rpc only holds the
+ * method list, jsonrpc_ctx_process() writes to its context and every frame
+ * gets its own.
+ */
+static struct jsonrpc_ctx s_rpc;
+static __thread struct device_job *s_rpc_job;
+
+static void rpc_call_handler(struct jsonrpc_request *r, device_handler_t handler)
+{
+    struct device_job *job = s_rpc_job;
+    struct device_job call;
+    char message[256];
+
+    memset(&call, 0, sizeof(struct device_job));
+    snprintf(call.device_name, sizeof(call.device_name), "%s", job->device_name);
+    call.state = job->state;
+    call.no_chunks = 1;
+    // Coalescing looks at the worker queue the frame came from
+    pthread_mutex_lock(&s_workers_lock);
+    call.worker = job->worker;
+    pthread_mutex_unlock(&s_workers_lock);
+    call.body = (char *)r->params;
+    call.body_len = r->params_len;
+
+    handler(&call);
+
+    if (call.status == 200)
+    {
+        jsonrpc_return_success(r, "%.*s", (int)call.out.len, call.out.buf ? call.out.buf : "");
+    }
+    else
+    {
+        snprintf(message, sizeof(message), "%.*s", (int)call.out.len, call.out.buf ? call.out.buf : "");
+        jsonrpc_return_error(r, call.status == 400 ? JSONRPC_ERROR_BAD_PARAMS : JSONRPC_ERROR_INTERNAL, message, NULL);
+    }
+    out_free(&call.out);
+}
+
+static void rpc_get(struct jsonrpc_request *r)
+{
+    rpc_call_handler(r, device_control_get);
+}
 
-        sprintf(json_path, "$.%s", var_name);
+static void rpc_set(struct jsonrpc_request *r)
+{
+    if (r->params_len < 2 || r->params[0] != '{')
+    {
+        jsonrpc_return_error(r, JSONRPC_ERROR_BAD_PARAMS, "params must be an object of controls", NULL);
+        return;
+    }
+    rpc_call_handler(r, device_control_set);
+}
+
+static void rpc_subscribe(struct jsonrpc_request *r)
+{
+    struct device_job *job = s_rpc_job;
+
+    if (event_subscribe(job->loop, job->conn_id, job->device_name, 1) < 0)
+    {
+        jsonrpc_return_error(r, JSONRPC_ERROR_INTERNAL, "Device can't be opened.", NULL);
+        return;
+    }
+    jsonrpc_return_success(r, "%s", "true");
+}
+
+static void rpc_unsubscribe(struct jsonrpc_request *r)
+{
+    struct device_job *job = s_rpc_job;
+
+    event_unsubscribe(job->loop, job->conn_id, job->device_name);
+    jsonrpc_return_success(r, "%s", "true");
+}
+
+static void rpc_init(void)
+{
+    jsonrpc_ctx_init(&s_rpc, NULL, NULL);
+    jsonrpc_ctx_export(&s_rpc, "get", rpc_get, NULL);
+    jsonrpc_ctx_export(&s_rpc, "set", rpc_set, NULL);
+    jsonrpc_ctx_export(&s_rpc, "subscribe", rpc_subscribe, NULL);
+    jsonrpc_ctx_export(&s_rpc, "unsubscribe", rpc_unsubscribe, NULL);
+}
+
+/*
+ * Device handler for one WebSocket frame. Replies of a batch are collected
+ * into one array frame, notifications (no "id") produce no reply.
+ */
+static void device_rpc(struct device_job *job)
+{
+    struct jsonrpc_ctx rpc;
+    struct out_buf *out = &job->out;
+    int off, koff, klen, voff, vlen, vtype;
+    size_t mark;
+    size_t start = 0;
+    int elements = 0;
+    int count = 0;
+
+    job->status = 200;
+    job->headers = "";
+    s_rpc_job = job;
+
+    memset(&rpc, 0, sizeof(struct jsonrpc_ctx));
+    rpc.methods = s_rpc.methods;
+
+    while (start < job->body_len && isspace((unsigned char)job->body[start]))
+    {
+        start++;
+    }
+
+    if (start < job->body_len && job->body[start] == '[')
+    {
+        out_printf(out, "[");
+        for (off = 0; (off = mjson_next(job->body, job->body_len, off, &koff, &klen, &voff, &vlen, &vtype)) != 0;)
+        {
+            elements++;
+            mark = out->len;
+            if (count)
+            {
+                out_printf(out, ",");
+            }
+            jsonrpc_ctx_process(&rpc, job->body + voff, vlen, out_print, out);
+            if (out->len == mark + (count ? 1 : 0))
+            {
+                out->len = mark;
+                continue;
+            }
+            count++;
+        }
+        out_printf(out, "]");
 
-        if (mjson_get_number(hm->body.ptr, hm->body.len, json_path, &dv))
+        if (!count)
+        {
+            out->len = 0;
+        }
+        // An empty batch is an invalid request (JSON-RPC 2.0, section 6)
+        if (!elements)
         {
-            ctrl.value = (__s32)dv;
-            LOGDEBUG("Device %s control %s set %d", device_name, var_name, ctrl.value);
+            out_printf(out, "{\"id\":null,\"error\":{\"code\":%d,\"message\":%Q}}",
+                       JSONRPC_ERROR_INVALID_REQUEST, "Invalid Request");
+        }
+    }
+    else if (job->body_len)
+    {
+        jsonrpc_ctx_process(&rpc, job->body, job->body_len, out_print, out);
+    }
+
+    s_rpc_job = NULL;
+}
+
+static void device_rpc_frame(struct mg_connection *c, struct mg_ws_message *wm)
+{
+    struct device_job *job = device_job_new(c, device_rpc, mg_str(c->label + 7), &wm->data);
+
+    if (!job)
+    {
+        static const char oom[] = "{\"error\":{\"code\":-32603,\"message\":\"Out of memory.\"}}";
+        mg_ws_send(c, oom, sizeof(oom) - 1, WEBSOCKET_OP_TEXT);
+        return;
+    }
+    job->ws = 1;
+    job->no_chunks = 1;
+    device_job_start(job);
+}
+
+/*
+ * Request routing. The route table is compiled at startup into a byte trie
+ * over the URI path, a {param} segment becomes a parameter edge taking
+ * everything up to the next '/'. Dispatch walks the path once, literal
+ * bytes win over parameters without backtracking, and the method picks the
+ * handler at the leaf. Parameters point into the request, nothing is
+ * copied.
+ */
+typedef void (*route_handler_t)(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params);
+
+struct route
+{
+    const char *pattern;
+    route_handler_t handlers[METHOD_OTHER];
+};
+
+struct route_node
+{
+    unsigned char next[128]; // child per path byte, 0 (the root) is none
+    unsigned char param;     // child after a parameter segment
+    unsigned char param_type;
+    signed char route;       // index into s_routes or -1
+};
+
+static const char *s_param_names[PARAM_COUNT] = {"device", "control"};
+static const size_t s_param_sizes[PARAM_COUNT] = {DEVICE_NAME_SIZE, CONTROL_NAME_SIZE};
+static const char *s_param_errors[PARAM_COUNT] = {"Device name too long.", "Control name too long."};
+
+static struct route_node s_route_nodes[ROUTE_MAX_NODES];
+static int s_route_nodes_count;
+
+static void metrics_list(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params);
+
+static void route_devices(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    device_list(c, hm);
+    (void)params;
+}
+
+static void route_formats(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    device_job_submit(c, hm, device_formats, params, NULL);
+}
+
+static void route_modes(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    device_job_submit(c, hm, device_modes, params, NULL);
+}
+
+static void route_format(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    device_job_submit(c, hm, device_format_get, params, NULL);
+}
+
+static void route_control_get(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    device_job_submit(c, hm, device_control_get, params, NULL);
+}
+
+static void route_control_set(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    device_job_submit(c, hm, device_control_set, params, &hm->body);
+}
+
+static void route_snapshot(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    device_job_submit(c, hm, device_snapshot, params, NULL);
+}
+
+static void route_ws(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    struct mg_str *device_name = &params->values[PARAM_DEVICE];
+
+    // The label names the device for frames and unsubscribe
+    snprintf(c->label, sizeof(c->label), "events:%.*s", (int)device_name->len, device_name->ptr);
+    mg_ws_upgrade(c, hm, NULL);
+}
+
+/* Order is the order of the route label in /metrics */
+static const struct route s_routes[ROUTE_COUNT] = {
+    {URL_DEVICES, {route_devices, NULL}},
+    {URL_DEVICE_FORMATS, {route_formats, NULL}},
+    {URL_DEVICE_MODES, {route_modes, NULL}},
+    {URL_DEVICE_CONTROL, {route_control_get, route_control_set}},
+    {URL_DEVICE_CONTROL_ITEM, {route_control_get, NULL}},
+    {URL_DEVICE_EVENTS, {device_events, NULL}},
+    {URL_DEVICE_WS, {route_ws, NULL}},
+    {URL_DEVICE_FORMAT, {route_format, NULL}},
+    {URL_DEVICE_SNAPSHOT, {route_snapshot, NULL}},
+    {URL_DEVICE_STREAM, {device_stream, NULL}},
+    {URL_METRICS, {metrics_list, NULL}}};
+
+static const char *s_method_names[METHOD_OTHER + 1] = {"GET", "POST", "other"};
+
+static int route_node_new(void)
+{
+    struct route_node *node;
+
+    if (s_route_nodes_count >= ROUTE_MAX_NODES)
+    {
+        return -1;
+    }
+    node = &s_route_nodes[s_route_nodes_count];
+    memset(node, 0, sizeof(struct route_node));
+    node->route = -1;
+
+    return s_route_nodes_count++;
+}
+
+static int route_compile(void)
+{
+    const char *p;
+    const char *end;
+    int node;
+    int child;
+    int type;
+    int r;
 
-            if (ioctl(fd, VIDIOC_S_CTRL, &ctrl) == 0)
+    s_route_nodes_count = 0;
+    route_node_new();
+
+    for (r = 0; r < ROUTE_COUNT; r++)
+    {
+        node = 0;
+        for (p = s_routes[r].pattern; *p; p++)
+        {
+            if (*p == '{')
             {
-                if (ioctl(fd, VIDIOC_G_CTRL, &ctrl) == 0)
+                end = strchr(p, '}');
+                for (type = 0; end && type < PARAM_COUNT; type++)
                 {
-                    sprintf(control, FORMAT_CONTROL_VALUE, var_name, ctrl.value);
-                    LOGDEBUG("Device %s control %s get %d", device_name, var_name, ctrl.value);
+                    if (strlen(s_param_names[type]) == (size_t)(end - p - 1) &&
+                        !strncmp(p + 1, s_param_names[type], end - p - 1))
+                    {
+                        break;
+                    }
                 }
-                else
+                if (!end || type == PARAM_COUNT ||
+                    (s_route_nodes[node].param && s_route_nodes[node].param_type != type))
                 {
-                    sprintf(control, FORMAT_CONTROL_STRING, var_name, strerror(errno));
-                    LOGERROR("Device %s control %s: %s", device_name, var_name, strerror(errno));
+                    LOGERROR("Route %s: bad parameter", s_routes[r].pattern);
+                    return -1;
                 }
+                if (!s_route_nodes[node].param)
+                {
+                    if ((child = route_node_new()) < 0)
+                    {
+                        LOGERROR("Route %s: out of route nodes", s_routes[r].pattern);
+                        return -1;
+                    }
+                    s_route_nodes[node].param = child;
+                    s_route_nodes[node].param_type = type;
+                }
+                node = s_route_nodes[node].param;
+                p = end;
             }
-            else
-            {
-                sprintf(control, FORMAT_CONTROL_STRING, var_name, strerror(errno));
-                LOGERROR("Device %s control %s: %s", device_name, var_name, strerror(errno));
-            }
-
-            if (controls_count)
+            else if ((unsigned char)*p < 128)
             {
-                strcat(controls, ", ");
+                if (!s_route_nodes[node].next[(unsigned char)*p])
+                {
+                    if ((child = route_node_new()) < 0)
+                    {
+                        LOGERROR("Route %s: out of route nodes", s_routes[r].pattern);
+                        return -1;
+                    }
+                    s_route_nodes[node].next[(unsigned char)*p] = child;
+                }
+                node = s_route_nodes[node].next[(unsigned char)*p];
             }
-            strcat(controls, control);
-            controls_count++;
         }
-        else if (mjson_get_string(hm->body.ptr, hm->body.len, json_path, buf, sizeof(buf)) > -1)
+        if (s_route_nodes[node].route >= 0)
         {
-            sprintf(control, FORMAT_CONTROL_STRING, var_name, "Error: Only numbers are expected");
-            LOGERROR("Device %s control %s: Only numbers are expected", device_name, var_name);
-
-            if (controls_count)
-            {
-                strcat(controls, ", ");
-            }
-            strcat(controls, control);
-            controls_count++;
+            LOGERROR("Route %s: can't be added", s_routes[r].pattern);
+            return -1;
         }
-        free(var_name);
+        s_route_nodes[node].route = r;
     }
-    close(fd);
-    strcat(controls, " }\n");
-    mg_http_reply(con, 200, "Content-Type: application/json\r\n", controls);
+    LOGDEBUG("Compiled %d routes into %d nodes", ROUTE_COUNT, s_route_nodes_count);
+
+    return 0;
 }
 
-static int device_buffer_check(struct v4l2_capability *cap, int buffer_index, int exclude_overlay)
+/*
+ * Returns the index of the route matching the path or -1, parameters that
+ * are not part of the route stay empty.
+ */
+static int route_match(struct mg_str *path, struct route_params *params)
 {
-    switch (buffer_index)
-    {
-    case V4L2_BUF_TYPE_VIDEO_CAPTURE:
-        return (cap->capabilities & V4L2_CAP_VIDEO_CAPTURE);
-
-    case V4L2_BUF_TYPE_VIDEO_OUTPUT:
-        return (cap->capabilities & V4L2_CAP_VIDEO_OUTPUT);
-
-    case V4L2_BUF_TYPE_VIDEO_OVERLAY:
-        return !exclude_overlay && (cap->capabilities & V4L2_CAP_VIDEO_OVERLAY);
+    struct route_node *node = &s_route_nodes[0];
+    size_t start;
+    size_t i = 0;
 
-    case V4L2_BUF_TYPE_VBI_CAPTURE:
-        return (cap->capabilities & V4L2_CAP_VBI_CAPTURE);
+    memset(params, 0, sizeof(struct route_params));
 
-    case V4L2_BUF_TYPE_VBI_OUTPUT:
-        return (cap->capabilities & V4L2_CAP_VBI_OUTPUT);
+    while (i < path->len)
+    {
+        unsigned char byte = (unsigned char)path->ptr[i];
 
-    case V4L2_BUF_TYPE_SLICED_VBI_CAPTURE:
-        return (cap->capabilities & V4L2_CAP_SLICED_VBI_CAPTURE);
+        if (byte < 128 && node->next[byte])
+        {
+            node = &s_route_nodes[node->next[byte]];
+            i++;
+            continue;
+        }
+        if (!node->param)
+        {
+            return -1;
+        }
 
-    case V4L2_BUF_TYPE_SLICED_VBI_OUTPUT:
-        return (cap->capabilities & V4L2_CAP_SLICED_VBI_OUTPUT);
+        start = i;
+        while (i < path->len && path->ptr[i] != '/')
+        {
+            i++;
+        }
+        if (i == start)
+        {
+            return -1;
+        }
+        params->values[node->param_type] = mg_str_n(path->ptr + start, i - start);
+        node = &s_route_nodes[node->param];
+    }
 
-    case V4L2_BUF_TYPE_VIDEO_OUTPUT_OVERLAY:
-        return !exclude_overlay && (cap->capabilities & V4L2_CAP_VIDEO_OUTPUT_OVERLAY);
+    return node->route;
+}
 
-    case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
-        return (cap->capabilities & V4L2_CAP_VIDEO_CAPTURE_MPLANE);
+static int request_method(struct mg_http_message *hm)
+{
+    int method;
 
-    case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
-        return (cap->capabilities & V4L2_CAP_VIDEO_OUTPUT_MPLANE);
+    for (method = 0; method < METHOD_OTHER; method++)
+    {
+        if (!mg_vcmp(&hm->method, s_method_names[method]))
+        {
+            break;
+        }
     }
 
-    return 0;
+    return method;
 }
 
-static void device_formats(struct mg_connection *con,
-                           char *device_name)
+static void request_timer_start(struct mg_connection *c, int route, int method)
 {
-    struct v4l2_capability cap;
-    struct v4l2_fmtdesc fmtdesc;
-    struct v4l2_frmsizeenum frmsize;
-    char format[1024] = {'\0'};
-    char formats[4096] = {'\0'};
-    char result[65536] = {'\0'};
-    int format_count = 0;
-    int buffers_count = 0;
-    int c;
+    struct http_loop *loop = (struct http_loop *)c->mgr->userdata;
 
-    int fd = device_open(device_name);
+    loop->request_latency = &loop->metrics.requests[route < 0 ? ROUTE_COUNT : route][method];
+    loop->request_started = metric_now_us();
+}
+
+static void route_dispatch(struct mg_connection *c, struct mg_http_message *hm, int route, int method, struct route_params *params)
+{
+    int type;
 
-    if (!fd)
+    if (route < 0)
     {
-        mg_http_reply(con, 400, "", "Device can't be opened.");
+        mg_http_reply(c, 404, "", "");
         return;
     }
 
-    memset(&cap, 0, sizeof(struct v4l2_capability));
-
-    strcat(result, "{ ");
-    if (ioctl(fd, VIDIOC_QUERYCAP, &cap) > -1)
+    for (type = 0; type < PARAM_COUNT; type++)
     {
-
-        memset(&fmtdesc, 0, sizeof(struct v4l2_fmtdesc));
-        memset(&frmsize, 0, sizeof(struct v4l2_frmsizeenum));
-
-        for (c = 1; c < 14; c++)
+        if (params->values[type].len >= s_param_sizes[type])
         {
-            if (!device_buffer_check(&cap, c, 0))
-            {
-                continue;
-            }
-
-            fmtdesc.type = c;
-
-            while (ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0)
-            {
-                fmtdesc.index++;
-                frmsize.pixel_format = fmtdesc.pixelformat;
-                frmsize.index = 0;
-                while (ioctl(fd, VIDIOC_ENUM_FRAMESIZES, &frmsize) >= 0)
-                {
-                    format[0] = '\0';
-                    if (frmsize.type == V4L2_FRMSIZE_TYPE_DISCRETE)
-                    {
-                        sprintf(format, FORMAT_DISCRETE,
-                                pixfmtstr(fmtdesc.pixelformat),
-                                frmsize.discrete.width,
-                                frmsize.discrete.height);
-                    }
-                    else if (frmsize.type == V4L2_FRMSIZE_TYPE_STEPWISE)
-                    {
-                        sprintf(format, FORMAT_STEPWISE,
-                                pixfmtstr(fmtdesc.pixelformat),
-                                frmsize.stepwise.min_width,
-                                frmsize.stepwise.min_height,
-                                frmsize.stepwise.max_width,
-                                frmsize.stepwise.max_height,
-                                frmsize.stepwise.step_width,
-                                frmsize.stepwise.step_height);
-                    }
-
-                    if (format_count)
-                    {
-                        strcat(formats, ", ");
-                    }
-                    strcat(formats, format);
-                    format_count++;
-                    frmsize.index++;
-                }
-            }
-            if (buffers_count)
-            {
-                strcat(result, ", ");
-            }
-            strcat(result, "\"");
-            strcat(result, v4l2_buffer_type_names[c - 1].name);
-            strcat(result, "\": { ");
-            strcat(result, formats);
-            strcat(result, " }");
-            buffers_count++;
+            mg_http_reply(c, 400, "", "%s", s_param_errors[type]);
+            return;
         }
     }
-    strcat(result, " }\n");
-    close(fd);
 
-    mg_http_reply(con, 200, "Content-Type: application/json\r\n", result);
+    if (method == METHOD_OTHER || !s_routes[route].handlers[method])
+    {
+        mg_http_reply(c, 405, "", "Unsupported method.");
+        return;
+    }
+
+    s_routes[route].handlers[method](c, hm, params);
 }
 
-static char *field_name_get(int field)
+/*
+ * Replies sent from the event loop are done when the handler returns,
+ * device jobs have taken the timer over.
+ */
+static void request_timer_stop(struct mg_connection *c)
 {
-    char *snum;
-    if (field > -1 && field < 10)
+    struct http_loop *loop = (struct http_loop *)c->mgr->userdata;
+
+    if (loop->request_latency)
     {
-        return strdup(v4l2_field_names[field].name);
+        metric_observe(loop->request_latency, metric_now_us() - loop->request_started);
+        loop->request_latency = NULL;
     }
-    snum = malloc(10);
-    sprintf(snum, "%d", field);
-    return snum;
 }
 
-static char *colorspace_name_get(int colorspace)
+static void metrics_printf(struct out_buf *out, const char *fmt, ...)
 {
-    char *snum;
-    if (colorspace > -1 && colorspace < 13)
+    char line[512];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+
+    if (len > 0)
     {
-        return strdup(v4l2_colorspace_names[colorspace].name);
+        out_print(line, len < (int)sizeof(line) ? len : (int)sizeof(line) - 1, out);
     }
-    snum = malloc(10);
-    sprintf(snum, "%d", colorspace);
-    return snum;
 }
 
-static void device_format_get(struct mg_connection *con,
-                              char *device_name)
+static void metric_histogram_merge(struct metric_histogram *to, struct metric_histogram *from)
 {
-    struct v4l2_capability cap;
-    struct v4l2_format fmt;
-    char status[1024] = {'\0'};
-    char pix_format[1024] = {'\0'};
-    char result[65536] = {'\0'};
-    char *field_name;
-    char *colorspace_name;
-    int buffers_count = 0;
-    int c;
-
-    int fd = device_open(device_name);
+    int i;
 
-    if (!fd)
+    for (i = 0; i <= METRIC_BUCKETS; i++)
     {
-        mg_http_reply(con, 400, "", "Device can't be opened.");
-        return;
+        to->buckets[i] += metric_get(&from->buckets[i]);
     }
+    to->sum_us += metric_get(&from->sum_us);
+    to->count += metric_get(&from->count);
+}
 
-    memset(&cap, 0, sizeof(struct v4l2_capability));
+static void metrics_print_histogram(struct out_buf *out, const char *name, const char *labels, struct metric_histogram *histogram)
+{
+    unsigned long long cumulative = 0;
+    int i;
 
-    strcat(result, "{ ");
+    for (i = 0; i < METRIC_BUCKETS; i++)
+    {
+        cumulative += histogram->buckets[i];
+        metrics_printf(out, "%s_bucket{%s,le=\"%g\"} %llu\n", name, labels, (double)(1ULL << i) / 1e6, cumulative);
+    }
+    metrics_printf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, labels, cumulative + histogram->buckets[METRIC_BUCKETS]);
+    metrics_printf(out, "%s_sum{%s} %.6f\n", name, labels, histogram->sum_us / 1e6);
+    metrics_printf(out, "%s_count{%s} %llu\n", name, labels, histogram->count);
+}
+
+/*
+ * Label value in the exposition format. Backslash, quote and newline are
+ * escaped, the value is cut to fit without splitting an escape.
+ */
+static void metrics_label_value(char *to, size_t size, const char *value, size_t max)
+{
+    size_t len = strnlen(value, max);
+    size_t n = 0;
+    size_t i;
 
-    if (ioctl(fd, VIDIOC_QUERYCAP, &cap) > -1)
+    for (i = 0; i < len; i++)
     {
-        for (c = 1; c < 14; c++)
+        if (value[i] == '\\' || value[i] == '"' || value[i] == '\n')
         {
-            if (!device_buffer_check(&cap, c, 1))
+            if (n + 3 > size)
             {
-                continue;
+                break;
             }
-
-            memset(&fmt, 0, sizeof(struct v4l2_format));
-
-            pix_format[0] = '\0';
-            fmt.type = c;
-
-            if (buffers_count)
+            to[n++] = '\\';
+            to[n++] = value[i] == '\n' ? 'n' : value[i];
+        }
+        else
+        {
+            if (n + 2 > size)
             {
-                strcat(result, ", ");
+                break;
             }
-            strcat(result, "\"");
-            strcat(result, v4l2_buffer_type_names[c - 1].name);
-            strcat(result, "\": { ");
+            to[n++] = value[i];
+        }
+    }
+    to[n] = '\0';
+}
 
-            if (ioctl(fd, VIDIOC_G_FMT, &fmt) == 0)
-            {
-                field_name = field_name_get(fmt.fmt.pix.field);
-                colorspace_name = colorspace_name_get(fmt.fmt.pix.colorspace);
+/*
+ * Labels of the per device ioctl series, the same for every one of them.
+ */
+static void metrics_ioctl_labels(char *labels, size_t size, struct device_metrics *device, int t)
+{
+    char name[160];
+    char ioctl[40];
 
-                sprintf(pix_format, FORMAT_PIX_FORMAT,
-                        fmt.fmt.pix.width,
-                        fmt.fmt.pix.height,
-                        pixfmtstr(fmt.fmt.pix.pixelformat),
-                        field_name,
-                        fmt.fmt.pix.bytesperline,
-                        fmt.fmt.pix.sizeimage,
-                        colorspace_name,
-                        fmt.fmt.pix.priv,
-                        fmt.fmt.pix.flags);
+    metrics_label_value(name, sizeof(name), device->device_name, sizeof(device->device_name));
+    metrics_label_value(ioctl, sizeof(ioctl), t < IOCTL_METRICS - 1 ? ioctl_names[t].name : "other", sizeof(ioctl));
+    snprintf(labels, size, "device=\"%.*s\",ioctl=\"%.*s\"", (int)sizeof(name), name, (int)sizeof(ioctl), ioctl);
+}
 
-                free(field_name);
-                free(colorspace_name);
+/*
+ * Prometheus text exposition for /metrics. Rendered on the event loop from
+ * relaxed reads of the counters, series without samples are left out.
+ */
+static void metrics_list(struct mg_connection *c, struct mg_http_message *hm, struct route_params *params)
+{
+    struct out_buf out;
+    struct metric_histogram histogram;
+    struct device_metrics *device;
+    unsigned long long bytes_received = 0;
+    unsigned long long bytes_sent = 0;
+    unsigned long long connections = 0;
+    unsigned long long accepted = 0;
+    char labels[256];
+    char pattern[128];
+    int devices = __atomic_load_n(&s_device_metrics_count, __ATOMIC_ACQUIRE);
+    int route;
+    int method;
+    int t;
+    int i;
 
-                strcat(result, pix_format);
+    conn_out(c, &out);
+    metrics_printf(&out, "# HELP video_control_http_request_duration_seconds Time from request to the last reply part handed to the connection.\n");
+    metrics_printf(&out, "# TYPE video_control_http_request_duration_seconds histogram\n");
+    for (route = 0; route < ROUTE_METRICS; route++)
+    {
+        for (method = 0; method < METHOD_METRICS; method++)
+        {
+            memset(&histogram, 0, sizeof(histogram));
+            for (t = 0; t < s_threads; t++)
+            {
+                metric_histogram_merge(&histogram, &s_loops[t].metrics.requests[route][method]);
             }
-            else
+            if (histogram.count)
             {
-                sprintf(status, "\"status\": \"%s\"", strerror(errno));
-                strcat(result, status);
+                metrics_label_value(pattern, sizeof(pattern), route < ROUTE_COUNT ? s_routes[route].pattern : "other", sizeof(pattern));
+                snprintf(labels, sizeof(labels), "route=\"%.*s\",method=\"%.16s\"",
+                         (int)sizeof(pattern), pattern, s_method_names[method]);
+                metrics_print_histogram(&out, "video_control_http_request_duration_seconds", labels, &histogram);
             }
-            strcat(result, " }");
-
-            buffers_count++;
         }
     }
 
-    strcat(result, " }\n");
-    mg_http_reply(con, 200, "Content-Type: application/json\r\n", result);
-}
-
-static int check_request(
-    struct mg_connection *c,
-    struct mg_http_message *hm,
-    char *url,
-    int enabled_methods,
-    char *device_name)
-{
-
-    int url_length = strlen(url) - 1;
-
-    if (hm->uri.len - url_length < 128)
+    metrics_printf(&out, "# HELP video_control_ioctl_duration_seconds Time spent in device ioctls.\n");
+    metrics_printf(&out, "# TYPE video_control_ioctl_duration_seconds histogram\n");
+    for (i = 0; i < devices; i++)
     {
-        memcpy(device_name, hm->uri.ptr + url_length, hm->uri.len - url_length);
-    }
-    else
-    {
-        mg_http_reply(c, 400, "", "Device name too long.");
-        return -1;
+        device = &s_device_metrics[i];
+        for (t = 0; t < IOCTL_METRICS; t++)
+        {
+            memset(&histogram, 0, sizeof(histogram));
+            metric_histogram_merge(&histogram, &device->ioctls[t]);
+            if (histogram.count)
+            {
+                metrics_ioctl_labels(labels, sizeof(labels), device, t);
+                metrics_print_histogram(&out, "video_control_ioctl_duration_seconds", labels, &histogram);
+            }
+        }
     }
 
-    if ((enabled_methods & METHOD_GET) && !strncmp(hm->method.ptr, "GET", 3))
+    metrics_printf(&out, "# HELP video_control_ioctl_errors_total Failed device ioctls, including the EINVAL that ends enumerations.\n");
+    metrics_printf(&out, "# TYPE video_control_ioctl_errors_total counter\n");
+    for (i = 0; i < devices; i++)
     {
-        return METHOD_GET;
+        device = &s_device_metrics[i];
+        for (t = 0; t < IOCTL_METRICS; t++)
+        {
+            if (metric_get(&device->errors[t]))
+            {
+                metrics_ioctl_labels(labels, sizeof(labels), device, t);
+                metrics_printf(&out, "video_control_ioctl_errors_total{%s} %llu\n", labels, metric_get(&device->errors[t]));
+            }
+        }
     }
 
-    if ((enabled_methods & METHOD_POST) && !strncmp(hm->method.ptr, "POST", 4))
+    metrics_printf(&out, "# HELP video_control_loop_iteration_duration_seconds Event loop work per iteration, without the IO wait.\n");
+    metrics_printf(&out, "# TYPE video_control_loop_iteration_duration_seconds histogram\n");
+    for (t = 0; t < s_threads; t++)
     {
-        return METHOD_POST;
+        memset(&histogram, 0, sizeof(histogram));
+        metric_histogram_merge(&histogram, &s_loops[t].metrics.iterations);
+        snprintf(labels, sizeof(labels), "loop=\"%d\"", t);
+        metrics_print_histogram(&out, "video_control_loop_iteration_duration_seconds", labels, &histogram);
+
+        bytes_received += metric_get(&s_loops[t].metrics.bytes_received);
+        bytes_sent += metric_get(&s_loops[t].metrics.bytes_sent);
+        connections += metric_get(&s_loops[t].metrics.connections);
+        accepted += metric_get(&s_loops[t].metrics.accepted);
     }
 
-    mg_http_reply(c, 405, "", "Unsupported method.");
-
-    return -1;
+    metrics_printf(&out, "# HELP video_control_http_received_bytes_total Bytes read from client connections.\n");
+    metrics_printf(&out, "# TYPE video_control_http_received_bytes_total counter\n");
+    metrics_printf(&out, "video_control_http_received_bytes_total %llu\n", bytes_received);
+    metrics_printf(&out, "# HELP video_control_http_sent_bytes_total Bytes written to client connections.\n");
+    metrics_printf(&out, "# TYPE video_control_http_sent_bytes_total counter\n");
+    metrics_printf(&out, "video_control_http_sent_bytes_total %llu\n", bytes_sent);
+    metrics_printf(&out, "# HELP video_control_http_connections Open client connections.\n");
+    metrics_printf(&out, "# TYPE video_control_http_connections gauge\n");
+    metrics_printf(&out, "video_control_http_connections %llu\n", connections);
+    metrics_printf(&out, "# HELP video_control_http_connections_accepted_total Accepted client connections.\n");
+    metrics_printf(&out, "# TYPE video_control_http_connections_accepted_total counter\n");
+    metrics_printf(&out, "video_control_http_connections_accepted_total %llu\n", accepted);
+
+    reply_body(c, hm, HEADERS_METRICS, &out, NULL, NULL);
+    out_free(&out);
+    (void)params;
 }
 
 static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
 {
-    char *method = malloc(128);
-    char *device_name = malloc(128);
-    char *peer = malloc(128);
+    struct http_loop *loop = (struct http_loop *)c->mgr->userdata;
+    struct http_conn *conn = (struct http_conn *)fn_data;
 
-    if (ev == MG_EV_HTTP_MSG)
+    if (ev == MG_EV_HTTP_MSG && conn)
     {
         struct mg_http_message *hm = (struct mg_http_message *)ev_data;
+        struct route_params params;
+        int route = route_match(&hm->uri, &params);
+        int method = request_method(hm);
+        char *peer;
 
-        mg_ntoa(&c->peer, peer, 128);
+        request_timer_start(c, route, method);
+
+        conn->used = 0;
+        peer = conn_alloc(conn, PEER_NAME_SIZE);
+        mg_ntoa(&c->peer, peer, PEER_NAME_SIZE);
 
         LOGINFO("%s %.*s %.*s (%lu bytes)",
                 peer,
@@ -815,58 +6433,55 @@ static void fn(struct mg_connection *c, int ev, void *ev_data, void *fn_data)
                 (int)hm->uri.len, hm->uri.ptr,
                 (unsigned long)hm->body.len);
 
-        if (mg_http_match_uri(hm, URL_DEVICES))
-        {
-            device_list(c);
-        }
-        else if (mg_http_match_uri(hm, URL_DEVICE_FORMATS))
-        {
-            switch (check_request(c, hm, URL_DEVICE_FORMATS, METHOD_GET, device_name))
-            {
-            case METHOD_GET:
-                device_formats(c, device_name);
-                break;
+        route_dispatch(c, hm, route, method, &params);
+        request_timer_stop(c);
+    }
+    else if (ev == MG_EV_WS_MSG)
+    {
+        device_rpc_frame(c, (struct mg_ws_message *)ev_data);
+    }
+    else if (ev == MG_EV_READ)
+    {
+        metric_add(&loop->metrics.bytes_received, ((struct mg_str *)ev_data)->len);
+    }
+    else if (ev == MG_EV_WRITE)
+    {
+        metric_add(&loop->metrics.bytes_sent, *(int *)ev_data);
+    }
+    else if (ev == MG_EV_ACCEPT)
+    {
+        metric_add(&loop->metrics.connections, 1);
+        metric_add(&loop->metrics.accepted, 1);
 
-            default:
-                break;
-            };
-        }
-        else if (mg_http_match_uri(hm, URL_DEVICE_CONTROL))
+        // Without a context the connection can't serve requests
+        conn = malloc(sizeof(struct http_conn));
+        c->fn_data = conn;
+        if (!conn)
         {
-            switch (check_request(c, hm, URL_DEVICE_CONTROL, METHOD_GET | METHOD_POST, device_name))
-            {
-            case METHOD_GET:
-                device_control_get(c, device_name);
-                break;
-
-            case METHOD_POST:
-                device_control_set(c, hm, device_name);
-                break;
-
-            default:
-                break;
-            };
+            LOGERROR("Connection dropped, out of memory");
+            c->is_closing = 1;
         }
-        else if (mg_http_match_uri(hm, URL_DEVICE_FORMAT))
+        else
         {
-            switch (check_request(c, hm, URL_DEVICE_FORMAT, METHOD_GET, device_name))
-            {
-            case METHOD_GET:
-                device_format_get(c, device_name);
-                break;
-
-            default:
-                break;
-            };
+            conn->c = c;
+            loop_conn_add(loop, conn);
         }
-        else
+    }
+    else if (ev == MG_EV_CLOSE)
+    {
+        if (c->is_accepted)
         {
-            mg_http_reply(c, 404, "", "");
+            metric_add(&loop->metrics.connections, -1);
+            if (conn)
+            {
+                loop_conn_remove(loop, conn);
+            }
+            free(c->fn_data);
+            c->fn_data = NULL;
         }
+        device_events_close(c);
+        device_stream_close(c);
     }
-    free(method);
-    free(device_name);
-    (void)fn_data;
 }
 
 static void usage(const char *argv0)
@@ -876,15 +6491,83 @@ static void usage(const char *argv0)
     fprintf(stderr, " -d            Enable debug log messages\n");
     fprintf(stderr, " -h            Print this help screen and exit\n");
     fprintf(stderr, " -i address    IP address for listening\n");
+    fprintf(stderr, " -j            Log as JSON lines\n");
     fprintf(stderr, " -p port       Port for listening (number between 80 and 65535)\n");
+    fprintf(stderr, " -M config     Simulated devices from JSON file (\"default\" = built-in set)\n");
+    fprintf(stderr, " -k seconds    Close device after seconds without requests (0 = after each request, default %d)\n", DEVICE_IDLE_TIMEOUT);
+    fprintf(stderr, " -r lines      Log at most lines per second from one place in the code (0 = no limit)\n");
+    fprintf(stderr, " -s devices    Publish frames of the comma separated devices to shared memory\n");
+    fprintf(stderr, " -t threads    Number of event loop threads (1 .. %d)\n", MAX_THREADS);
+}
+
+/*
+ * Start of the work in a loop iteration, after the IO wait.
+ */
+static void loop_ready_fn(struct mg_mgr *mgr)
+{
+    ((struct http_loop *)mgr->userdata)->poll_ready = metric_now_us();
+}
+
+static void *event_loop(void *arg)
+{
+    long thread_index = (long)arg;
+    struct http_loop *loop = &s_loops[thread_index];
+    struct mg_mgr *mgr = &loop->mgr;
+    int wakeup_socks[2];
+
+    mg_mgr_init(mgr);
+    mgr->userdata = loop;
+    // Only several loops share the port, a single one keeps EADDRINUSE
+    // for a second server on the same port
+    mgr->reuseport = s_threads > 1;
+    mgr->ready_fn = loop_ready_fn;
+
+    if (mg_socketpair(&wakeup_socks[0], &wakeup_socks[1]) &&
+        mg_wrapfd(mgr, wakeup_socks[1], wakeup_fn, loop) != NULL)
+    {
+        loop->wakeup_sock = wakeup_socks[0];
+    }
+    else
+    {
+        LOGWARN("Thread %ld can't create wakeup socket, device requests will block", thread_index);
+    }
+
+    if (thread_index == 0)
+    {
+        device_registry_start(mgr);
+    }
+
+    if (mg_http_listen(mgr, s_listen_on, fn, NULL) == NULL)
+    {
+        LOGERROR("Thread %ld can't listen on %s", thread_index, s_listen_on);
+        s_signo = SIGTERM;
+    }
+    else
+    {
+        LOGDEBUG("Thread %ld listen on %s", thread_index, s_listen_on);
+    }
+
+    while (s_signo == 0)
+    {
+        mg_mgr_poll(mgr, 100);
+        metric_observe(&loop->metrics.iterations, metric_now_us() - loop->poll_ready);
+    }
+    mg_mgr_free(mgr);
+
+    return NULL;
 }
 
 int main(int argc, char *argv[])
 {
     int opt;
-    struct mg_mgr mgr;
-
-    while ((opt = getopt(argc, argv, "dhi:p:")) != -1)
+    long t;
+    int log_json = 0;
+    int log_rate = 0;
+    char *shm_devices = NULL;
+    char *device_name;
+    pthread_t threads[MAX_THREADS];
+
+    while ((opt = getopt(argc, argv, "dhi:jk:M:p:r:s:t:")) != -1)
     {
         switch (opt)
         {
@@ -900,6 +6583,30 @@ int main(int argc, char *argv[])
             listen_ip = optarg;
             break;
 
+        case 'j':
+            log_json = 1;
+            break;
+
+        case 'k':
+            if (digits_only(optarg) && strlen(optarg) < 7)
+            {
+                s_device_idle = atoi(optarg);
+            }
+            else
+            {
+                printf("ERROR: Invalid idle timeout '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'M':
+            if (mock_init(optarg) != 0)
+            {
+                printf("ERROR: Invalid mock config '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
         case 'p':
             if (digits_only(optarg) && atoi(optarg) > 79 && atoi(optarg) < 65536)
             {
@@ -912,6 +6619,34 @@ int main(int argc, char *argv[])
             }
             break;
 
+        case 'r':
+            if (digits_only(optarg) && strlen(optarg) < 7)
+            {
+                log_rate = atoi(optarg);
+            }
+            else
+            {
+                printf("ERROR: Invalid log rate '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 's':
+            shm_devices = optarg;
+            break;
+
+        case 't':
+            if (digits_only(optarg) && atoi(optarg) > 0 && atoi(optarg) <= MAX_THREADS)
+            {
+                s_threads = atoi(optarg);
+            }
+            else
+            {
+                printf("ERROR: Invalid number of threads '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
         default:
             printf("ERROR: Invalid option '-%c'\n", opt);
             return 1;
@@ -923,23 +6658,87 @@ int main(int argc, char *argv[])
     strcat(s_listen_on, ":");
     strcat(s_listen_on, listen_port);
 
+    log_start(log_json, log_rate);
+
     LOGINFO("Starting video-control-rest");
 
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
 
-    mg_mgr_init(&mgr);
-    mg_http_listen(&mgr, s_listen_on, fn, NULL);
+    LOGINFO("Listen on %s (%d threads)", s_listen_on, s_threads);
+    if (mock_enabled())
+    {
+        LOGINFO("Using %d simulated devices", mock_count());
+    }
 
-    LOGINFO("Listen on %s", s_listen_on);
+    rpc_init();
+    if (route_compile() != 0)
+    {
+        log_stop();
+        return 1;
+    }
 
-    while (s_signo == 0)
+    for (device_name = shm_devices ? strtok(shm_devices, ",") : NULL; device_name; device_name = strtok(NULL, ","))
+    {
+        if (stream_publish(device_name) != 0)
+        {
+            LOGERROR("Can't publish device %s", device_name);
+        }
+        else if (!device_exists(device_name))
+        {
+            LOGINFO("Device %s not present, publishing once it is plugged in", device_name);
+        }
+    }
+
+    // Every thread owns its mg_mgr and a SO_REUSEPORT listener,
+    // the kernel spreads incoming connections across them
+    for (t = 0; t < s_threads; t++)
+    {
+        s_loops[t].wakeup_sock = -1;
+        pthread_mutex_init(&s_loops[t].lock, NULL);
+    }
+
+    for (t = 1; t < s_threads; t++)
+    {
+        int rc = pthread_create(&threads[t], NULL, event_loop, (void *)t);
+        if (rc != 0)
+        {
+            LOGERROR("Can't start thread %ld: %s", t, strerror(rc));
+            s_threads = t;
+            break;
+        }
+    }
+
+    event_loop((void *)0);
+
+    for (t = 1; t < s_threads; t++)
     {
-        mg_mgr_poll(&mgr, 100);
+        pthread_join(threads[t], NULL);
+    }
+
+    device_workers_stop();
+    device_events_stop();
+    device_streams_stop();
+    device_registry_free();
+    mock_free();
+
+    for (t = 0; t < s_threads; t++)
+    {
+        struct reply_part *part;
+        while ((part = s_loops[t].parts))
+        {
+            s_loops[t].parts = part->next;
+            reply_part_free(part);
+        }
+        if (s_loops[t].wakeup_sock >= 0)
+        {
+            close(s_loops[t].wakeup_sock);
+        }
+        pthread_mutex_destroy(&s_loops[t].lock);
     }
-    mg_mgr_free(&mgr);
 
     LOGINFO("Exiting on signal %d", s_signo);
+    log_stop();
 
     return 0;
 }
@@ -2298,6 +2298,10 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   mg_mgr_poll(mgr, 0);
 #if MG_ARCH == MG_ARCH_FREERTOS
   FreeRTOS_DeleteSocketSet(mgr->ss);
+#endif
+#if MG_ENABLE_EPOLL
+  if (mgr->epoll_fd >= 0) close(mgr->epoll_fd);
+  mgr->epoll_fd = -1;
 #endif
   LOG(LL_INFO, ("All connections closed"));
 }
@@ -2317,6 +2321,12 @@ void mg_mgr_init(struct mg_mgr *mgr) {
   mgr->dnstimeout = 3000;
   mgr->dns4.url = "udp://8.8.8.8:53";
   mgr->dns6.url = "udp://[2001:4860:4860::8888]:53";
+#if MG_ENABLE_EPOLL
+  // On failure, mg_iotest() falls back to select()
+  if ((mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    LOG(LL_ERROR, ("epoll_create1: %d, using select()", errno));
+  }
+#endif
 }
 
 #ifdef MG_ENABLE_LINES
@@ -2755,6 +2765,26 @@ static struct mg_connection *alloc_conn(struct mg_mgr *mgr, int is_client,
   return c;
 }
 
+#if MG_ENABLE_EPOLL
+#ifndef MG_EPOLL_EVENTS
+#define MG_EPOLL_EVENTS 64
+#endif
+
+// Register socket once for its whole lifetime. Edge-triggered, so readiness
+// is latched in is_readable / is_wready until the socket returns EAGAIN.
+// Closing the socket removes it from the epoll set automatically.
+static void mg_epoll_add(struct mg_connection *c) {
+  struct epoll_event ev;
+  if (c->mgr->epoll_fd < 0 || FD(c) == INVALID_SOCKET) return;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  if (epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, FD(c), &ev) != 0) {
+    LOG(LL_ERROR, ("%lu epoll_ctl: %d", c->id, errno));
+  }
+}
+#endif
+
 static int mg_sock_recv(struct mg_connection *c, void *buf, int len,
                         int *fail) {
   int n = 0;
@@ -2776,6 +2806,10 @@ static int mg_sock_recv(struct mg_connection *c, void *buf, int len,
         c->peer.port = usa.sin.sin_port;
       }
     }
+#if MG_ARCH == MG_ARCH_UNIX
+  } else if (c->is_fd) {
+    n = read(FD(c), buf, len);
+#endif
   } else {
     n = recv(FD(c), (char *) buf, len, MSG_NONBLOCKING);
   }
@@ -2793,6 +2827,10 @@ static int mg_sock_send(struct mg_connection *c, const void *buf, int len,
     if (c->peer.is_ip6) slen = sizeof(usa.sin6);
 #endif
     n = sendto(FD(c), (char *) buf, len, 0, &usa.sa, slen);
+#if MG_ARCH == MG_ARCH_UNIX
+  } else if (c->is_fd) {
+    n = write(FD(c), buf, len);
+#endif
   } else {
     n = send(FD(c), (char *) buf, len, MSG_NONBLOCKING);
   }
@@ -2852,7 +2890,7 @@ static void mg_set_non_blocking_mode(SOCKET fd) {
 #endif
 }
 
-SOCKET mg_open_listener(const char *url) {
+SOCKET mg_open_listener(const char *url, int reuseport) {
   struct mg_addr addr;
   SOCKET fd = INVALID_SOCKET;
 
@@ -2881,6 +2919,10 @@ SOCKET mg_open_listener(const char *url) {
         // SO_EXCLUSIVEADDRUSE is supported and set on a socket.
         !setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *) &on, sizeof(on)) &&
 #endif
+#if defined(SO_REUSEPORT)
+        (!reuseport ||
+         !setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on))) &&
+#endif
 #if defined(_WIN32) && defined(SO_EXCLUSIVEADDRUSE) && !defined(WINCE)
         // "Using SO_REUSEADDR and SO_EXCLUSIVEADDRUSE"
         //! setsockopt(fd, SOL_SOCKET, SO_BROADCAST, (char *) &on, sizeof(on))
@@ -2923,6 +2965,9 @@ static void read_conn(struct mg_connection *c,
     mg_call(c, MG_EV_READ, &evd);
   } else {
     if (fail) c->is_closing = 1;
+#if MG_ENABLE_EPOLL
+    else c->is_readable = 0;  // Drained, wait for the next edge
+#endif
   }
 }
 
@@ -2934,6 +2979,10 @@ static int write_conn(struct mg_connection *c) {
     mg_call(c, MG_EV_WRITE, &rc);
   } else if (fail) {
     c->is_closing = 1;
+#if MG_ENABLE_EPOLL
+  } else {
+    c->is_wready = 0;  // Socket buffer full, wait for the next edge
+#endif
   }
   return rc;
 }
@@ -3002,6 +3051,9 @@ void mg_connect_resolved(struct mg_connection *c) {
   }
 
   mg_set_non_blocking_mode(FD(c));
+#if MG_ENABLE_EPOLL
+  mg_epoll_add(c);
+#endif
   mg_call(c, MG_EV_RESOLVE, NULL);
   if (type == SOCK_STREAM) {
     union usa usa = tousa(&c->peer);
@@ -3045,9 +3097,17 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   socklen_t sa_len = sizeof(usa);
   SOCKET fd = accept(FD(lsn), &usa.sa, &sa_len);
   if (fd == INVALID_SOCKET) {
+#if MG_ENABLE_EPOLL
+    lsn->is_readable = 0;  // Backlog drained, wait for the next edge
+    if (!mg_sock_failed()) return;
+#endif
     LOG(LL_ERROR, ("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERRNO));
 #if !defined(_WIN32)
-  } else if (fd >= FD_SETSIZE) {
+  } else if (fd >= FD_SETSIZE
+#if MG_ENABLE_EPOLL
+             && lsn->mgr->epoll_fd < 0
+#endif
+  ) {
     LOG(LL_ERROR, ("%ld > %ld", (long) fd, (long) FD_SETSIZE));
     closesocket(fd);
 #endif
@@ -3070,6 +3130,9 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
     mg_set_non_blocking_mode(FD(c));
     setsockopts(c);
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+#if MG_ENABLE_EPOLL
+    mg_epoll_add(c);
+#endif
     c->is_accepted = 1;
     c->is_hexdumping = lsn->is_hexdumping;
     c->pfn = lsn->pfn;
@@ -3126,7 +3189,7 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
                                 mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = NULL;
   int is_udp = strncmp(url, "udp:", 4) == 0;
-  SOCKET fd = mg_open_listener(url);
+  SOCKET fd = mg_open_listener(url, mgr->reuseport);
   if (fd == INVALID_SOCKET) {
   } else if ((c = alloc_conn(mgr, 0, fd)) == NULL) {
     LOG(LL_ERROR, ("OOM %s", url));
@@ -3136,6 +3199,9 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
     c->is_listening = 1;
     c->is_udp = is_udp;
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+#if MG_ENABLE_EPOLL
+    mg_epoll_add(c);
+#endif
     c->fn = fn;
     c->fn_data = fn_data;
     LOG(LL_INFO, ("%lu accepting on %s", c->id, url));
@@ -3143,7 +3209,50 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
   return c;
 }
 
+// Add an already opened socket (e.g. one end of mg_socketpair) to the manager
+struct mg_connection *mg_wrapfd(struct mg_mgr *mgr, int fd,
+                                mg_event_handler_t fn, void *fn_data) {
+  struct mg_connection *c = alloc_conn(mgr, 0, (SOCKET) fd);
+  if (c == NULL) {
+    LOG(LL_ERROR, ("OOM"));
+  } else {
+    LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+#if MG_ENABLE_EPOLL
+    mg_epoll_add(c);
+#endif
+    c->fn = fn;
+    c->fn_data = fn_data;
+    LOG(LL_DEBUG, ("%lu wrapped fd %d", c->id, fd));
+  }
+  return c;
+}
+
+#if MG_ENABLE_EPOLL
+// Only connections with new events are touched, idle ones cost nothing.
+// Do not block if the previous iteration left readiness unconsumed.
+static void mg_epoll_iotest(struct mg_mgr *mgr, int ms) {
+  struct epoll_event evs[MG_EPOLL_EVENTS];
+  int i, n = epoll_wait(mgr->epoll_fd, evs, MG_EPOLL_EVENTS,
+                        mgr->epoll_hot ? 0 : ms);
+  if (n < 0) {
+    LOG(LL_DEBUG, ("epoll_wait: %d %d", n, errno));
+  }
+  for (i = 0; i < n; i++) {
+    struct mg_connection *c = (struct mg_connection *) evs[i].data.ptr;
+    uint32_t e = evs[i].events;
+    if (e & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) c->is_readable = 1;
+    if (e & (EPOLLOUT | EPOLLERR | EPOLLHUP)) c->is_wready = 1;
+  }
+}
+#endif
+
 static void mg_iotest(struct mg_mgr *mgr, int ms) {
+#if MG_ENABLE_EPOLL
+  if (mgr->epoll_fd >= 0) {
+    mg_epoll_iotest(mgr, ms);
+    return;
+  }
+#endif
 #if MG_ARCH == MG_ARCH_FREERTOS
   struct mg_connection *c;
   for (c = mgr->conns; c != NULL; c = c->next) {
@@ -3214,12 +3323,22 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
   unsigned long now;
 
   mg_iotest(mgr, ms);
+  if (mgr->ready_fn != NULL) mgr->ready_fn(mgr);
   now = mg_millis();
   mg_timer_poll(now);
+#if MG_ENABLE_EPOLL
+  mgr->epoll_hot = 0;
+#endif
 
   for (c = mgr->conns; c != NULL; c = tmp) {
     tmp = c->next;
     mg_call(c, MG_EV_POLL, &now);
+#if MG_ENABLE_EPOLL
+    if (mgr->epoll_fd >= 0) {
+      c->is_writable = c->is_wready && (c->is_connecting ||
+                                        (c->send.len > 0 && c->is_tls_hs == 0));
+    }
+#endif
     LOG(LL_VERBOSE_DEBUG,
         ("%lu %c%c %c%c%c%c%c", c->id, c->is_readable ? 'r' : '-',
          c->is_writable ? 'w' : '-', c->is_tls ? 'T' : 't',
@@ -3239,6 +3358,12 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
     }
 
     if (c->is_draining && c->send.len == 0) c->is_closing = 1;
+#if MG_ENABLE_EPOLL
+    if (!c->is_closing && !c->is_resolving &&
+        (c->is_readable || (c->is_wready && c->send.len > 0))) {
+      mgr->epoll_hot = 1;
+    }
+#endif
     if (c->is_closing) close_conn(c);
   }
 }
@@ -391,6 +391,15 @@ typedef int socklen_t;
 #define MG_ENABLE_SOCKETPAIR 0
 #endif
 
+// Use edge-triggered epoll instead of select() for socket IO (Linux only)
+#ifndef MG_ENABLE_EPOLL
+#define MG_ENABLE_EPOLL 0
+#endif
+
+#if MG_ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 // Granularity of the send/recv IO buffer growth
 #ifndef MG_IO_SIZE
 #define MG_IO_SIZE 512
@@ -668,6 +677,13 @@ struct mg_mgr {
   int dnstimeout;               // DNS resolve timeout in milliseconds
   unsigned long nextid;         // Next connection ID
   void *userdata;               // Arbitrary user data pointer
+  void (*ready_fn)(struct mg_mgr *);  // Called when mg_mgr_poll() IO wait ends
+  int reuseport;  // Set SO_REUSEPORT on listeners, so that several managers
+                  // (e.g. one per thread) share an address
+#if MG_ENABLE_EPOLL
+  int epoll_fd;   // epoll instance, all sockets are registered once
+  int epoll_hot;  // Some connection still has unconsumed readiness
+#endif
 #if MG_ARCH == MG_ARCH_FREERTOS
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
@@ -701,6 +717,10 @@ struct mg_connection {
   unsigned is_closing : 1;     // Close and free the connection immediately
   unsigned is_readable : 1;    // Connection is ready to read
   unsigned is_writable : 1;    // Connection is ready to write
+  unsigned is_fd : 1;          // Wrapped non-socket fd, use read()/write()
+#if MG_ENABLE_EPOLL
+  unsigned is_wready : 1;      // Socket reported writable, not yet EAGAIN
+#endif
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
@@ -716,6 +736,8 @@ int mg_printf(struct mg_connection *, const char *fmt, ...);
 int mg_vprintf(struct mg_connection *, const char *fmt, va_list ap);
 char *mg_straddr(struct mg_connection *, char *, size_t);
 bool mg_socketpair(int *s1, int *s2);
+struct mg_connection *mg_wrapfd(struct mg_mgr *, int fd,
+                                mg_event_handler_t fn, void *fn_data);
 bool mg_aton(struct mg_str str, struct mg_addr *addr);
 char *mg_ntoa(const struct mg_addr *addr, char *buf, size_t len);
 
@@ -0,0 +1,1500 @@
+/*
+ * video-control-rest
+ *
+ * Simulated V4L2 devices for benchmarking and testing without cameras.
+ * Devices are described in JSON, every device answers the ioctls used by
+ * the server and sleeps a configurable time per ioctl to mimic the driver.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// memfd_create()
+#define _GNU_SOURCE
+
+#include "v4l2_mock.h"
+#include "mjson.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <linux/version.h>
+#include <linux/videodev2.h>
+
+#define MOCK_MAX_DEVICES 16
+#define MOCK_MAX_CONTROLS 64
+#define MOCK_MAX_MENU_ITEMS 16
+#define MOCK_MAX_FORMATS 8
+#define MOCK_MAX_SIZES 16
+#define MOCK_MAX_INTERVALS 8
+#define MOCK_MAX_FDS 4096
+#define MOCK_MAX_BUFFERS 8
+#define MOCK_MAX_CONFIG_SIZE (256 * 1024)
+
+enum mock_op
+{
+    OP_QUERYCAP,
+    OP_QUERYCTRL,
+    OP_QUERYMENU,
+    OP_G_CTRL,
+    OP_S_CTRL,
+    OP_G_EXT_CTRLS,
+    OP_S_EXT_CTRLS,
+    OP_TRY_EXT_CTRLS,
+    OP_ENUM_FMT,
+    OP_ENUM_FRAMESIZES,
+    OP_ENUM_FRAMEINTERVALS,
+    OP_G_FMT,
+    OP_REQBUFS,
+    OP_QUERYBUF,
+    OP_QBUF,
+    OP_DQBUF,
+    OP_STREAMON,
+    OP_STREAMOFF,
+    OP_COUNT
+};
+
+static const char *mock_op_names[OP_COUNT] = {
+    "QUERYCAP", "QUERYCTRL", "QUERYMENU", "G_CTRL", "S_CTRL", "G_EXT_CTRLS",
+    "S_EXT_CTRLS", "TRY_EXT_CTRLS", "ENUM_FMT", "ENUM_FRAMESIZES",
+    "ENUM_FRAMEINTERVALS", "G_FMT", "REQBUFS", "QUERYBUF", "QBUF", "DQBUF",
+    "STREAMON", "STREAMOFF"};
+
+struct mock_control
+{
+    __u32 id;
+    __u32 type;
+    __u32 flags;
+    char name[32];
+    __s32 minimum;
+    __s32 maximum;
+    __s32 step;
+    __s32 default_value;
+    __s64 value;
+    char menu[MOCK_MAX_MENU_ITEMS][32];
+};
+
+struct mock_size
+{
+    __u32 type;
+    __u32 min_width;
+    __u32 min_height;
+    __u32 max_width;
+    __u32 max_height;
+    __u32 step_width;
+    __u32 step_height;
+};
+
+struct mock_format
+{
+    __u32 pixelformat;
+    char description[32];
+    int sizes_count;
+    struct mock_size sizes[MOCK_MAX_SIZES];
+    int intervals_count;
+    struct v4l2_fract intervals[MOCK_MAX_INTERVALS];
+};
+
+struct mock_device
+{
+    char name[32];
+    char driver[16];
+    char card[32];
+    char bus_info[32];
+    int latency_us[OP_COUNT];
+    int controls_count;
+    struct mock_control controls[MOCK_MAX_CONTROLS];
+    int formats_count;
+    struct mock_format formats[MOCK_MAX_FORMATS];
+    pthread_mutex_t lock;
+
+    // Streaming I/O, the buffers belong to the fd that requested them
+    int owner_fd;
+    int memfd;
+    unsigned char *memory;
+    __u32 buffers_count;
+    __u32 buffer_size;
+    __u32 queue[MOCK_MAX_BUFFERS];
+    __u32 queued;
+    int streaming;
+    __u32 sequence;
+    unsigned long long next_frame_us;
+};
+
+/*
+ * Known control names get their standard ids, so class grouping and
+ * clients behave as with a real UVC camera.
+ */
+static const struct
+{
+    const char *name;
+    __u32 id;
+} mock_control_ids[] = {
+    {"Brightness", V4L2_CID_BRIGHTNESS},
+    {"Contrast", V4L2_CID_CONTRAST},
+    {"Saturation", V4L2_CID_SATURATION},
+    {"Hue", V4L2_CID_HUE},
+    {"White Balance Temperature, Auto", V4L2_CID_AUTO_WHITE_BALANCE},
+    {"Gamma", V4L2_CID_GAMMA},
+    {"Gain", V4L2_CID_GAIN},
+    {"Power Line Frequency", V4L2_CID_POWER_LINE_FREQUENCY},
+    {"White Balance Temperature", V4L2_CID_WHITE_BALANCE_TEMPERATURE},
+    {"Sharpness", V4L2_CID_SHARPNESS},
+    {"Backlight Compensation", V4L2_CID_BACKLIGHT_COMPENSATION},
+    {"Exposure, Auto", V4L2_CID_EXPOSURE_AUTO},
+    {"Exposure (Absolute)", V4L2_CID_EXPOSURE_ABSOLUTE},
+    {"Focus (absolute)", V4L2_CID_FOCUS_ABSOLUTE},
+    {"Focus, Auto", V4L2_CID_FOCUS_AUTO},
+    {"Zoom, Absolute", V4L2_CID_ZOOM_ABSOLUTE},
+    {"Pan (Absolute)", V4L2_CID_PAN_ABSOLUTE},
+    {"Tilt (Absolute)", V4L2_CID_TILT_ABSOLUTE},
+    {"Video Bitrate", V4L2_CID_MPEG_VIDEO_BITRATE},
+};
+
+static const struct
+{
+    __u32 ctrl_class;
+    const char *name;
+} mock_classes[] = {
+    {V4L2_CTRL_CLASS_USER, "User Controls"},
+    {V4L2_CTRL_CLASS_CODEC, "Codec Controls"},
+    {V4L2_CTRL_CLASS_CAMERA, "Camera Controls"},
+};
+
+// A webcam with discrete modes and a board camera with stepwise sizes
+static const char *mock_default_config =
+    "{\"devices\": ["
+    "{\"name\": \"video0\", \"driver\": \"uvcvideo\", \"card\": \"Mock UVC Camera\", \"bus_info\": \"usb-mock-1\","
+    " \"latency_us\": {\"default\": 50, \"G_CTRL\": 400, \"S_CTRL\": 1500, \"G_EXT_CTRLS\": 400, \"S_EXT_CTRLS\": 1500},"
+    " \"controls\": ["
+    "  {\"name\": \"Brightness\", \"min\": -64, \"max\": 64, \"default\": 0},"
+    "  {\"name\": \"Contrast\", \"min\": 0, \"max\": 95, \"default\": 32},"
+    "  {\"name\": \"Saturation\", \"min\": 0, \"max\": 100, \"default\": 55},"
+    "  {\"name\": \"Hue\", \"min\": -2000, \"max\": 2000, \"default\": 0},"
+    "  {\"name\": \"White Balance Temperature, Auto\", \"type\": \"bool\", \"default\": 1},"
+    "  {\"name\": \"Gamma\", \"min\": 100, \"max\": 300, \"default\": 165},"
+    "  {\"name\": \"Power Line Frequency\", \"type\": \"menu\", \"default\": 1, \"menu\": [\"Disabled\", \"50 Hz\", \"60 Hz\"]},"
+    "  {\"name\": \"Sharpness\", \"min\": 1, \"max\": 7, \"default\": 2},"
+    "  {\"name\": \"Exposure, Auto\", \"type\": \"menu\", \"default\": 3, \"menu\": [\"\", \"Manual Mode\", \"\", \"Aperture Priority Mode\"]},"
+    "  {\"name\": \"Exposure (Absolute)\", \"min\": 3, \"max\": 2047, \"default\": 250},"
+    "  {\"name\": \"Pan (Absolute)\", \"min\": -36000, \"max\": 36000, \"step\": 3600, \"default\": 0},"
+    "  {\"name\": \"Tilt (Absolute)\", \"min\": -36000, \"max\": 36000, \"step\": 3600, \"default\": 0},"
+    "  {\"name\": \"Zoom, Absolute\", \"min\": 100, \"max\": 500, \"default\": 100}],"
+    " \"formats\": ["
+    "  {\"fourcc\": \"MJPG\", \"description\": \"Motion-JPEG\", \"sizes\": [\"1920x1080\", \"1280x720\", \"640x480\"], \"intervals\": [\"1/30\", \"1/15\"]},"
+    "  {\"fourcc\": \"YUYV\", \"description\": \"YUYV 4:2:2\", \"sizes\": [\"640x480\", \"320x240\"], \"intervals\": [\"1/30\", \"1/15\", \"1/5\"]}]},"
+    "{\"name\": \"video1\", \"driver\": \"bm2835 mmal\", \"card\": \"Mock MMAL Camera\", \"bus_info\": \"platform:mock-mmal\","
+    " \"latency_us\": {\"default\": 20},"
+    " \"controls\": ["
+    "  {\"name\": \"Brightness\", \"min\": 0, \"max\": 100, \"default\": 50},"
+    "  {\"name\": \"Contrast\", \"min\": -100, \"max\": 100, \"default\": 0},"
+    "  {\"name\": \"Video Bitrate\", \"min\": 25000, \"max\": 25000000, \"step\": 25000, \"default\": 10000000}],"
+    " \"formats\": ["
+    "  {\"fourcc\": \"H264\", \"description\": \"H.264\", \"sizes\": [{\"min\": \"32x32\", \"max\": \"4056x3040\", \"step\": \"2x2\"}], \"intervals\": [\"1/30\"]},"
+    "  {\"fourcc\": \"MJPG\", \"description\": \"Motion-JPEG\", \"sizes\": [{\"min\": \"32x32\", \"max\": \"4056x3040\", \"step\": \"2x2\"}], \"intervals\": [\"1/30\"]}]}"
+    "]}";
+
+static struct mock_device *s_mock_devices = NULL;
+static int s_mock_count = 0;
+// fd of the opened /dev/null -> device index + 1
+static int s_mock_fds[MOCK_MAX_FDS];
+
+static int mock_get_int(const char *json, int len, const char *path, int fallback)
+{
+    double value;
+
+    return mjson_get_number(json, len, path, &value) ? (int)value : fallback;
+}
+
+static int mock_control_cmp(const void *a, const void *b)
+{
+    __u32 ia = ((const struct mock_control *)a)->id;
+    __u32 ib = ((const struct mock_control *)b)->id;
+
+    return ia < ib ? -1 : ia > ib;
+}
+
+/*
+ * Nested lookups run on the element found by mjson_find(), paths like
+ * "$.controls[1].min" would match the key of the next element when the
+ * first one has none.
+ */
+static int mock_element(const char *json, int len, const char *array, int index, const char **p, int *n)
+{
+    char path[64];
+
+    snprintf(path, sizeof(path), "$.%s[%d]", array, index);
+    return mjson_find(json, len, path, p, n) != MJSON_TOK_INVALID;
+}
+
+static void mock_parse_controls(struct mock_device *device, const char *json, int len)
+{
+    struct mock_control *control;
+    const char *p;
+    char path[64];
+    char type[16];
+    int n;
+    int c;
+    int i;
+    unsigned int k;
+    __u32 classes[sizeof(mock_classes) / sizeof(mock_classes[0])] = {0};
+
+    for (c = 0; device->controls_count < MOCK_MAX_CONTROLS && mock_element(json, len, "controls", c, &p, &n); c++)
+    {
+        control = &device->controls[device->controls_count];
+
+        if (mjson_get_string(p, n, "$.name", control->name, sizeof(control->name)) < 0)
+        {
+            continue;
+        }
+
+        if (mjson_get_string(p, n, "$.type", type, sizeof(type)) < 0)
+        {
+            strcpy(type, "int");
+        }
+        control->type = !strcmp(type, "bool")    ? V4L2_CTRL_TYPE_BOOLEAN
+                        : !strcmp(type, "menu")  ? V4L2_CTRL_TYPE_MENU
+                        : !strcmp(type, "int64") ? V4L2_CTRL_TYPE_INTEGER64
+                                                 : V4L2_CTRL_TYPE_INTEGER;
+
+        control->id = V4L2_CID_USER_BASE + 0x1000 + c;
+        for (k = 0; k < sizeof(mock_control_ids) / sizeof(mock_control_ids[0]); k++)
+        {
+            if (!strcmp(mock_control_ids[k].name, control->name))
+            {
+                control->id = mock_control_ids[k].id;
+            }
+        }
+        control->id = mock_get_int(p, n, "$.id", control->id);
+
+        // An empty menu item is an index the driver skips
+        for (i = 0; control->type == V4L2_CTRL_TYPE_MENU && i < MOCK_MAX_MENU_ITEMS; i++)
+        {
+            snprintf(path, sizeof(path), "$.menu[%d]", i);
+            if (mjson_get_string(p, n, path, control->menu[i], sizeof(control->menu[i])) < 0)
+            {
+                break;
+            }
+        }
+
+        control->minimum = mock_get_int(p, n, "$.min", 0);
+        control->maximum = mock_get_int(p, n, "$.max", control->type == V4L2_CTRL_TYPE_MENU      ? i - 1
+                                                       : control->type == V4L2_CTRL_TYPE_BOOLEAN ? 1
+                                                                                                 : 255);
+        control->step = mock_get_int(p, n, "$.step", 1);
+        control->default_value = mock_get_int(p, n, "$.default", control->minimum);
+        control->value = control->default_value;
+
+        if (control->step < 1)
+        {
+            control->step = 1;
+        }
+
+        for (k = 0; k < sizeof(mock_classes) / sizeof(mock_classes[0]); k++)
+        {
+            if (V4L2_CTRL_ID2CLASS(control->id) == mock_classes[k].ctrl_class)
+            {
+                classes[k] = 1;
+            }
+        }
+        device->controls_count++;
+    }
+
+    // Real drivers list a class control in front of each class
+    for (k = 0; k < sizeof(mock_classes) / sizeof(mock_classes[0]) && device->controls_count < MOCK_MAX_CONTROLS; k++)
+    {
+        if (!classes[k])
+        {
+            continue;
+        }
+        control = &device->controls[device->controls_count++];
+        control->id = mock_classes[k].ctrl_class | 1;
+        control->type = V4L2_CTRL_TYPE_CTRL_CLASS;
+        control->flags = V4L2_CTRL_FLAG_READ_ONLY | V4L2_CTRL_FLAG_WRITE_ONLY;
+        snprintf(control->name, sizeof(control->name), "%s", mock_classes[k].name);
+    }
+
+    qsort(device->controls, device->controls_count, sizeof(struct mock_control), mock_control_cmp);
+}
+
+/*
+ * Sizes are "WxH" strings for discrete sizes or { "min", "max", "step" }
+ * objects for stepwise ones.
+ */
+static int mock_parse_size(struct mock_size *size, const char *json, int len)
+{
+    char value[32];
+
+    if (mjson_get_string(json, len, "$", value, sizeof(value)) > 0 &&
+        sscanf(value, "%ux%u", &size->max_width, &size->max_height) == 2)
+    {
+        size->type = V4L2_FRMSIZE_TYPE_DISCRETE;
+        size->min_width = size->max_width;
+        size->min_height = size->max_height;
+        size->step_width = size->step_height = 1;
+        return 0;
+    }
+
+    if (mjson_get_string(json, len, "$.min", value, sizeof(value)) < 0 ||
+        sscanf(value, "%ux%u", &size->min_width, &size->min_height) != 2 ||
+        mjson_get_string(json, len, "$.max", value, sizeof(value)) < 0 ||
+        sscanf(value, "%ux%u", &size->max_width, &size->max_height) != 2)
+    {
+        return -1;
+    }
+    if (mjson_get_string(json, len, "$.step", value, sizeof(value)) < 0 ||
+        sscanf(value, "%ux%u", &size->step_width, &size->step_height) != 2)
+    {
+        size->step_width = size->step_height = 1;
+    }
+    size->type = size->step_width == 1 && size->step_height == 1 ? V4L2_FRMSIZE_TYPE_CONTINUOUS : V4L2_FRMSIZE_TYPE_STEPWISE;
+
+    return 0;
+}
+
+static void mock_parse_formats(struct mock_device *device, const char *json, int len)
+{
+    struct mock_format *format;
+    struct v4l2_fract *interval;
+    const char *p;
+    const char *sp;
+    char path[64];
+    char value[32];
+    char fourcc[8];
+    int n;
+    int sn;
+    int i;
+
+    while (device->formats_count < MOCK_MAX_FORMATS && mock_element(json, len, "formats", device->formats_count, &p, &n))
+    {
+        format = &device->formats[device->formats_count];
+
+        if (mjson_get_string(p, n, "$.fourcc", fourcc, sizeof(fourcc)) < 0)
+        {
+            break;
+        }
+        // Short codes like "Y8" are padded with spaces
+        for (i = strlen(fourcc); i < 4; i++)
+        {
+            fourcc[i] = ' ';
+        }
+        format->pixelformat = v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+
+        if (mjson_get_string(p, n, "$.description", format->description, sizeof(format->description)) < 0)
+        {
+            snprintf(format->description, sizeof(format->description), "%.4s", fourcc);
+        }
+
+        while (format->sizes_count < MOCK_MAX_SIZES && mock_element(p, n, "sizes", format->sizes_count, &sp, &sn) &&
+               mock_parse_size(&format->sizes[format->sizes_count], sp, sn) == 0)
+        {
+            format->sizes_count++;
+        }
+
+        while (format->intervals_count < MOCK_MAX_INTERVALS)
+        {
+            interval = &format->intervals[format->intervals_count];
+            snprintf(path, sizeof(path), "$.intervals[%d]", format->intervals_count);
+            if (mjson_get_string(p, n, path, value, sizeof(value)) < 0 ||
+                sscanf(value, "%u/%u", &interval->numerator, &interval->denominator) != 2)
+            {
+                break;
+            }
+            format->intervals_count++;
+        }
+
+        device->formats_count++;
+    }
+}
+
+static int mock_parse(const char *json, int len)
+{
+    struct mock_device *device;
+    const char *p;
+    char path[64];
+    int latency;
+    int n;
+    int o;
+
+    s_mock_devices = calloc(MOCK_MAX_DEVICES, sizeof(struct mock_device));
+    if (!s_mock_devices)
+    {
+        return -1;
+    }
+
+    while (s_mock_count < MOCK_MAX_DEVICES && mock_element(json, len, "devices", s_mock_count, &p, &n))
+    {
+        device = &s_mock_devices[s_mock_count];
+
+        if (mjson_get_string(p, n, "$.name", device->name, sizeof(device->name)) < 0)
+        {
+            break;
+        }
+        if (mjson_get_string(p, n, "$.driver", device->driver, sizeof(device->driver)) < 0)
+        {
+            strcpy(device->driver, "mock");
+        }
+        if (mjson_get_string(p, n, "$.card", device->card, sizeof(device->card)) < 0)
+        {
+            strcpy(device->card, "Mock Camera");
+        }
+        if (mjson_get_string(p, n, "$.bus_info", device->bus_info, sizeof(device->bus_info)) < 0)
+        {
+            snprintf(device->bus_info, sizeof(device->bus_info), "mock:%.26s", device->name);
+        }
+
+        // "latency_us" is either one number or an object keyed by ioctl
+        latency = mock_get_int(p, n, "$.latency_us", 0);
+        latency = mock_get_int(p, n, "$.latency_us.default", latency);
+        for (o = 0; o < OP_COUNT; o++)
+        {
+            snprintf(path, sizeof(path), "$.latency_us.%s", mock_op_names[o]);
+            device->latency_us[o] = mock_get_int(p, n, path, latency);
+        }
+
+        mock_parse_controls(device, p, n);
+        mock_parse_formats(device, p, n);
+        pthread_mutex_init(&device->lock, NULL);
+        device->owner_fd = -1;
+        device->memfd = -1;
+        s_mock_count++;
+    }
+
+    if (!s_mock_count)
+    {
+        free(s_mock_devices);
+        s_mock_devices = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+int mock_init(const char *config)
+{
+    char *json = NULL;
+    FILE *fp;
+    int len;
+    int rc;
+
+    if (!strcmp(config, "default"))
+    {
+        return mock_parse(mock_default_config, strlen(mock_default_config));
+    }
+
+    fp = fopen(config, "r");
+    if (!fp)
+    {
+        return -1;
+    }
+    json = malloc(MOCK_MAX_CONFIG_SIZE);
+    len = json ? (int)fread(json, 1, MOCK_MAX_CONFIG_SIZE, fp) : 0;
+    fclose(fp);
+
+    rc = len > 0 ? mock_parse(json, len) : -1;
+    free(json);
+
+    return rc;
+}
+
+static void mock_buffers_free(struct mock_device *device)
+{
+    // Mappings made by mock_mmap() keep the memory of the memfd alive
+    if (device->memory)
+    {
+        munmap(device->memory, (size_t)device->buffers_count * device->buffer_size);
+    }
+    if (device->memfd >= 0)
+    {
+        close(device->memfd);
+    }
+    device->memory = NULL;
+    device->memfd = -1;
+    device->owner_fd = -1;
+    device->buffers_count = 0;
+    device->queued = 0;
+    device->streaming = 0;
+}
+
+void mock_free(void)
+{
+    int d;
+
+    for (d = 0; d < s_mock_count; d++)
+    {
+        mock_buffers_free(&s_mock_devices[d]);
+        pthread_mutex_destroy(&s_mock_devices[d].lock);
+    }
+    free(s_mock_devices);
+    s_mock_devices = NULL;
+    s_mock_count = 0;
+}
+
+int mock_enabled(void)
+{
+    return s_mock_count > 0;
+}
+
+int mock_count(void)
+{
+    return s_mock_count;
+}
+
+const char *mock_name(int index)
+{
+    return index < s_mock_count ? s_mock_devices[index].name : NULL;
+}
+
+static int mock_find(const char *device_name)
+{
+    int d;
+
+    for (d = 0; d < s_mock_count; d++)
+    {
+        if (!strcmp(s_mock_devices[d].name, device_name))
+        {
+            return d;
+        }
+    }
+
+    return -1;
+}
+
+static struct mock_device *mock_device_of(int fd)
+{
+    if (fd < 0 || fd >= MOCK_MAX_FDS || !s_mock_fds[fd])
+    {
+        return NULL;
+    }
+
+    return &s_mock_devices[s_mock_fds[fd] - 1];
+}
+
+/*
+ * Mock fds are real fds of /dev/null, so close(), poll() and fd limits
+ * behave as usual.
+ */
+int mock_open(const char *device_name)
+{
+    int d = mock_find(device_name);
+    int fd;
+
+    if (d < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    fd = open("/dev/null", O_RDWR | O_CLOEXEC);
+    if (fd >= MOCK_MAX_FDS)
+    {
+        close(fd);
+        errno = EMFILE;
+        return -1;
+    }
+    if (fd >= 0)
+    {
+        s_mock_fds[fd] = d + 1;
+    }
+
+    return fd;
+}
+
+int mock_close(int fd)
+{
+    struct mock_device *device = mock_device_of(fd);
+
+    // Like the driver, the closing owner releases the buffers
+    if (device)
+    {
+        pthread_mutex_lock(&device->lock);
+        if (device->owner_fd == fd)
+        {
+            mock_buffers_free(device);
+        }
+        pthread_mutex_unlock(&device->lock);
+        s_mock_fds[fd] = 0;
+    }
+
+    return close(fd);
+}
+
+void *mock_mmap(size_t length, int prot, int flags, int fd, off_t offset)
+{
+    struct mock_device *device = mock_device_of(fd);
+    void *map = MAP_FAILED;
+
+    if (!device)
+    {
+        errno = EBADF;
+        return MAP_FAILED;
+    }
+
+    pthread_mutex_lock(&device->lock);
+    if (device->owner_fd == fd && offset >= 0 && (size_t)offset % device->buffer_size == 0 &&
+        (size_t)offset + length <= (size_t)device->buffers_count * device->buffer_size)
+    {
+        map = mmap(NULL, length, prot, flags, device->memfd, offset);
+    }
+    else
+    {
+        errno = EINVAL;
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    return map;
+}
+
+static void mock_stat_fill(int d, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IFCHR | 0660;
+    st->st_ino = 1000 + d;
+    st->st_rdev = makedev(81, d);
+}
+
+int mock_stat(const char *device_name, struct stat *st)
+{
+    int d = mock_find(device_name);
+
+    if (d < 0)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    mock_stat_fill(d, st);
+
+    return 0;
+}
+
+int mock_fstat(int fd, struct stat *st)
+{
+    struct mock_device *device = mock_device_of(fd);
+
+    if (!device)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    mock_stat_fill(device - s_mock_devices, st);
+
+    return 0;
+}
+
+static struct mock_control *mock_control_find(struct mock_device *device, __u32 id)
+{
+    int c;
+
+    for (c = 0; c < device->controls_count; c++)
+    {
+        if (device->controls[c].id == id)
+        {
+            return &device->controls[c];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Adjusts value like the v4l2 control framework: integers are clamped and
+ * rounded to the step, menus must name an existing item.
+ */
+static int mock_control_validate(struct mock_control *control, __s64 *value)
+{
+    __s64 v = *value;
+
+    switch (control->type)
+    {
+    case V4L2_CTRL_TYPE_CTRL_CLASS:
+        return EACCES;
+
+    case V4L2_CTRL_TYPE_BOOLEAN:
+        v = v != 0;
+        break;
+
+    case V4L2_CTRL_TYPE_MENU:
+        if (v < control->minimum || v > control->maximum ||
+            v >= MOCK_MAX_MENU_ITEMS || !control->menu[v][0])
+        {
+            return EINVAL;
+        }
+        break;
+
+    default:
+        if (v < control->minimum)
+        {
+            v = control->minimum;
+        }
+        if (v > control->maximum)
+        {
+            v = control->maximum;
+        }
+        v = control->minimum + ((v - control->minimum + control->step / 2) / control->step) * control->step;
+        if (v > control->maximum)
+        {
+            v -= control->step;
+        }
+        break;
+    }
+
+    *value = v;
+    return 0;
+}
+
+static int mock_queryctrl(struct mock_device *device, struct v4l2_queryctrl *qc)
+{
+    struct mock_control *control = NULL;
+    __u32 id = qc->id & ~(V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND);
+    int c;
+
+    if (qc->id & (V4L2_CTRL_FLAG_NEXT_CTRL | V4L2_CTRL_FLAG_NEXT_COMPOUND))
+    {
+        for (c = 0; c < device->controls_count && !control; c++)
+        {
+            if (device->controls[c].id > id)
+            {
+                control = &device->controls[c];
+            }
+        }
+    }
+    else
+    {
+        control = mock_control_find(device, id);
+    }
+
+    if (!control)
+    {
+        return EINVAL;
+    }
+
+    memset(qc, 0, sizeof(struct v4l2_queryctrl));
+    qc->id = control->id;
+    qc->type = control->type;
+    snprintf((char *)qc->name, sizeof(qc->name), "%s", control->name);
+    qc->minimum = control->minimum;
+    qc->maximum = control->maximum;
+    qc->step = control->step;
+    qc->default_value = control->default_value;
+    qc->flags = control->flags;
+
+    return 0;
+}
+
+static int mock_querymenu(struct mock_device *device, struct v4l2_querymenu *qm)
+{
+    struct mock_control *control = mock_control_find(device, qm->id);
+
+    if (!control || control->type != V4L2_CTRL_TYPE_MENU ||
+        qm->index >= MOCK_MAX_MENU_ITEMS || (__s32)qm->index < control->minimum ||
+        (__s32)qm->index > control->maximum || !control->menu[qm->index][0])
+    {
+        return EINVAL;
+    }
+    snprintf((char *)qm->name, sizeof(qm->name), "%s", control->menu[qm->index]);
+
+    return 0;
+}
+
+static int mock_ext_ctrls(struct mock_device *device, struct v4l2_ext_controls *ctrls, int op)
+{
+    struct v4l2_ext_control *ext;
+    struct mock_control *control;
+    __s64 value;
+    __u32 i;
+    int err;
+
+    // Validate all first, a set is applied completely or not at all
+    for (i = 0; i < ctrls->count; i++)
+    {
+        ext = &ctrls->controls[i];
+        control = mock_control_find(device, ext->id);
+        if (!control || control->type == V4L2_CTRL_TYPE_CTRL_CLASS)
+        {
+            ctrls->error_idx = op == OP_S_EXT_CTRLS ? ctrls->count : i;
+            return EINVAL;
+        }
+        if (op == OP_G_EXT_CTRLS)
+        {
+            continue;
+        }
+        value = control->type == V4L2_CTRL_TYPE_INTEGER64 ? ext->value64 : ext->value;
+        if ((err = mock_control_validate(control, &value)) != 0)
+        {
+            ctrls->error_idx = op == OP_S_EXT_CTRLS ? ctrls->count : i;
+            return err;
+        }
+    }
+
+    for (i = 0; i < ctrls->count; i++)
+    {
+        ext = &ctrls->controls[i];
+        control = mock_control_find(device, ext->id);
+        value = control->type == V4L2_CTRL_TYPE_INTEGER64 ? ext->value64 : ext->value;
+
+        if (op == OP_G_EXT_CTRLS)
+        {
+            value = control->value;
+        }
+        else
+        {
+            mock_control_validate(control, &value);
+            if (op == OP_S_EXT_CTRLS)
+            {
+                control->value = value;
+            }
+        }
+
+        if (control->type == V4L2_CTRL_TYPE_INTEGER64)
+        {
+            ext->value64 = value;
+        }
+        else
+        {
+            ext->value = (__s32)value;
+        }
+    }
+
+    return 0;
+}
+
+static struct mock_format *mock_format_find(struct mock_device *device, __u32 pixelformat)
+{
+    int f;
+
+    for (f = 0; f < device->formats_count; f++)
+    {
+        if (device->formats[f].pixelformat == pixelformat)
+        {
+            return &device->formats[f];
+        }
+    }
+
+    return NULL;
+}
+
+static int mock_enum_framesizes(struct mock_device *device, struct v4l2_frmsizeenum *fs)
+{
+    struct mock_format *format = mock_format_find(device, fs->pixel_format);
+    struct mock_size *size;
+
+    if (!format || fs->index >= (__u32)format->sizes_count)
+    {
+        return EINVAL;
+    }
+
+    size = &format->sizes[fs->index];
+    if (size->type != V4L2_FRMSIZE_TYPE_DISCRETE && fs->index > 0)
+    {
+        return EINVAL;
+    }
+
+    fs->type = size->type;
+    if (size->type == V4L2_FRMSIZE_TYPE_DISCRETE)
+    {
+        fs->discrete.width = size->max_width;
+        fs->discrete.height = size->max_height;
+    }
+    else
+    {
+        fs->stepwise.min_width = size->min_width;
+        fs->stepwise.min_height = size->min_height;
+        fs->stepwise.max_width = size->max_width;
+        fs->stepwise.max_height = size->max_height;
+        fs->stepwise.step_width = size->step_width;
+        fs->stepwise.step_height = size->step_height;
+    }
+
+    return 0;
+}
+
+static int mock_enum_frameintervals(struct mock_device *device, struct v4l2_frmivalenum *fi)
+{
+    struct mock_format *format = mock_format_find(device, fi->pixel_format);
+    struct mock_size *size;
+    int s;
+
+    if (!format || fi->index >= (__u32)format->intervals_count)
+    {
+        return EINVAL;
+    }
+
+    for (s = 0; s < format->sizes_count; s++)
+    {
+        size = &format->sizes[s];
+        if (fi->width >= size->min_width && fi->width <= size->max_width &&
+            fi->height >= size->min_height && fi->height <= size->max_height)
+        {
+            fi->type = V4L2_FRMIVAL_TYPE_DISCRETE;
+            fi->discrete = format->intervals[fi->index];
+            return 0;
+        }
+    }
+
+    return EINVAL;
+}
+
+// 0 for compressed formats
+static __u32 mock_bytes_per_pixel(__u32 pixelformat)
+{
+    switch (pixelformat)
+    {
+    case V4L2_PIX_FMT_GREY:
+        return 1;
+    case V4L2_PIX_FMT_YUYV:
+        return 2;
+    case V4L2_PIX_FMT_RGB24:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+static int mock_g_fmt(struct mock_device *device, struct v4l2_format *fmt)
+{
+    struct mock_format *format = &device->formats[0];
+    __u32 type = fmt->type;
+
+    if (type != V4L2_BUF_TYPE_VIDEO_CAPTURE || !device->formats_count || !format->sizes_count)
+    {
+        return EINVAL;
+    }
+
+    memset(fmt, 0, sizeof(struct v4l2_format));
+    fmt->type = type;
+    fmt->fmt.pix.width = format->sizes[0].max_width;
+    fmt->fmt.pix.height = format->sizes[0].max_height;
+    fmt->fmt.pix.pixelformat = format->pixelformat;
+    fmt->fmt.pix.field = V4L2_FIELD_NONE;
+    fmt->fmt.pix.bytesperline = fmt->fmt.pix.width * mock_bytes_per_pixel(format->pixelformat);
+    fmt->fmt.pix.sizeimage = fmt->fmt.pix.width * fmt->fmt.pix.height * 2;
+    if (fmt->fmt.pix.bytesperline)
+    {
+        fmt->fmt.pix.sizeimage = fmt->fmt.pix.bytesperline * fmt->fmt.pix.height;
+    }
+    fmt->fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+
+    return 0;
+}
+
+/*
+ * Bit writer for the generated JPEG frames, 0xff bytes are stuffed with
+ * a zero as in the entropy coded segment of a real JPEG.
+ */
+struct mock_bits
+{
+    unsigned char *buf;
+    size_t len;
+    size_t size;
+    __u32 acc;
+    int count;
+};
+
+static void mock_bits_put(struct mock_bits *bits, __u32 value, int count)
+{
+    bits->acc = (bits->acc << count) | (value & ((1u << count) - 1));
+    bits->count += count;
+
+    while (bits->count >= 8 && bits->len + 2 <= bits->size)
+    {
+        unsigned char byte = (unsigned char)(bits->acc >> (bits->count - 8));
+
+        bits->buf[bits->len++] = byte;
+        if (byte == 0xff)
+        {
+            bits->buf[bits->len++] = 0;
+        }
+        bits->count -= 8;
+    }
+}
+
+/*
+ * Grayscale baseline JPEG of the configured size. All blocks are flat,
+ * the first DC difference sets the brightness of the whole image and
+ * follows the frame sequence, so consecutive frames differ.
+ */
+static size_t mock_jpeg(unsigned char *out, size_t size, __u32 width, __u32 height, __u32 sequence)
+{
+    static const unsigned char header[] = {
+        0xff, 0xd8,                                     // SOI
+        0xff, 0xdb, 0x00, 0x43, 0x00,                   // DQT, 64 entries follow
+    };
+    static const unsigned char tables[] = {
+        0xff, 0xc4, 0x00, 0x27,                         // DHT
+        0x00, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00, 0x06, // DC 0: "0" = 0, "10" = 6 bits
+        0x10, 1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0x00,       // AC 0: "0" = EOB
+        0xff, 0xda, 0x00, 0x08, 0x01, 0x01, 0x00, 0x00, 0x3f, 0x00,       // SOS
+    };
+    struct mock_bits bits = {out, 0, size, 0, 0};
+    __u32 blocks = ((width + 7) / 8) * ((height + 7) / 8);
+    __u32 b;
+
+    if (size < sizeof(header) + 64 + 13 + sizeof(tables) + 2 * 2 + blocks / 4 + 8)
+    {
+        return 0;
+    }
+
+    memcpy(out, header, sizeof(header));
+    memset(out + sizeof(header), 8, 64);
+    bits.len = sizeof(header) + 64;
+
+    // SOF0, one 8 bit component without subsampling
+    out[bits.len++] = 0xff;
+    out[bits.len++] = 0xc0;
+    out[bits.len++] = 0x00;
+    out[bits.len++] = 0x0b;
+    out[bits.len++] = 8;
+    out[bits.len++] = height >> 8;
+    out[bits.len++] = height & 0xff;
+    out[bits.len++] = width >> 8;
+    out[bits.len++] = width & 0xff;
+    out[bits.len++] = 1;
+    out[bits.len++] = 1;
+    out[bits.len++] = 0x11;
+    out[bits.len++] = 0;
+
+    memcpy(out + bits.len, tables, sizeof(tables));
+    bits.len += sizeof(tables);
+
+    mock_bits_put(&bits, 0x2, 2);
+    mock_bits_put(&bits, 32 + sequence % 32, 6);
+    mock_bits_put(&bits, 0, 1);
+    for (b = 1; b < blocks; b++)
+    {
+        mock_bits_put(&bits, 0, 2);
+    }
+    // Padding with ones up to the byte boundary
+    if (bits.count)
+    {
+        mock_bits_put(&bits, 0xff, 8 - bits.count);
+    }
+
+    out[bits.len++] = 0xff;
+    out[bits.len++] = 0xd9;
+
+    return bits.len;
+}
+
+/*
+ * Moving test pattern for uncompressed formats, compressed formats other
+ * than MJPEG only get the configured size filled.
+ */
+static __u32 mock_frame(struct mock_device *device, unsigned char *out, __u32 size)
+{
+    struct v4l2_format fmt;
+    __u32 x;
+    __u32 y;
+    __u32 bpp;
+
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (mock_g_fmt(device, &fmt) != 0)
+    {
+        return 0;
+    }
+
+    if (fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG || fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_JPEG)
+    {
+        return mock_jpeg(out, size, fmt.fmt.pix.width, fmt.fmt.pix.height, device->sequence);
+    }
+
+    bpp = mock_bytes_per_pixel(fmt.fmt.pix.pixelformat);
+    if (!bpp || fmt.fmt.pix.sizeimage > size)
+    {
+        memset(out, 0, size);
+        return size;
+    }
+
+    for (y = 0; y < fmt.fmt.pix.height; y++)
+    {
+        unsigned char *line = out + y * fmt.fmt.pix.bytesperline;
+
+        for (x = 0; x < fmt.fmt.pix.width; x++)
+        {
+            unsigned char value = (unsigned char)(x + y + device->sequence * 4);
+
+            if (fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV)
+            {
+                line[x * 2] = value;
+                line[x * 2 + 1] = 128;
+            }
+            else
+            {
+                memset(line + x * bpp, value, bpp);
+            }
+        }
+    }
+
+    return fmt.fmt.pix.sizeimage;
+}
+
+static unsigned long long mock_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (unsigned long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int mock_reqbufs(struct mock_device *device, int fd, struct v4l2_requestbuffers *req)
+{
+    struct v4l2_format fmt;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t total;
+
+    if (req->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || req->memory != V4L2_MEMORY_MMAP)
+    {
+        return EINVAL;
+    }
+    if (device->owner_fd >= 0 && device->owner_fd != fd)
+    {
+        return EBUSY;
+    }
+
+    mock_buffers_free(device);
+    if (!req->count)
+    {
+        return 0;
+    }
+
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (mock_g_fmt(device, &fmt) != 0)
+    {
+        return EINVAL;
+    }
+
+    req->count = req->count < MOCK_MAX_BUFFERS ? req->count : MOCK_MAX_BUFFERS;
+    device->buffer_size = (fmt.fmt.pix.sizeimage + page - 1) / page * page;
+    total = (size_t)req->count * device->buffer_size;
+
+    device->memfd = memfd_create(device->name, MFD_CLOEXEC);
+    if (device->memfd < 0 || ftruncate(device->memfd, total) != 0 ||
+        (device->memory = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, device->memfd, 0)) == MAP_FAILED)
+    {
+        device->memory = NULL;
+        mock_buffers_free(device);
+        return ENOMEM;
+    }
+    device->buffers_count = req->count;
+    device->owner_fd = fd;
+
+    return 0;
+}
+
+static int mock_buffer(struct mock_device *device, int fd, struct v4l2_buffer *buf)
+{
+    if (device->owner_fd != fd)
+    {
+        return EBUSY;
+    }
+    if (buf->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || buf->memory != V4L2_MEMORY_MMAP ||
+        buf->index >= device->buffers_count)
+    {
+        return EINVAL;
+    }
+    buf->length = device->buffer_size;
+    buf->m.offset = buf->index * device->buffer_size;
+
+    return 0;
+}
+
+static int mock_qbuf(struct mock_device *device, int fd, struct v4l2_buffer *buf)
+{
+    __u32 i;
+    int err = mock_buffer(device, fd, buf);
+
+    for (i = 0; !err && i < device->queued; i++)
+    {
+        if (device->queue[i] == buf->index)
+        {
+            err = EINVAL;
+        }
+    }
+    if (!err)
+    {
+        device->queue[device->queued++] = buf->index;
+        buf->flags = V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_QUEUED;
+    }
+
+    return err;
+}
+
+/*
+ * Blocks until the next frame is due at the first frame interval of the
+ * format, poll() on the /dev/null fd returns at once. Called locked.
+ */
+static int mock_dqbuf(struct mock_device *device, int fd, struct v4l2_buffer *buf)
+{
+    struct mock_format *format = &device->formats[0];
+    unsigned long long interval_us = 33333;
+    unsigned long long now;
+    __u32 index;
+
+    if (device->owner_fd != fd || !device->streaming)
+    {
+        return EINVAL;
+    }
+
+    if (format->intervals_count && format->intervals[0].denominator)
+    {
+        interval_us = 1000000ULL * format->intervals[0].numerator / format->intervals[0].denominator;
+    }
+    now = mock_now_us();
+    if (device->next_frame_us > now)
+    {
+        pthread_mutex_unlock(&device->lock);
+        usleep(device->next_frame_us - now);
+        pthread_mutex_lock(&device->lock);
+        if (device->owner_fd != fd || !device->streaming)
+        {
+            return EINVAL;
+        }
+        now = device->next_frame_us;
+    }
+    device->next_frame_us = now + interval_us;
+
+    // Without a queued buffer the frame is dropped, as by the hardware
+    if (!device->queued)
+    {
+        return EAGAIN;
+    }
+
+    index = device->queue[0];
+    memmove(device->queue, device->queue + 1, --device->queued * sizeof(__u32));
+
+    memset(buf, 0, sizeof(struct v4l2_buffer));
+    buf->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf->memory = V4L2_MEMORY_MMAP;
+    buf->index = index;
+    buf->length = device->buffer_size;
+    buf->m.offset = index * device->buffer_size;
+    buf->bytesused = mock_frame(device, device->memory + buf->m.offset, device->buffer_size);
+    buf->flags = V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_DONE | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+    buf->field = V4L2_FIELD_NONE;
+    buf->sequence = device->sequence++;
+    buf->timestamp.tv_sec = now / 1000000;
+    buf->timestamp.tv_usec = now % 1000000;
+
+    return 0;
+}
+
+static int mock_stream(struct mock_device *device, int fd, int *type, int on)
+{
+    if (*type != V4L2_BUF_TYPE_VIDEO_CAPTURE || device->owner_fd != fd)
+    {
+        return EINVAL;
+    }
+    if (on && !device->streaming)
+    {
+        device->next_frame_us = mock_now_us();
+    }
+    else if (!on)
+    {
+        device->queued = 0;
+    }
+    device->streaming = on;
+
+    return 0;
+}
+
+static int mock_op_of(unsigned long request)
+{
+    switch (request)
+    {
+    case VIDIOC_QUERYCAP:
+        return OP_QUERYCAP;
+    case VIDIOC_QUERYCTRL:
+        return OP_QUERYCTRL;
+    case VIDIOC_QUERYMENU:
+        return OP_QUERYMENU;
+    case VIDIOC_G_CTRL:
+        return OP_G_CTRL;
+    case VIDIOC_S_CTRL:
+        return OP_S_CTRL;
+    case VIDIOC_G_EXT_CTRLS:
+        return OP_G_EXT_CTRLS;
+    case VIDIOC_S_EXT_CTRLS:
+        return OP_S_EXT_CTRLS;
+    case VIDIOC_TRY_EXT_CTRLS:
+        return OP_TRY_EXT_CTRLS;
+    case VIDIOC_ENUM_FMT:
+        return OP_ENUM_FMT;
+    case VIDIOC_ENUM_FRAMESIZES:
+        return OP_ENUM_FRAMESIZES;
+    case VIDIOC_ENUM_FRAMEINTERVALS:
+        return OP_ENUM_FRAMEINTERVALS;
+    case VIDIOC_G_FMT:
+        return OP_G_FMT;
+    case VIDIOC_REQBUFS:
+        return OP_REQBUFS;
+    case VIDIOC_QUERYBUF:
+        return OP_QUERYBUF;
+    case VIDIOC_QBUF:
+        return OP_QBUF;
+    case VIDIOC_DQBUF:
+        return OP_DQBUF;
+    case VIDIOC_STREAMON:
+        return OP_STREAMON;
+    case VIDIOC_STREAMOFF:
+        return OP_STREAMOFF;
+    default:
+        return -1;
+    }
+}
+
+int mock_ioctl(int fd, unsigned long request, void *arg)
+{
+    struct mock_device *device = mock_device_of(fd);
+    struct mock_control *control;
+    struct v4l2_capability *cap;
+    struct v4l2_control *ctrl;
+    struct v4l2_fmtdesc *fmtdesc;
+    __s64 value;
+    int op = mock_op_of(request);
+    int err = 0;
+
+    if (!device)
+    {
+        errno = EBADF;
+        return -1;
+    }
+    if (op < 0)
+    {
+        errno = ENOTTY;
+        return -1;
+    }
+
+    // The driver round trip, outside of the lock like a sleeping driver
+    if (device->latency_us[op] > 0)
+    {
+        usleep(device->latency_us[op]);
+    }
+
+    pthread_mutex_lock(&device->lock);
+    switch (op)
+    {
+    case OP_QUERYCAP:
+        cap = (struct v4l2_capability *)arg;
+        memset(cap, 0, sizeof(struct v4l2_capability));
+        snprintf((char *)cap->driver, sizeof(cap->driver), "%s", device->driver);
+        snprintf((char *)cap->card, sizeof(cap->card), "%s", device->card);
+        snprintf((char *)cap->bus_info, sizeof(cap->bus_info), "%s", device->bus_info);
+        cap->version = KERNEL_VERSION(5, 10, 0);
+        cap->device_caps = V4L2_CAP_VIDEO_CAPTURE | V4L2_CAP_STREAMING;
+        cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+        break;
+
+    case OP_QUERYCTRL:
+        err = mock_queryctrl(device, (struct v4l2_queryctrl *)arg);
+        break;
+
+    case OP_QUERYMENU:
+        err = mock_querymenu(device, (struct v4l2_querymenu *)arg);
+        break;
+
+    case OP_G_CTRL:
+    case OP_S_CTRL:
+        ctrl = (struct v4l2_control *)arg;
+        control = mock_control_find(device, ctrl->id);
+        if (!control)
+        {
+            err = EINVAL;
+        }
+        else if (control->type == V4L2_CTRL_TYPE_CTRL_CLASS)
+        {
+            err = EACCES;
+        }
+        else if (op == OP_G_CTRL)
+        {
+            ctrl->value = (__s32)control->value;
+        }
+        else
+        {
+            value = ctrl->value;
+            if ((err = mock_control_validate(control, &value)) == 0)
+            {
+                control->value = value;
+                ctrl->value = (__s32)value;
+            }
+        }
+        break;
+
+    case OP_G_EXT_CTRLS:
+    case OP_S_EXT_CTRLS:
+    case OP_TRY_EXT_CTRLS:
+        err = mock_ext_ctrls(device, (struct v4l2_ext_controls *)arg, op);
+        break;
+
+    case OP_ENUM_FMT:
+        fmtdesc = (struct v4l2_fmtdesc *)arg;
+        if (fmtdesc->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || fmtdesc->index >= (__u32)device->formats_count)
+        {
+            err = EINVAL;
+            break;
+        }
+        fmtdesc->pixelformat = device->formats[fmtdesc->index].pixelformat;
+        fmtdesc->flags = fmtdesc->pixelformat == V4L2_PIX_FMT_YUYV ? 0 : V4L2_FMT_FLAG_COMPRESSED;
+        snprintf((char *)fmtdesc->description, sizeof(fmtdesc->description), "%s",
+                 device->formats[fmtdesc->index].description);
+        break;
+
+    case OP_ENUM_FRAMESIZES:
+        err = mock_enum_framesizes(device, (struct v4l2_frmsizeenum *)arg);
+        break;
+
+    case OP_ENUM_FRAMEINTERVALS:
+        err = mock_enum_frameintervals(device, (struct v4l2_frmivalenum *)arg);
+        break;
+
+    case OP_G_FMT:
+        err = mock_g_fmt(device, (struct v4l2_format *)arg);
+        break;
+
+    case OP_REQBUFS:
+        err = mock_reqbufs(device, fd, (struct v4l2_requestbuffers *)arg);
+        break;
+
+    case OP_QUERYBUF:
+        err = mock_buffer(device, fd, (struct v4l2_buffer *)arg);
+        break;
+
+    case OP_QBUF:
+        err = mock_qbuf(device, fd, (struct v4l2_buffer *)arg);
+        break;
+
+    case OP_DQBUF:
+        err = mock_dqbuf(device, fd, (struct v4l2_buffer *)arg);
+        break;
+
+    case OP_STREAMON:
+    case OP_STREAMOFF:
+        err = mock_stream(device, fd, (int *)arg, op == OP_STREAMON);
+        break;
+    }
+    pthread_mutex_unlock(&device->lock);
+
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+/*
+ * video-control-rest
+ *
+ * Simulated V4L2 devices for benchmarking and testing without cameras.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef V4L2_MOCK_H
+#define V4L2_MOCK_H
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// Loads the JSON device description from file, "default" selects the
+// built-in one. Returns 0 on success.
+int mock_init(const char *config);
+void mock_free(void);
+int mock_enabled(void);
+
+int mock_count(void);
+const char *mock_name(int index);
+
+// Same contracts as open(), ioctl(), close(), stat() and fstat(), errors
+// are returned as -1 with errno set
+int mock_open(const char *device_name);
+int mock_ioctl(int fd, unsigned long request, void *arg);
+int mock_close(int fd);
+int mock_stat(const char *device_name, struct stat *st);
+int mock_fstat(int fd, struct stat *st);
+
+// mmap() of a buffer from VIDIOC_QUERYBUF, released with munmap()
+void *mock_mmap(size_t length, int prot, int flags, int fd, off_t offset);
+
+#endif